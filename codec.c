@@ -1,153 +1,430 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <opus.h>
 
 #include "types.h"
+#include "util.h"
 #include "codec.h"
 
-/* Codec bitrate in bps */
+/* Default codec bitrate in bps */
 #define BITRATE  (8000)
 
+/* Longest packet Opus can carry in millisec. */
+#define CODEC_MAX_DURATION  (120)
+
 /* Local structures */
 typedef struct
 {
-  void   *encoder;
-  void   *decoder;
-  uint32  frame_size;
-  uint32  packet_size;
+  void           *encoder;
+  uint8           channels;
+  uint32          rate;
+  uint32          frame_size;
+  uint32          packet_size;
+  uint32          delay;
+  int32           fec_loss;
+  int32           bitrate;
+  uint8           max_frames;
+  uint8          *frame_packet;
+  void           *repacketizer;
 } codec_t;
 
-/* File scope global variables */
-static codec_t codec =
+typedef struct
+{
+  void           *decoder;
+  uint32          frame_size;
+  uint32          packet_size;
+  uint8           max_frames;
+  codec_stats_t   stats;
+} codec_decoder_t;
+
+/* File scope global variables, settings for codecs created from now on */
+static struct
 {
-  .encoder     = NULL,
-  .decoder     = NULL,
-  .frame_size  = 0,
-  .packet_size = 0
+  int32  fec_loss;
+  int32  bitrate;
+} codec_options =
+{
+  .fec_loss = 0,
+  .bitrate  = BITRATE
 };
 
+/* Frame durations in millisec. and sampling rates Opus encodes (its 2.5 ms
+ * frames can't be asked for in whole millisec.) */
+static const uint32 codec_durations[] = {5, 10, 20, 40, 60};
+static const uint32 codec_rates[] = {8000, 12000, 16000, 24000, 48000};
+
 
-uint32 codec_packetsize (void)
+/* Takes effect on the next codec_create */
+void codec_option (int32 option, int32 value)
 {
-  return codec.packet_size;
+  if (option == CODEC_OPTION_FEC)
+  {
+    /* Expected packet loss in percent, 0 turns in-band FEC off */
+    codec_options.fec_loss = (value < 0) ? 0 : ((value > 100) ? 100 : value);
+  }
+  else if (option == CODEC_OPTION_BITRATE)
+  {
+    /* In bps, the encoder refuses what Opus can't do */
+    codec_options.bitrate = value;
+  }
 }
 
-int32 codec_encode (int16 *audio_buffer, uint8 *codec_buffer, uint8 frames)
+static int32 codec_supported (uint8 channels, uint32 frame_duration, uint32 rate)
 {
-  int32 status;
+  int32 duration_ok = 0;
+  int32 rate_ok = 0;
+  uint32 index;
+
+  for (index = 0; index < (sizeof (codec_durations)/sizeof (codec_durations[0])); index++)
+  {
+    duration_ok |= (frame_duration == codec_durations[index]);
+  }
+
+  for (index = 0; index < (sizeof (codec_rates)/sizeof (codec_rates[0])); index++)
+  {
+    rate_ok |= (rate == codec_rates[index]);
+  }
+
+  if (!duration_ok)
+  {
+    printf ("Opus frames are 5, 10, 20, 40 or 60 ms, not %u ms\n", frame_duration);
+  }
+
+  if (!rate_ok)
+  {
+    printf ("Opus rates are 8, 12, 16, 24 or 48 kHz, not %u Hz\n", rate);
+  }
+
+  if ((channels < 1) || (channels > 2))
+  {
+    printf ("Opus takes 1 or 2 channels, not %u\n", channels);
+  }
+
+  return (duration_ok && rate_ok && (channels >= 1) && (channels <= 2));
+}
 
-  if ((status = opus_encode (codec.encoder, audio_buffer, codec.frame_size,
-                             codec_buffer, 1000)) <= 0)
+/* Frames of a CBR stream share one size, so a multi-frame packet needs the
+ * TOC byte, the frame count byte and the frames without their own TOC */
+static uint32 codec_packed_size (uint32 packet_size, uint8 max_frames, uint8 frames)
+{
+  uint32 size = 0;
+
+  if (frames == 1)
+  {
+    size = packet_size;
+  }
+  else if ((frames > 1) && (frames <= max_frames))
   {
-    printf ("Encode error: %d\n", status);
+    size = 2 + (frames * (packet_size - 1));
+  }
+
+  return (size <= CODEC_MAX_PACKET) ? size : 0;
+}
+
+/* Bytes in a packet of that many frames, 0 when it would not fit an Opus packet */
+uint32 codec_packetsize (void *handle, uint8 frames)
+{
+  codec_t *codec = handle;
+
+  return codec_packed_size (codec->packet_size, codec->max_frames, frames);
+}
+
+uint32 codec_delay (void *handle)
+{
+  codec_t *codec = handle;
+
+  return codec->delay;
+}
+
+/* Frames are encoded one by one and joined into a single packet */
+int32 codec_encode (void *handle, int16 *audio_buffer, uint8 *codec_buffer, uint8 frames)
+{
+  codec_t *codec = handle;
+  uint32 size = codec_packed_size (codec->packet_size, codec->max_frames, frames);
+  int32 status = (size > 0) ? 1 : OPUS_BAD_ARG;
+  uint8 frame;
+
+  if (frames == 1)
+  {
+    status = opus_encode (codec->encoder, audio_buffer, codec->frame_size,
+                          codec_buffer, codec->packet_size);
+  }
+  else if (status > 0)
+  {
+    opus_repacketizer_init (codec->repacketizer);
+  }
+
+  for (frame = 0; ((frames > 1) && (status > 0) && (frame < frames)); frame++)
+  {
+    uint8 *packet = &(codec->frame_packet[frame * codec->packet_size]);
+
+    /* Fails if the encoder switched mode or bandwidth inside the packet */
+    if (((status = opus_encode (codec->encoder,
+                                &(audio_buffer[frame * codec->frame_size * codec->channels]),
+                                codec->frame_size, packet, codec->packet_size)) > 0) &&
+        ((status = opus_repacketizer_cat (codec->repacketizer, packet, status)) == OPUS_OK))
+    {
+      status = 1;
+    }
+  }
+
+  /* Padding keeps the size fixed should a frame have come out short */
+  if ((frames > 1) && (status > 0) &&
+      ((status = opus_repacketizer_out (codec->repacketizer, codec_buffer, size)) > 0) &&
+      ((status = opus_packet_pad (codec_buffer, status, size)) == OPUS_OK))
+  {
+    status = size;
+  }
+
+  if (status <= 0)
+  {
+    LOG (LOG_MODULE_CODEC, LOG_ERROR, "Encode error: %d\n", status);
     status = -1;
   }
 
   return status;
 }
 
-int32 codec_decode (uint8 *codec_buffer, int16 *audio_buffer, uint8 frames)
+int32 codec_decode (void *handle, uint8 *codec_buffer, int16 *audio_buffer, uint8 frames)
 {
+  codec_decoder_t *decoder = handle;
   int32 status;
 
-  if ((status = opus_decode (codec.decoder, codec_buffer, codec.packet_size,
-                             audio_buffer, codec.frame_size, 0)) <= 0)
+  /* One call splits a multi-frame packet, or conceals all of its frames */
+  if ((status = opus_decode (decoder->decoder, codec_buffer,
+                             codec_packed_size (decoder->packet_size, decoder->max_frames, frames),
+                             audio_buffer, frames * decoder->frame_size, 0)) <= 0)
   {
-    printf ("Decode error: %d\n", status);
+    LOG (LOG_MODULE_CODEC, LOG_ERROR, "Decode error: %d\n", status);
     status = -1;
   }
+  else if (codec_buffer != NULL)
+  {
+    decoder->stats.decoded += frames;
+  }
+  else
+  {
+    decoder->stats.concealed += frames;
+  }
 
   return status;
 }
 
-int32 codec_init (uint8 channels, uint32 frame_duration, uint32 rate)
+/* Rebuilds a lost packet from the redundancy carried in the packet after it;
+ * that covers its last frame, Opus conceals the ones before */
+int32 codec_recover (void *handle, uint8 *codec_buffer, int16 *audio_buffer, uint8 frames)
 {
+  codec_decoder_t *decoder = handle;
   int32 status;
 
-  codec.encoder = opus_encoder_create (rate, channels,
-                                       OPUS_APPLICATION_VOIP, &status);
-  if (status != OPUS_OK)
+  if ((status = opus_decode (decoder->decoder, codec_buffer,
+                             codec_packed_size (decoder->packet_size, decoder->max_frames, frames),
+                             audio_buffer, frames * decoder->frame_size, 1)) <= 0)
+  {
+    LOG (LOG_MODULE_CODEC, LOG_ERROR, "FEC decode error: %d\n", status);
+    status = -1;
+  }
+  else
   {
-    printf ("Unable to create encoder\n");
+    decoder->stats.recovered++;
+    decoder->stats.concealed += frames - 1;
+  }
+
+  return status;
+}
+
+void codec_stats (void *handle, codec_stats_t *stats)
+{
+  codec_decoder_t *decoder = handle;
+
+  *stats = decoder->stats;
+}
+
+/* Encoder and stream format, one per radio channel */
+int32 codec_create (uint8 channels, uint32 frame_duration, uint32 rate, void **handle)
+{
+  int32 status = OPUS_ALLOC_FAIL;
+  codec_t *codec = calloc (1, sizeof (codec_t));
+
+  if (!(codec_supported (channels, frame_duration, rate)))
+  {
+    status = OPUS_BAD_ARG;
+  }
+  else if (codec != NULL)
+  {
+    codec->fec_loss = codec_options.fec_loss;
+    codec->bitrate  = codec_options.bitrate;
+    codec->encoder  = opus_encoder_create (rate, channels,
+                                           OPUS_APPLICATION_VOIP, &status);
+    if (status != OPUS_OK)
+    {
+      printf ("Unable to create encoder\n");
+    }
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
+      ((status = opus_encoder_ctl (codec->encoder,
                                    OPUS_SET_FORCE_CHANNELS (channels))) != OPUS_OK))
   {
     printf ("Unable to set encoder channels\n");
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
+      ((status = opus_encoder_ctl (codec->encoder,
                                    OPUS_SET_BANDWIDTH (OPUS_AUTO))) != OPUS_OK))
   {
     printf ("Unable to set encoder bandwidth\n");
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
+      ((status = opus_encoder_ctl (codec->encoder,
                                    OPUS_SET_SIGNAL (OPUS_AUTO))) != OPUS_OK))
   {
     printf ("Unable to set encoder bandwidth\n");
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
-                                   OPUS_SET_INBAND_FEC (0))) != OPUS_OK))
+      ((status = opus_encoder_ctl (codec->encoder,
+                                   OPUS_SET_INBAND_FEC (codec->fec_loss > 0))) != OPUS_OK))
   {
     printf ("Unable to set encoder FEC\n");
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
+      ((status = opus_encoder_ctl (codec->encoder,
+                                   OPUS_SET_PACKET_LOSS_PERC (codec->fec_loss))) != OPUS_OK))
+  {
+    printf ("Unable to set encoder packet loss\n");
+  }
+
+  if ((status == OPUS_OK) &&
+      ((status = opus_encoder_ctl (codec->encoder,
                                    OPUS_SET_VBR (0))) != OPUS_OK))
   {
     printf ("Unable to set encoder CBR\n");
   }
 
   if ((status == OPUS_OK) &&
-      ((status = opus_encoder_ctl (codec.encoder,
-                                   OPUS_SET_BITRATE (BITRATE))) != OPUS_OK))
+      ((status = opus_encoder_ctl (codec->encoder,
+                                   OPUS_SET_BITRATE (codec->bitrate))) != OPUS_OK))
   {
     printf ("Unable to set encoder bitrate\n");
   }
 
-  codec.decoder = opus_decoder_create (rate, channels, &status);
-  if (status != OPUS_OK)
+  if (status == OPUS_OK)
   {
-    printf ("Unable to create decoder\n");
+    opus_int32 lookahead = 0;
+
+    /* Encoder lookahead adds to the frame accumulation delay */
+    if ((opus_encoder_ctl (codec->encoder, OPUS_GET_LOOKAHEAD (&lookahead))) == OPUS_OK)
+    {
+      codec->delay = (lookahead * 1000)/rate;
+    }
+  }
+
+  if ((status == OPUS_OK) &&
+      (((((codec->bitrate * frame_duration)/1000) + 7)/8) > CODEC_MAX_PACKET))
+  {
+    printf ("Bitrate too high for %u ms frames\n", frame_duration);
+    status = OPUS_BAD_ARG;
+  }
+
+  if (status == OPUS_OK)
+  {
+    codec->channels    = channels;
+    codec->rate        = rate;
+    codec->frame_size  = (rate * frame_duration)/1000;
+    codec->packet_size = (((codec->bitrate * frame_duration)/1000) + 7)/8;
+    codec->max_frames  = CODEC_MAX_DURATION/frame_duration;
+
+    /* Room for each frame's own packet before they are joined */
+    codec->frame_packet = malloc (codec->max_frames * codec->packet_size);
+    codec->repacketizer = opus_repacketizer_create ();
+    status = ((codec->frame_packet != NULL) && (codec->repacketizer != NULL))
+             ? OPUS_OK : OPUS_ALLOC_FAIL;
   }
 
   if (status == OPUS_OK)
   {
-    codec.frame_size  = (rate * frame_duration)/1000;
-    codec.packet_size = (((BITRATE * frame_duration)/1000) + 7)/8;
+    *handle = codec;
     status = 1;
   }
   else
   {
-    codec_deinit ();
+    codec_destroy (codec);
+    status = -1;
   }
 
   return status;
 }
 
-int32 codec_deinit (void)
+int32 codec_destroy (void *handle)
 {
-  if (codec.encoder != NULL)
+  codec_t *codec = handle;
+
+  if (codec != NULL)
   {
-    opus_encoder_destroy (codec.encoder);
-    codec.encoder = NULL;
+    if (codec->encoder != NULL)
+    {
+      opus_encoder_destroy (codec->encoder);
+    }
+
+    if (codec->repacketizer != NULL)
+    {
+      opus_repacketizer_destroy (codec->repacketizer);
+    }
+
+    free (codec->frame_packet);
+    free (codec);
   }
 
-  if (codec.decoder != NULL)
+  return 1;
+}
+
+/* Decoder for one remote talker, in the format of the given codec */
+int32 codec_decoder_create (void *codec_handle, void **handle)
+{
+  codec_t *codec = codec_handle;
+  int32 status = OPUS_ALLOC_FAIL;
+  codec_decoder_t *decoder = calloc (1, sizeof (codec_decoder_t));
+
+  if (decoder != NULL)
   {
-    opus_decoder_destroy (codec.decoder);
-    codec.decoder = NULL;
+    decoder->decoder = opus_decoder_create (codec->rate, codec->channels, &status);
   }
 
-  codec.frame_size = 0;
+  if (status == OPUS_OK)
+  {
+    decoder->frame_size  = codec->frame_size;
+    decoder->packet_size = codec->packet_size;
+    decoder->max_frames  = codec->max_frames;
+    *handle = decoder;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to create decoder\n");
+    codec_decoder_destroy (decoder);
+    status = -1;
+  }
+
+  return status;
+}
+
+int32 codec_decoder_destroy (void *handle)
+{
+  codec_decoder_t *decoder = handle;
+
+  if (decoder != NULL)
+  {
+    if (decoder->decoder != NULL)
+    {
+      opus_decoder_destroy (decoder->decoder);
+    }
+
+    free (decoder);
+  }
 
   return 1;
 }
@@ -3,15 +3,46 @@
 
 #include "types.h"
 
-extern uint32 codec_packetsize (void);
+/* Largest packet the encoder is allowed to produce */
+#define CODEC_MAX_PACKET  (1000)
 
-extern int32 codec_init (uint8 channels, uint32 frame_duration, uint32 rate);
+enum
+{
+  CODEC_OPTION_FEC,
+  CODEC_OPTION_BITRATE,
+  NUM_CODEC_OPTIONS
+};
 
-extern int32 codec_deinit (void);
+/* Decoder outcome counts since it was created, in frames; FEC rebuilds only the
+ * last frame of a lost packet, the ones before it count as concealed */
+typedef struct
+{
+  uint32  decoded;
+  uint32  recovered;
+  uint32  concealed;
+} codec_stats_t;
 
-extern int32 codec_encode (int16 *audio_buffer, uint8 *codec_buffer, uint8 frames);
+extern void codec_option (int32 option, int32 value);
 
-extern int32 codec_decode (uint8 *codec_buffer, int16 *audio_buffer, uint8 frames);
+extern int32 codec_create (uint8 channels, uint32 frame_duration, uint32 rate, void **handle);
+
+extern int32 codec_destroy (void *handle);
+
+extern uint32 codec_packetsize (void *handle, uint8 frames);
+
+extern uint32 codec_delay (void *handle);
+
+extern int32 codec_encode (void *handle, int16 *audio_buffer, uint8 *codec_buffer, uint8 frames);
+
+extern int32 codec_decoder_create (void *codec, void **handle);
+
+extern int32 codec_decoder_destroy (void *handle);
+
+extern int32 codec_decode (void *handle, uint8 *codec_buffer, int16 *audio_buffer, uint8 frames);
+
+extern int32 codec_recover (void *handle, uint8 *codec_buffer, int16 *audio_buffer, uint8 frames);
+
+extern void codec_stats (void *handle, codec_stats_t *stats);
 
 #endif
 
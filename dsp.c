@@ -0,0 +1,603 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "types.h"
+#include "util.h"
+#include "dsp.h"
+
+/* Channels processed, and samples per channel per call (120 ms at 48 kHz) */
+#define DSP_MAX_CHANNELS     (2)
+#define DSP_MAX_SAMPLES      (5760)
+
+/* High-pass corner in Hz, removes DC and handling rumble */
+#define DSP_HIGHPASS_CORNER  (100.0)
+
+/* Noise suppression analysis window in millisec., rounded up to a power
+ * of two FFT size; windows overlap by half */
+#define DSP_NOISE_WINDOW     (16)
+#define DSP_MAX_FFT          (1024)
+
+/* Per bin power smoothing; the noise floor follows bins within 5 dB of it
+ * and creeps up about 3 dB/s under speech */
+#define DSP_NOISE_SMOOTH     (0.3f)
+#define DSP_NOISE_SPEECH     (3.0f)
+#define DSP_NOISE_ADAPT      (0.1f)
+#define DSP_NOISE_RISE       (1.005f)
+
+/* Over-subtraction factor and gain floor (-20 dB) against musical noise */
+#define DSP_NOISE_OVER       (2.0f)
+#define DSP_NOISE_FLOOR      (0.1f)
+
+/* AGC works on 10 ms blocks towards -20 dBFS RMS, at most +20 dB */
+#define DSP_AGC_BLOCK        (10)
+#define DSP_AGC_TARGET       (3277.0f)
+#define DSP_AGC_MAX_GAIN     (10.0f)
+#define DSP_AGC_MIN_GAIN     (0.1f)
+
+/* Blocks quieter than -50 dBFS RMS hold the gain instead of pulling up noise */
+#define DSP_AGC_GATE         (104.0f)
+
+/* Per block gain smoothing, fast when loud, slow to recover */
+#define DSP_AGC_ATTACK       (0.5f)
+#define DSP_AGC_RELEASE      (0.05f)
+
+/* Limiter ceiling, about -1 dBFS peak */
+#define DSP_LIMIT            (29204.0f)
+
+/* Local structures */
+typedef struct
+{
+  float   highpass[2];
+  float   input[DSP_MAX_FFT];
+  float   queue[DSP_MAX_FFT/2];
+  float   overlap[DSP_MAX_FFT/2];
+  float   power[(DSP_MAX_FFT/2) + 1];
+  float   noise[(DSP_MAX_FFT/2) + 1];
+  float   gain[(DSP_MAX_FFT/2) + 1];
+  uint32  position;
+  int32   primed;
+} dsp_channel_t;
+
+typedef struct
+{
+  int32          enabled[NUM_DSP_STAGES];
+  uint8          channels;
+  uint32         rate;
+  uint32         samples;
+  uint32         block;
+  float          coef[5];
+  uint32         fft_size;
+  float          window[DSP_MAX_FFT];
+  float          cosine[DSP_MAX_FFT/2];
+  float          sine[DSP_MAX_FFT/2];
+  uint16         reverse[DSP_MAX_FFT];
+  float          agc_gain;
+  float          agc_applied;
+  dsp_channel_t  channel[DSP_MAX_CHANNELS];
+  float          work[DSP_MAX_CHANNELS][DSP_MAX_SAMPLES];
+  uint32         frames;
+  unsigned long long cost[NUM_DSP_STAGES + 1];
+} dsp_t;
+
+/* File scope global variables */
+static dsp_t dsp =
+{
+  .enabled =
+    {
+      [DSP_STAGE_HIGHPASS] = 1,
+      [DSP_STAGE_NOISE]    = 1,
+      [DSP_STAGE_AGC]      = 1
+    },
+  .channels    = 0,
+  .rate        = 0,
+  .samples     = 0,
+  .fft_size    = 0,
+  .agc_gain    = 1.0f,
+  .agc_applied = 1.0f,
+  .frames      = 0
+};
+
+
+/* Thread CPU time in nanosec., what the stage really costs on this core */
+static inline unsigned long long dsp_clock (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &now);
+
+  return ((unsigned long long)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/* Direct form II transposed biquad, recursive so it stays scalar */
+static void dsp_highpass (dsp_channel_t *channel, float *sample, uint32 count)
+{
+  float z1 = channel->highpass[0];
+  float z2 = channel->highpass[1];
+  uint32 index;
+
+  for (index = 0; index < count; index++)
+  {
+    float in = sample[index];
+    float out = (dsp.coef[0] * in) + z1;
+
+    z1 = (dsp.coef[1] * in) - (dsp.coef[3] * out) + z2;
+    z2 = (dsp.coef[2] * in) - (dsp.coef[4] * out);
+    sample[index] = out;
+  }
+
+  channel->highpass[0] = z1;
+  channel->highpass[1] = z2;
+}
+
+/* In place radix-2 complex FFT, the inverse is left unscaled */
+static void dsp_fft (float *real, float *imag, int32 inverse)
+{
+  uint32 size = dsp.fft_size;
+  uint32 span;
+  uint32 index;
+
+  for (index = 0; index < size; index++)
+  {
+    uint32 swap = dsp.reverse[index];
+
+    if (swap > index)
+    {
+      float temp;
+
+      temp = real[index]; real[index] = real[swap]; real[swap] = temp;
+      temp = imag[index]; imag[index] = imag[swap]; imag[swap] = temp;
+    }
+  }
+
+  for (span = 1; span < size; span <<= 1)
+  {
+    uint32 step = size/(span << 1);
+    uint32 start;
+
+    for (start = 0; start < size; start += (span << 1))
+    {
+      uint32 count;
+
+      for (count = 0; count < span; count++)
+      {
+        float cosine = dsp.cosine[count * step];
+        float sine = inverse ? dsp.sine[count * step] : -dsp.sine[count * step];
+        uint32 top = start + count;
+        uint32 bottom = top + span;
+        float real_part = (real[bottom] * cosine) - (imag[bottom] * sine);
+        float imag_part = (real[bottom] * sine) + (imag[bottom] * cosine);
+
+        real[bottom] = real[top] - real_part;
+        imag[bottom] = imag[top] - imag_part;
+        real[top]   += real_part;
+        imag[top]   += imag_part;
+      }
+    }
+  }
+}
+
+/* Per bin Wiener style gain from the tracked noise floor, branch free so
+ * the compiler vectorizes it */
+static void dsp_noise_gain (dsp_channel_t *channel, const float * __restrict real,
+                            const float * __restrict imag, uint32 bins)
+{
+  float * __restrict power = channel->power;
+  float * __restrict noise = channel->noise;
+  float * __restrict gain = channel->gain;
+  uint32 bin;
+
+  /* Seed the floor high from the first block, it settles down in a few
+   * blocks where rising to it would take seconds */
+  if (!(channel->primed))
+  {
+    float seed = 1.0f;
+
+    for (bin = 0; bin < bins; bin++)
+    {
+      float current = (real[bin] * real[bin]) + (imag[bin] * imag[bin]);
+
+      seed = (current > seed) ? current : seed;
+    }
+
+    for (bin = 0; bin < bins; bin++)
+    {
+      power[bin] = seed;
+      noise[bin] = seed;
+    }
+
+    channel->primed = 1;
+  }
+
+  for (bin = 0; bin < bins; bin++)
+  {
+    float current = (real[bin] * real[bin]) + (imag[bin] * imag[bin]);
+    float target;
+
+    power[bin] += DSP_NOISE_SMOOTH * (current - power[bin]);
+    noise[bin]  = (power[bin] < (DSP_NOISE_SPEECH * noise[bin])) ?
+                  (noise[bin] + (DSP_NOISE_ADAPT * (power[bin] - noise[bin]))) :
+                  (noise[bin] * DSP_NOISE_RISE);
+
+    target = 1.0f - ((DSP_NOISE_OVER * noise[bin])/(power[bin] + 1.0f));
+    target = (target > DSP_NOISE_FLOOR) ? target : DSP_NOISE_FLOOR;
+
+    /* Open at once on speech, close over a few blocks */
+    gain[bin] = (target > gain[bin]) ? target : (0.5f * (gain[bin] + target));
+  }
+}
+
+/* One hop of the overlap-add analysis/synthesis */
+static void dsp_noise_block (dsp_channel_t *channel)
+{
+  float real[DSP_MAX_FFT];
+  float imag[DSP_MAX_FFT];
+  uint32 size = dsp.fft_size;
+  uint32 half = size/2;
+  uint32 index;
+
+  for (index = 0; index < size; index++)
+  {
+    real[index] = channel->input[index] * dsp.window[index];
+    imag[index] = 0.0f;
+  }
+
+  dsp_fft (real, imag, 0);
+  dsp_noise_gain (channel, real, imag, half + 1);
+
+  /* Real input, mirror the gains onto the negative frequencies */
+  for (index = 0; index <= half; index++)
+  {
+    real[index] *= channel->gain[index];
+    imag[index] *= channel->gain[index];
+  }
+  for (index = half + 1; index < size; index++)
+  {
+    real[index] *= channel->gain[size - index];
+    imag[index] *= channel->gain[size - index];
+  }
+
+  dsp_fft (real, imag, 1);
+
+  /* Synthesis window carries the 1/N of the inverse transform */
+  for (index = 0; index < half; index++)
+  {
+    channel->queue[index]   = channel->overlap[index] + (real[index] * dsp.window[index]);
+    channel->overlap[index] = real[half + index] * dsp.window[half + index];
+  }
+
+  memcpy (channel->input, &(channel->input[half]), half * sizeof (float));
+}
+
+/* Streams through the analysis buffer, output lags input by one FFT size */
+static void dsp_noise (dsp_channel_t *channel, float *sample, uint32 count)
+{
+  uint32 half = dsp.fft_size/2;
+  uint32 index;
+
+  for (index = 0; index < count; index++)
+  {
+    float out = channel->queue[channel->position];
+
+    channel->input[half + channel->position] = sample[index];
+    sample[index] = out;
+
+    if ((++(channel->position)) == half)
+    {
+      dsp_noise_block (channel);
+      channel->position = 0;
+    }
+  }
+}
+
+static inline float dsp_rms (const float * __restrict sample, uint32 count)
+{
+  float sum = 0.0f;
+  uint32 index;
+
+  for (index = 0; index < count; index++)
+  {
+    sum += sample[index] * sample[index];
+  }
+
+  return sum/count;
+}
+
+static inline float dsp_peak (const float * __restrict sample, uint32 count)
+{
+  float peak = 0.0f;
+  uint32 index;
+
+  for (index = 0; index < count; index++)
+  {
+    float level = fabsf (sample[index]);
+
+    peak = (level > peak) ? level : peak;
+  }
+
+  return peak;
+}
+
+/* Linked gain across channels, ramped over each block to avoid zipper noise */
+static void dsp_agc (uint32 count)
+{
+  uint32 start;
+
+  for (start = 0; start < count; start += dsp.block)
+  {
+    uint32 length = ((count - start) < dsp.block) ? (count - start) : dsp.block;
+    float energy = 0.0f;
+    float peak = 0.0f;
+    float applied;
+    float step;
+    uint32 channel;
+
+    for (channel = 0; channel < dsp.channels; channel++)
+    {
+      float level = dsp_peak (&(dsp.work[channel][start]), length);
+
+      energy += dsp_rms (&(dsp.work[channel][start]), length);
+      peak    = (level > peak) ? level : peak;
+    }
+
+    energy = sqrtf (energy/dsp.channels);
+
+    if (energy > DSP_AGC_GATE)
+    {
+      float desired = DSP_AGC_TARGET/energy;
+
+      desired = (desired < DSP_AGC_MAX_GAIN) ? desired : DSP_AGC_MAX_GAIN;
+      desired = (desired > DSP_AGC_MIN_GAIN) ? desired : DSP_AGC_MIN_GAIN;
+      dsp.agc_gain += (desired - dsp.agc_gain)
+                      * ((desired < dsp.agc_gain) ? DSP_AGC_ATTACK : DSP_AGC_RELEASE);
+    }
+
+    /* Limiter, the whole block is known so no lookahead is needed */
+    applied = dsp.agc_gain;
+    if ((peak * applied) > DSP_LIMIT)
+    {
+      applied = DSP_LIMIT/peak;
+    }
+
+    /* Ramping down from the last block's gain would let a transient at the start
+     * through above the limit, the limiter gain applies at once then */
+    if ((applied < dsp.agc_applied) && ((peak * dsp.agc_applied) > DSP_LIMIT))
+    {
+      dsp.agc_applied = applied;
+    }
+
+    step = (applied - dsp.agc_applied)/length;
+
+    for (channel = 0; channel < dsp.channels; channel++)
+    {
+      float * __restrict sample = &(dsp.work[channel][start]);
+      float gain = dsp.agc_applied;
+      uint32 index;
+
+      for (index = 0; index < length; index++)
+      {
+        gain += step;
+        sample[index] *= gain;
+      }
+    }
+
+    dsp.agc_applied = applied;
+  }
+}
+
+static void dsp_to_float (const int16 *audio_buffer, uint32 count)
+{
+  uint32 channel;
+  uint32 index;
+
+  for (channel = 0; channel < dsp.channels; channel++)
+  {
+    float * __restrict sample = dsp.work[channel];
+
+    for (index = 0; index < count; index++)
+    {
+      sample[index] = (float)audio_buffer[(index * dsp.channels) + channel];
+    }
+  }
+}
+
+static void dsp_from_float (int16 *audio_buffer, uint32 count)
+{
+  uint32 channel;
+  uint32 index;
+
+  for (channel = 0; channel < dsp.channels; channel++)
+  {
+    const float * __restrict sample = dsp.work[channel];
+
+    for (index = 0; index < count; index++)
+    {
+      float value = sample[index];
+
+      value = (value < 32767.0f) ? value : 32767.0f;
+      value = (value > -32768.0f) ? value : -32768.0f;
+      audio_buffer[(index * dsp.channels) + channel] = (int16)lrintf (value);
+    }
+  }
+}
+
+/* Takes effect on the next dsp_init */
+void dsp_option (int32 stage, int32 enable)
+{
+  if ((stage >= 0) && (stage < NUM_DSP_STAGES))
+  {
+    dsp.enabled[stage] = enable;
+  }
+}
+
+int32 dsp_init (uint8 channels, uint32 frame_duration, uint32 rate)
+{
+  int32 status = -1;
+  uint32 samples = (rate * frame_duration)/1000;
+  uint32 size = 1;
+  uint32 bits = 0;
+
+  while ((size * 1000) < (rate * DSP_NOISE_WINDOW))
+  {
+    size <<= 1;
+    bits++;
+  }
+
+  if ((channels > 0) && (channels <= DSP_MAX_CHANNELS) &&
+      (samples > 0) && (samples <= DSP_MAX_SAMPLES) && (size <= DSP_MAX_FFT))
+  {
+    double corner = (2.0 * M_PI * DSP_HIGHPASS_CORNER)/rate;
+    double alpha = sin (corner)/(2.0 * M_SQRT1_2);
+    double norm = 1.0 + alpha;
+    uint32 index;
+    uint32 channel;
+
+    dsp.channels    = channels;
+    dsp.rate        = rate;
+    dsp.samples     = samples;
+    dsp.block       = (rate * DSP_AGC_BLOCK)/1000;
+    dsp.fft_size    = size;
+    dsp.agc_gain    = 1.0f;
+    dsp.agc_applied = 1.0f;
+    dsp.frames      = 0;
+    memset (dsp.cost, 0, sizeof (dsp.cost));
+
+    /* Butterworth high-pass, coefficients b0 b1 b2 a1 a2 */
+    dsp.coef[0] = (float)(((1.0 + cos (corner))/2.0)/norm);
+    dsp.coef[1] = (float)(-(1.0 + cos (corner))/norm);
+    dsp.coef[2] = dsp.coef[0];
+    dsp.coef[3] = (float)((-2.0 * cos (corner))/norm);
+    dsp.coef[4] = (float)((1.0 - alpha)/norm);
+
+    /* Periodic sqrt-Hann, its square overlap-adds to one at half overlap */
+    for (index = 0; index < size; index++)
+    {
+      uint32 bit;
+
+      dsp.window[index] = (float)sqrt ((0.5 - (0.5 * cos ((2.0 * M_PI * index)/size)))/size);
+      dsp.reverse[index] = 0;
+      for (bit = 0; bit < bits; bit++)
+      {
+        dsp.reverse[index] |= ((index >> bit) & 0x1) << (bits - 1 - bit);
+      }
+    }
+
+    for (index = 0; index < (size/2); index++)
+    {
+      dsp.cosine[index] = (float)cos ((2.0 * M_PI * index)/size);
+      dsp.sine[index]   = (float)sin ((2.0 * M_PI * index)/size);
+    }
+
+    for (channel = 0; channel < DSP_MAX_CHANNELS; channel++)
+    {
+      dsp_channel_t *state = &(dsp.channel[channel]);
+
+      memset (state, 0, sizeof (dsp_channel_t));
+      for (index = 0; index <= (size/2); index++)
+      {
+        state->gain[index] = 1.0f;
+      }
+    }
+
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set up voice DSP\n");
+  }
+
+  return status;
+}
+
+int32 dsp_deinit (void)
+{
+  dsp.channels = 0;
+  dsp.samples  = 0;
+
+  return 1;
+}
+
+/* Added delay in millisec., the overlap-add window of noise suppression */
+uint32 dsp_delay (void)
+{
+  return (dsp.enabled[DSP_STAGE_NOISE] && (dsp.rate > 0)) ?
+         ((dsp.fft_size * 1000)/dsp.rate) : 0;
+}
+
+int32 dsp_process (int16 *audio_buffer, uint8 frames)
+{
+  uint32 count = dsp.samples * frames;
+  unsigned long long start;
+  unsigned long long stop;
+  uint32 channel;
+
+  if ((count == 0) || (count > DSP_MAX_SAMPLES))
+  {
+    return -1;
+  }
+
+  start = dsp_clock ();
+  dsp_to_float (audio_buffer, count);
+
+  stop = dsp_clock ();
+  dsp.cost[NUM_DSP_STAGES] += stop - start;
+  start = stop;
+
+  if (dsp.enabled[DSP_STAGE_HIGHPASS])
+  {
+    for (channel = 0; channel < dsp.channels; channel++)
+    {
+      dsp_highpass (&(dsp.channel[channel]), dsp.work[channel], count);
+    }
+
+    stop = dsp_clock ();
+    dsp.cost[DSP_STAGE_HIGHPASS] += stop - start;
+    start = stop;
+  }
+
+  if (dsp.enabled[DSP_STAGE_NOISE])
+  {
+    for (channel = 0; channel < dsp.channels; channel++)
+    {
+      dsp_noise (&(dsp.channel[channel]), dsp.work[channel], count);
+    }
+
+    stop = dsp_clock ();
+    dsp.cost[DSP_STAGE_NOISE] += stop - start;
+    start = stop;
+  }
+
+  if (dsp.enabled[DSP_STAGE_AGC])
+  {
+    dsp_agc (count);
+
+    stop = dsp_clock ();
+    dsp.cost[DSP_STAGE_AGC] += stop - start;
+    start = stop;
+  }
+
+  dsp_from_float (audio_buffer, count);
+  dsp.cost[NUM_DSP_STAGES] += dsp_clock () - start;
+  dsp.frames += frames;
+
+  return 1;
+}
+
+void dsp_stats (dsp_stats_t *stats)
+{
+  unsigned long long total = dsp.cost[NUM_DSP_STAGES];
+  uint32 stage;
+
+  stats->frames = dsp.frames;
+
+  for (stage = 0; stage < NUM_DSP_STAGES; stage++)
+  {
+    stats->stage[stage] = (dsp.frames > 0) ? (uint32)((dsp.cost[stage]/dsp.frames)/1000) : 0;
+    total += dsp.cost[stage];
+  }
+
+  stats->total = (dsp.frames > 0) ? (uint32)((total/dsp.frames)/1000) : 0;
+}
+
@@ -0,0 +1,35 @@
+#ifndef __DSP_H__
+#define __DSP_H__
+
+#include "types.h"
+
+enum
+{
+  DSP_STAGE_HIGHPASS,
+  DSP_STAGE_NOISE,
+  DSP_STAGE_AGC,
+  NUM_DSP_STAGES
+};
+
+/* Mean CPU time per frame in microsec., conversions to/from float included in total */
+typedef struct
+{
+  uint32  frames;
+  uint32  stage[NUM_DSP_STAGES];
+  uint32  total;
+} dsp_stats_t;
+
+extern void dsp_option (int32 stage, int32 enable);
+
+extern int32 dsp_init (uint8 channels, uint32 frame_duration, uint32 rate);
+
+extern int32 dsp_deinit (void);
+
+extern uint32 dsp_delay (void);
+
+extern int32 dsp_process (int16 *audio_buffer, uint8 frames);
+
+extern void dsp_stats (dsp_stats_t *stats);
+
+#endif
+
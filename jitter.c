@@ -0,0 +1,427 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "util.h"
+#include "jitter.h"
+
+/* Packets held, a power of two so sequence numbers index slots directly */
+#define JITTER_SLOTS        (16)
+
+/* Deepest playout target in frames */
+#define JITTER_MAX_DEPTH    (JITTER_SLOTS/2)
+
+/* Target covers this many times the mean arrival deviation */
+#define JITTER_SPREAD       (3)
+
+/* Frames over target before the oldest packet is dropped */
+#define JITTER_HYSTERESIS   (2)
+
+/* Slot tag bit, set while the slot holds the packet of its sequence number */
+#define JITTER_VALID        (0x10000)
+
+/* Local structures */
+typedef struct
+{
+  uint32  tag;
+  uint32  bytes;
+  uint8   data[JITTER_MAX_PACKET];
+} jitter_slot_t;
+
+typedef struct
+{
+  uint32         frame_duration;
+  uint32         min_depth;
+  jitter_slot_t  slot[JITTER_SLOTS];
+
+  /* Serial (producer) side */
+  uint32         head;
+  uint32         target;
+  uint32         jitter;
+  int32          last_arrival;
+  uint32         last_timestamp;
+  uint32         received;
+  uint32         late;
+  uint32         restart;
+
+  /* Audio (consumer) side */
+  uint32         next;
+  int32          playing;
+  uint32         lost;
+  uint32         inserted;
+
+  /* Either side */
+  uint32         dropped;
+} jitter_t;
+
+/* File scope global variables */
+static jitter_t jitter =
+{
+  .frame_duration = 0,
+  .min_depth      = 1,
+  .head           = 0,
+  .target         = 1,
+  .jitter         = 0,
+  .last_arrival   = 0,
+  .last_timestamp = 0,
+  .received       = 0,
+  .late           = 0,
+  .restart        = 0,
+  .next           = 0,
+  .playing        = 0,
+  .lost           = 0,
+  .inserted       = 0,
+  .dropped        = 0
+};
+
+
+/* Interarrival jitter as in RFC 3550 (kept scaled by 16), sets the playout target;
+ * timestamps are the sender's media clock, arrival the local clock, both in millisec. */
+static void jitter_arrival (uint32 timestamp, int32 arrival)
+{
+  int32 deviation = (arrival - jitter.last_arrival) - (int32)(timestamp - jitter.last_timestamp);
+  uint32 target;
+
+  deviation = (deviation < 0) ? -deviation : deviation;
+
+  /* A gap longer than the buffer is a new talk spurt, not jitter */
+  if ((jitter.received > 0) && (deviation < (JITTER_MAX_DEPTH * jitter.frame_duration)))
+  {
+    jitter.jitter += deviation - (jitter.jitter >> 4);
+  }
+
+  jitter.last_arrival   = arrival;
+  jitter.last_timestamp = timestamp;
+
+  target = 1 + ((JITTER_SPREAD * (jitter.jitter >> 4))/jitter.frame_duration);
+  target = (target > jitter.min_depth) ? target : jitter.min_depth;
+  target = (target < JITTER_MAX_DEPTH) ? target : JITTER_MAX_DEPTH;
+  __atomic_store_n (&(jitter.target), target, __ATOMIC_RELAXED);
+}
+
+/* Consumer side, copies the packet of sequence out of its slot; 0 when it isn't
+ * there, or when the producer took the slot over during the copy (it clears the
+ * tag before writing, so a changed tag afterwards means a torn copy) */
+static uint32 jitter_copy (uint16 sequence, uint8 *packet)
+{
+  jitter_slot_t *slot = &(jitter.slot[sequence & (JITTER_SLOTS - 1)]);
+  uint32 bytes;
+
+  if ((__atomic_load_n (&(slot->tag), __ATOMIC_ACQUIRE)) != (JITTER_VALID | sequence))
+  {
+    return 0;
+  }
+
+  bytes = slot->bytes;
+  memcpy (packet, slot->data, bytes);
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  return ((__atomic_load_n (&(slot->tag), __ATOMIC_RELAXED)) == (JITTER_VALID | sequence))
+         ? bytes : 0;
+}
+
+/* min_depth of 2 keeps the packet after the one due at hand for FEC */
+int32 jitter_init (uint32 frame_duration, uint32 min_depth)
+{
+  int32 status = -1;
+
+  if ((frame_duration > 0) && (min_depth > 0) && (min_depth <= JITTER_MAX_DEPTH))
+  {
+    memset (&jitter, 0, sizeof (jitter));
+    jitter.frame_duration = frame_duration;
+    jitter.min_depth      = min_depth;
+    jitter.target         = min_depth;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set up jitter buffer\n");
+  }
+
+  return status;
+}
+
+int32 jitter_deinit (void)
+{
+  jitter.frame_duration = 0;
+
+  return 1;
+}
+
+/* Consumer side, drops whatever is buffered and waits for the target depth again */
+void jitter_reset (void)
+{
+  __atomic_store_n (&(jitter.next), __atomic_load_n (&(jitter.head), __ATOMIC_ACQUIRE),
+                    __ATOMIC_RELEASE);
+  jitter.playing = 0;
+}
+
+/* Producer side, returns 1 when buffered, -1 when late or out of room */
+int32 jitter_put (uint16 sequence, uint32 timestamp, int32 arrival, uint8 *packet, uint32 bytes)
+{
+  int32 status = -1;
+  uint32 restart = __atomic_load_n (&(jitter.restart), __ATOMIC_ACQUIRE);
+  uint16 next = (restart != 0) ? (uint16)restart
+                               : (uint16)__atomic_load_n (&(jitter.next), __ATOMIC_ACQUIRE);
+  uint16 ahead = sequence - next;
+  int16 offset = sequence - (uint16)jitter.head;
+  int32 restarted = 0;
+
+  /* First packet, or far off what came before: the sender restarted or talked
+   * while we did. The consumer moves over to the new stream on its next frame */
+  if (((jitter.received == 0) || (offset >= JITTER_SLOTS) || (offset < -JITTER_SLOTS)) &&
+      (bytes <= JITTER_MAX_PACKET))
+  {
+    uint32 index;
+
+    /* Packets of the old stream must not pass for the new one's, nor may the
+     * consumer keep a copy of a slot that is being rewritten */
+    for (index = 0; index < JITTER_SLOTS; index++)
+    {
+      __atomic_store_n (&(jitter.slot[index].tag), 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n (&(jitter.restart), (JITTER_VALID | sequence), __ATOMIC_RELEASE);
+    ahead     = 0;
+    restarted = 1;
+  }
+
+  if ((int16)ahead < 0)
+  {
+    /* Its playout time has passed, concealment already covered it */
+    jitter.late++;
+  }
+  else if ((ahead >= JITTER_SLOTS) || (bytes > JITTER_MAX_PACKET))
+  {
+    __atomic_add_fetch (&(jitter.dropped), 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    jitter_slot_t *slot = &(jitter.slot[sequence & (JITTER_SLOTS - 1)]);
+
+    __atomic_store_n (&(slot->tag), 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (slot->data, packet, bytes);
+    slot->bytes = bytes;
+    __atomic_store_n (&(slot->tag), (JITTER_VALID | sequence), __ATOMIC_RELEASE);
+
+    if ((offset >= 0) || (restarted))
+    {
+      __atomic_store_n (&(jitter.head), (uint16)(sequence + 1), __ATOMIC_RELEASE);
+    }
+
+    status = 1;
+  }
+
+  jitter_arrival (timestamp, arrival);
+  jitter.received++;
+
+  return status;
+}
+
+/* Consumer side, once per frame; returns the packet size, or 0 when the
+ * decoder has to conceal this frame. When the due packet is lost but the
+ * next one is in, that one is copied (and kept) with fec set instead */
+int32 jitter_get (uint8 *packet, int32 *fec)
+{
+  int32 status = 0;
+  uint32 restart = __atomic_load_n (&(jitter.restart), __ATOMIC_ACQUIRE);
+  uint16 next;
+  uint16 depth;
+  uint32 target = __atomic_load_n (&(jitter.target), __ATOMIC_RELAXED);
+
+  *fec = 0;
+
+  if (restart != 0)
+  {
+    /* New stream, next moves before the request clears so the producer never
+     * sees both stale */
+    __atomic_store_n (&(jitter.next), (uint16)restart, __ATOMIC_RELEASE);
+    __atomic_store_n (&(jitter.restart), 0, __ATOMIC_RELEASE);
+    jitter.playing = 0;
+  }
+
+  next  = jitter.next;
+  depth = (uint16)__atomic_load_n (&(jitter.head), __ATOMIC_ACQUIRE) - next;
+
+  if ((!(jitter.playing)) && (depth >= target) && (depth > 0))
+  {
+    jitter.playing = 1;
+  }
+
+  if (!(jitter.playing))
+  {
+    return 0;
+  }
+
+  if (depth == 0)
+  {
+    /* Playout ran ahead of arrivals: this frame is concealed, the stream goes on a
+     * frame later once the target depth is built up again */
+    jitter.inserted++;
+    jitter.playing = 0;
+    return 0;
+  }
+
+  if (depth > (target + JITTER_HYSTERESIS))
+  {
+    /* Shrink by skipping the oldest packet (or the gap where it was due) */
+    if ((__atomic_load_n (&(jitter.slot[next & (JITTER_SLOTS - 1)].tag), __ATOMIC_ACQUIRE))
+        == (JITTER_VALID | next))
+    {
+      __atomic_add_fetch (&(jitter.dropped), 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      jitter.lost++;
+    }
+
+    next++;
+  }
+
+  if ((status = jitter_copy (next, packet)) == 0)
+  {
+    /* A later packet is in, this one never made it */
+    jitter.lost++;
+
+    if ((status = jitter_copy (next + 1, packet)) > 0)
+    {
+      *fec = 1;
+    }
+  }
+
+  /* Slot may be reused only after the copy */
+  __atomic_store_n (&(jitter.next), (uint16)(next + 1), __ATOMIC_RELEASE);
+
+  return status;
+}
+
+void jitter_stats (jitter_stats_t *stats)
+{
+  stats->depth    = (uint16)((__atomic_load_n (&(jitter.head), __ATOMIC_ACQUIRE))
+                             - (__atomic_load_n (&(jitter.next), __ATOMIC_ACQUIRE)));
+  stats->target   = __atomic_load_n (&(jitter.target), __ATOMIC_RELAXED);
+  stats->jitter   = jitter.jitter >> 4;
+  stats->received = jitter.received;
+  stats->late     = jitter.late;
+  stats->lost     = jitter.lost;
+  stats->inserted = jitter.inserted;
+  stats->dropped  = __atomic_load_n (&(jitter.dropped), __ATOMIC_RELAXED);
+}
+
+
+#ifdef JITTER_TEST
+
+/* Packets carry their sequence number and stream in the first two bytes, and
+ * arrive exactly on the sender's clock so the target stays at min_depth */
+static int32 put (uint16 sequence, uint8 stream)
+{
+  uint8 packet[10] = {0};
+
+  packet[0] = (uint8)sequence;
+  packet[1] = stream;
+
+  return jitter_put (sequence, 20 * sequence, 20 * sequence, packet, sizeof (packet));
+}
+
+/* Returns 1 when the next frame is not the expected packet (0 expects concealment) */
+static int32 get (uint16 sequence, uint8 stream, int32 fec, int32 present)
+{
+  uint8 packet[JITTER_MAX_PACKET];
+  int32 got_fec;
+  int32 bytes = jitter_get (packet, &got_fec);
+
+  if (!present)
+  {
+    return (bytes != 0);
+  }
+
+  return ((bytes != 10) || (packet[0] != (uint8)sequence) || (packet[1] != stream) ||
+          (got_fec != fec));
+}
+
+int main (void)
+{
+  jitter_stats_t stats;
+  uint16 sequence;
+  int32 failures = 0;
+  int32 total = 0;
+
+  /* Reordered and duplicated arrivals, playout catching up with them */
+  jitter_init (20, 2);
+  failures += ((put (0, 0)) != 1);
+  failures += get (0, 0, 0, 0);
+  failures += ((put (1, 0)) != 1);
+  failures += get (0, 0, 0, 1);
+  failures += ((put (3, 0)) != 1);
+  failures += ((put (2, 0)) != 1);
+  failures += get (1, 0, 0, 1);
+  failures += get (2, 0, 0, 1);
+  failures += ((put (2, 0)) != -1);
+  failures += ((put (3, 0)) != 1);
+  failures += get (3, 0, 0, 1);
+  failures += get (0, 0, 0, 0);
+  jitter_stats (&stats);
+  failures += ((stats.late != 1) || (stats.lost != 0) || (stats.inserted != 1) ||
+               (stats.dropped != 0) || (stats.received != 6) || (stats.depth != 0));
+  printf ("Jitter reorder: %s\n", failures ? "FAIL" : "OK");
+  total += failures;
+  failures = 0;
+
+  /* Losses, the packet after a lost one is handed over for FEC and again
+   * in its own turn; two in a row leave one frame to concealment */
+  failures += ((put (4, 0)) != 1);
+  failures += ((put (5, 0)) != 1);
+  failures += get (4, 0, 0, 1);
+  failures += ((put (7, 0)) != 1);
+  failures += get (5, 0, 0, 1);
+  failures += ((put (8, 0)) != 1);
+  failures += get (7, 0, 1, 1);
+  failures += get (7, 0, 0, 1);
+  failures += ((put (11, 0)) != 1);
+  failures += get (8, 0, 0, 1);
+  failures += ((put (12, 0)) != 1);
+  failures += get (0, 0, 0, 0);
+  failures += get (11, 0, 1, 1);
+  failures += get (11, 0, 0, 1);
+  failures += get (12, 0, 0, 1);
+  jitter_stats (&stats);
+  failures += ((stats.lost != 3) || (stats.inserted != 1) || (stats.depth != 0));
+  printf ("Jitter loss: %s\n", failures ? "FAIL" : "OK");
+  total += failures;
+  failures = 0;
+
+  /* The sender restarts far off, playout builds up again on the new stream */
+  failures += ((put (1000, 1)) != 1);
+  failures += get (0, 0, 0, 0);
+  for (sequence = 1001; sequence < 1020; sequence++)
+  {
+    failures += ((put (sequence, 1)) != 1);
+    failures += get (sequence - 1, 1, 0, 1);
+  }
+  jitter_stats (&stats);
+  failures += ((stats.lost != 3) || (stats.late != 1) || (stats.depth != 1));
+  printf ("Jitter restart: %s\n", failures ? "FAIL" : "OK");
+  total += failures;
+  failures = 0;
+
+  /* Restart just behind the old stream: 1004 of the old one is still in its
+   * slot, the new stream's 1004 is lost and must not be played from there */
+  failures += ((put (1003, 2)) != 1);
+  failures += get (0, 0, 0, 0);
+  failures += ((put (1005, 2)) != 1);
+  failures += get (1003, 2, 0, 1);
+  failures += get (1005, 2, 1, 1);
+  failures += get (1005, 2, 0, 1);
+  jitter_stats (&stats);
+  failures += ((stats.lost != 4) || (stats.depth != 0));
+  printf ("Jitter stale slots: %s\n", failures ? "FAIL" : "OK");
+  total += failures;
+
+  jitter_deinit ();
+
+  return total ? 1 : 0;
+}
+
+#endif
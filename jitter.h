@@ -0,0 +1,36 @@
+#ifndef __JITTER_H__
+#define __JITTER_H__
+
+#include "types.h"
+
+/* Largest packet a slot holds */
+#define JITTER_MAX_PACKET  (1000)
+
+/* Buffer state and counters since init, times in millisec. */
+typedef struct
+{
+  uint32  depth;
+  uint32  target;
+  uint32  jitter;
+  uint32  received;
+  uint32  late;
+  uint32  lost;
+  uint32  inserted;
+  uint32  dropped;
+} jitter_stats_t;
+
+extern int32 jitter_init (uint32 frame_duration, uint32 min_depth);
+
+extern int32 jitter_deinit (void);
+
+extern void jitter_reset (void);
+
+extern int32 jitter_put (uint16 sequence, uint32 timestamp, int32 arrival,
+                         uint8 *packet, uint32 bytes);
+
+extern int32 jitter_get (uint8 *packet, int32 *fec);
+
+extern void jitter_stats (jitter_stats_t *stats);
+
+#endif
+
@@ -0,0 +1,495 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <termios.h>
+
+#include "types.h"
+#include "util.h"
+
+/* Radio link simulator: two pty pairs, a ppr instance opens the slave end of
+ * each (-T) and the bytes between the masters go through a model of the link */
+
+/* Defaults, the command line overrides them */
+#define LINKSIM_BAUD_RATE      (115200)
+#define LINKSIM_BITS_PER_BYTE  (10)
+
+/* Bytes a modem holds ahead of the air, a power of two; more are lost */
+#define LINKSIM_BUFFER         (16384)
+
+/* Delivery tick in millisec. */
+#define LINKSIM_TICK           (1)
+
+/* One pty pair, a link end; the master goes unwatched while its line is busy */
+typedef struct
+{
+  int    master;
+  int    slave;
+  char  *path;
+  char  *link;
+  int32  paused;
+} linksim_end_t;
+
+/* One direction of the link, times in nanosec. of the monotonic clock */
+typedef struct
+{
+  int8      *name;
+  uint8      data[LINKSIM_BUFFER];
+  uint64_t   due[LINKSIM_BUFFER];
+  uint32     head;
+  uint32     count;
+  uint64_t   line_free;
+  uint64_t   last_due;
+  uint64_t   burst_start;
+  uint64_t   burst_end;
+
+  /* Counters since start-up */
+  uint32     bytes;
+  uint32     delivered;
+  uint32     bit_errors;
+  uint32     byte_errors;
+  uint32     burst_lost;
+  uint32     overflow;
+} linksim_path_t;
+
+/* Link model, probabilities as fractions of 2^32 */
+typedef struct
+{
+  uint32    baud_rate;
+  uint32    delay;
+  uint32    jitter;
+  uint32    bit_error;
+  uint32    byte_error;
+  uint32    burst_interval;
+  uint32    burst_length;
+  uint32    seed;
+} linksim_model_t;
+
+/* File scope global variables */
+static linksim_model_t linksim_model =
+{
+  .baud_rate      = LINKSIM_BAUD_RATE,
+  .delay          = 0,
+  .jitter         = 0,
+  .bit_error      = 0,
+  .byte_error     = 0,
+  .burst_interval = 0,
+  .burst_length   = 0,
+  .seed           = 1
+};
+
+static linksim_end_t linksim_end[2] =
+{
+  {.master = -1, .slave = -1, .path = NULL, .link = NULL, .paused = 0},
+  {.master = -1, .slave = -1, .path = NULL, .link = NULL, .paused = 0}
+};
+
+static linksim_path_t linksim_path[2] =
+{
+  {.name = "A->B"},
+  {.name = "B->A"}
+};
+
+static void *linksim_event = NULL;
+
+/* Stop request from the signal handler */
+static int32 linksim_wake = -1;
+static int32 linksim_running = 1;
+
+
+static uint64_t linksim_now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return ((uint64_t)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/* xorshift32, the seed makes a run repeatable */
+static uint32 linksim_random (void)
+{
+  uint32 x = linksim_model.seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  linksim_model.seed = x;
+
+  return x;
+}
+
+/* Probability 0..1 as a threshold for linksim_random */
+static uint32 linksim_probability (double probability)
+{
+  probability = (probability < 0.0) ? 0.0 : probability;
+
+  return (probability >= 1.0) ? 0xFFFFFFFF : (uint32)(probability * 4294967296.0);
+}
+
+/* Next burst starts anywhere up to twice the mean interval after the last one ended */
+static void linksim_burst (linksim_path_t *path, uint64_t after)
+{
+  uint64_t interval = (uint64_t)linksim_model.burst_interval * 1000000ULL;
+
+  path->burst_start = after + ((interval * 2 * (linksim_random () & 0xFFFF)) >> 16);
+  path->burst_end   = path->burst_start + ((uint64_t)linksim_model.burst_length * 1000000ULL);
+}
+
+/* Bytes from a ppr instance, each goes on the line behind the ones before it
+ * and gets its share of the errors; a read's worth shares one jitter draw.
+ * Like a UART, no more is taken than the line gets through, the rest waits in
+ * the pty and the sender blocks */
+static void linksim_ingest (void *data, uint32 events)
+{
+  linksim_end_t *end = data;
+  uint32 side = end - linksim_end;
+  linksim_path_t *path = &(linksim_path[side]);
+  uint8 buffer[1024];
+  uint64_t byte_time = (LINKSIM_BITS_PER_BYTE * 1000000000ULL)/linksim_model.baud_rate;
+  uint64_t now = linksim_now ();
+  uint64_t ahead = now + (LINKSIM_TICK * 1000000ULL);
+  uint64_t jitter = 0;
+  ssize_t bytes = 1;
+  ssize_t count;
+
+  /* What keeps the line busy until the next tick */
+  if (path->line_free < ahead)
+  {
+    bytes += (ahead - path->line_free)/byte_time;
+    bytes  = (bytes < sizeof (buffer)) ? bytes : sizeof (buffer);
+  }
+
+  if ((bytes = read (linksim_end[side].master, buffer, bytes)) <= 0)
+  {
+    /* Nobody on the slave yet (our own open end keeps the master from hanging up) */
+    return;
+  }
+
+  if (linksim_model.jitter > 0)
+  {
+    jitter = (((uint64_t)linksim_model.jitter * 1000000ULL) * (linksim_random () & 0xFFFF)) >> 16;
+  }
+
+  for (count = 0; count < bytes; count++)
+  {
+    uint8 byte = buffer[count];
+    uint64_t due;
+    uint32 bit;
+
+    path->line_free = ((path->line_free > now) ? path->line_free : now) + byte_time;
+    path->bytes++;
+
+    if (linksim_model.burst_interval > 0)
+    {
+      while (path->line_free >= path->burst_end)
+      {
+        linksim_burst (path, path->burst_end);
+      }
+
+      if (path->line_free >= path->burst_start)
+      {
+        path->burst_lost++;
+        continue;
+      }
+    }
+
+    if (linksim_random () < linksim_model.byte_error)
+    {
+      path->byte_errors++;
+      continue;
+    }
+
+    for (bit = 0; ((linksim_model.bit_error > 0) && (bit < 8)); bit++)
+    {
+      if (linksim_random () < linksim_model.bit_error)
+      {
+        byte ^= (0x1 << bit);
+        path->bit_errors++;
+      }
+    }
+
+    if (path->count == LINKSIM_BUFFER)
+    {
+      path->overflow++;
+      continue;
+    }
+
+    /* A serial link keeps the order, jitter only ever holds bytes back */
+    due = path->line_free + ((uint64_t)linksim_model.delay * 1000000ULL) + jitter;
+    due = (due > path->last_due) ? due : path->last_due;
+    path->last_due = due;
+
+    path->data[(path->head + path->count) & (LINKSIM_BUFFER - 1)] = byte;
+    path->due[(path->head + path->count) & (LINKSIM_BUFFER - 1)]  = due;
+    path->count++;
+  }
+
+  if ((path->line_free > ahead) &&
+      ((event_remove (linksim_event, end->master)) >= 0))
+  {
+    end->paused = 1;
+  }
+}
+
+/* Hands the bytes that are due to the far end, what it has no room for waits */
+static void linksim_deliver (void *data, uint32 events)
+{
+  uint64_t now = linksim_now ();
+  uint32 side;
+
+  for (side = 0; side < 2; side++)
+  {
+    linksim_path_t *path = &(linksim_path[side]);
+    uint8 buffer[1024];
+    uint32 bytes = 0;
+    ssize_t written;
+
+    /* Line caught up, take more from the sender */
+    if ((linksim_end[side].paused) && (path->line_free <= (now + (LINKSIM_TICK * 1000000ULL))) &&
+        ((event_add (linksim_event, linksim_end[side].master, EVENT_READ, linksim_ingest,
+                     &(linksim_end[side]))) >= 0))
+    {
+      linksim_end[side].paused = 0;
+    }
+
+    while ((bytes < sizeof (buffer)) && (bytes < path->count) &&
+           (path->due[(path->head + bytes) & (LINKSIM_BUFFER - 1)] <= now))
+    {
+      buffer[bytes] = path->data[(path->head + bytes) & (LINKSIM_BUFFER - 1)];
+      bytes++;
+    }
+
+    if ((bytes > 0) && ((written = write (linksim_end[1 - side].master, buffer, bytes)) > 0))
+    {
+      path->head       = (path->head + written) & (LINKSIM_BUFFER - 1);
+      path->count     -= written;
+      path->delivered += written;
+    }
+  }
+}
+
+static void linksim_stop (void *data, uint32 events)
+{
+  __atomic_store_n (&linksim_running, 0, __ATOMIC_RELEASE);
+}
+
+static void linksim_signal (int signal_number)
+{
+  event_notify (linksim_wake);
+}
+
+/* New pty pair with a raw slave, held open so nothing is echoed before ppr takes it */
+static int32 linksim_open (linksim_end_t *end, int8 *link)
+{
+  struct termios options;
+  int32 status = -1;
+
+  if (((end->master = posix_openpt (O_RDWR | O_NOCTTY | O_NONBLOCK)) >= 0) &&
+      ((grantpt (end->master)) == 0) && ((unlockpt (end->master)) == 0) &&
+      ((end->path = ptsname (end->master)) != NULL) &&
+      ((end->path = strdup (end->path)) != NULL) &&
+      ((end->slave = open (end->path, (O_RDWR | O_NOCTTY))) >= 0) &&
+      ((tcgetattr (end->slave, &options)) == 0))
+  {
+    cfmakeraw (&options);
+    tcsetattr (end->slave, TCSANOW, &options);
+    status = 1;
+
+    /* Stable name for scripts, the pts number changes from run to run */
+    if (link != NULL)
+    {
+      unlink (link);
+
+      if (((symlink (end->path, link)) == 0) && ((end->link = strdup (link)) != NULL))
+      {
+        printf ("%s -> %s\n", link, end->path);
+      }
+      else
+      {
+        printf ("Unable to link %s\n", link);
+      }
+    }
+  }
+  else
+  {
+    printf ("Unable to create pty\n");
+  }
+
+  return status;
+}
+
+static void linksim_close (linksim_end_t *end)
+{
+  if (end->link != NULL)
+  {
+    unlink (end->link);
+    free (end->link);
+    end->link = NULL;
+  }
+
+  if (end->slave >= 0)
+  {
+    close (end->slave);
+    end->slave = -1;
+  }
+
+  if (end->master >= 0)
+  {
+    close (end->master);
+    end->master = -1;
+  }
+
+  free (end->path);
+  end->path = NULL;
+}
+
+int32 main (int32 argc, int8 * argv[])
+{
+  int8 *link_prefix = NULL;
+  int8 *link[2] = {NULL, NULL};
+  uint32 duration = 0;
+  int32 option;
+  uint32 side;
+
+  while ((option = getopt (argc, argv, "b:d:j:e:E:g:G:s:N:l:")) != -1)
+  {
+    switch (option)
+    {
+      case 'b':
+      {
+        linksim_model.baud_rate = (uint32)atoi (optarg);
+        break;
+      }
+      case 'd':
+      {
+        /* One-way propagation delay in millisec. */
+        linksim_model.delay = (uint32)atoi (optarg);
+        break;
+      }
+      case 'j':
+      {
+        /* Extra delay up to this many millisec. */
+        linksim_model.jitter = (uint32)atoi (optarg);
+        break;
+      }
+      case 'e':
+      {
+        /* Bit error rate, 1e-5 say */
+        linksim_model.bit_error = linksim_probability (atof (optarg));
+        break;
+      }
+      case 'E':
+      {
+        /* Probability a byte is lost */
+        linksim_model.byte_error = linksim_probability (atof (optarg));
+        break;
+      }
+      case 'g':
+      {
+        /* Mean time between fades in millisec., 0 for none */
+        linksim_model.burst_interval = (uint32)atoi (optarg);
+        break;
+      }
+      case 'G':
+      {
+        /* Fade length in millisec., everything on the air meanwhile is lost */
+        linksim_model.burst_length = (uint32)atoi (optarg);
+        break;
+      }
+      case 's':
+      {
+        linksim_model.seed = (uint32)atoi (optarg);
+        linksim_model.seed = (linksim_model.seed == 0) ? 1 : linksim_model.seed;
+        break;
+      }
+      case 'N':
+      {
+        /* Run for this many seconds, 0 runs until interrupted */
+        duration = (uint32)atoi (optarg);
+        break;
+      }
+      case 'l':
+      {
+        /* Symlinks <prefix>A and <prefix>B to the slave ends */
+        link_prefix = optarg;
+        break;
+      }
+      default:
+      {
+        printf ("Unknown option -%c\n", option);
+        break;
+      }
+    }
+  }
+
+  if (linksim_model.baud_rate == 0)
+  {
+    printf ("Unsupported baud rate\n");
+    return 1;
+  }
+
+  if ((link_prefix != NULL) &&
+      (((asprintf (&(link[0]), "%sA", link_prefix)) < 0) ||
+       ((asprintf (&(link[1]), "%sB", link_prefix)) < 0)))
+  {
+    link[0] = NULL;
+    link[1] = NULL;
+  }
+
+  event_create (&linksim_event);
+  linksim_wake = event_notifier (linksim_event, linksim_stop, NULL);
+  signal (SIGINT, linksim_signal);
+  signal (SIGTERM, linksim_signal);
+
+  if (((linksim_open (&(linksim_end[0]), link[0])) > 0) &&
+      ((linksim_open (&(linksim_end[1]), link[1])) > 0) &&
+      ((event_add (linksim_event, linksim_end[0].master, EVENT_READ, linksim_ingest,
+                   &(linksim_end[0]))) >= 0) &&
+      ((event_add (linksim_event, linksim_end[1].master, EVENT_READ, linksim_ingest,
+                   &(linksim_end[1]))) >= 0) &&
+      ((event_timer (linksim_event, LINKSIM_TICK, 1, linksim_deliver, NULL)) >= 0) &&
+      ((duration == 0) || ((event_timer (linksim_event, duration * 1000, 0, linksim_stop, NULL)) >= 0)))
+  {
+    printf ("Link A %s, B %s: %u baud, %u ms delay, %u ms jitter, fades of %u ms "
+            "every %u ms\n", linksim_end[0].path, linksim_end[1].path,
+            linksim_model.baud_rate, linksim_model.delay, linksim_model.jitter,
+            linksim_model.burst_length, linksim_model.burst_interval);
+    fflush (stdout);
+
+    for (side = 0; side < 2; side++)
+    {
+      linksim_burst (&(linksim_path[side]), linksim_now ());
+    }
+
+    while ((__atomic_load_n (&linksim_running, __ATOMIC_ACQUIRE)) &&
+           ((event_dispatch (linksim_event, -1)) >= 0))
+    {
+    }
+
+    for (side = 0; side < 2; side++)
+    {
+      linksim_path_t *path = &(linksim_path[side]);
+
+      printf ("%s: %u bytes in, %u delivered, %u bits flipped, %u bytes lost, "
+              "%u lost in fades, %u overflowed, %u in flight\n", path->name, path->bytes,
+              path->delivered, path->bit_errors, path->byte_errors, path->burst_lost,
+              path->overflow, path->count);
+    }
+  }
+
+  linksim_close (&(linksim_end[0]));
+  linksim_close (&(linksim_end[1]));
+  event_destroy (linksim_event);
+  free (link[0]);
+  free (link[1]);
+
+  return 0;
+}
@@ -1,10 +1,17 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "types.h"
 #include "util.h"
 #include "codec.h"
+#include "vad.h"
+#include "jitter.h"
+#include "dsp.h"
+
+/* Defaults, -c, -p and -s override them at start-up */
 
 /* Mono capture/playback */
 #define CHANNELS            (1)
@@ -15,9 +22,6 @@
 /* Sampling rate in Hz */
 #define SAMPLING_RATE      (16000)
 
-/* Samples per frame */
-#define SAMPLES_PER_FRAME  ((SAMPLING_RATE*FRAME_DURATION)/1000)
-
 enum
 {
   RADIO_STATE_RX_SWITCH = -2,
@@ -27,31 +31,155 @@ enum
   RADIO_STATE_TX_SWITCH = 2
 };
 
-/* Audio buffer */
-int16 audio_buffer[CHANNELS*SAMPLES_PER_FRAME];
+/* Audio buffer, one frame of all channels */
+int16 *audio_buffer = NULL;
 
-/* Codec buffer */
-uint8 codec_buffer[1000];
+/* Codec buffer, one packet */
+uint8 *codec_buffer = NULL;
+
+/* Packet taken from the jitter buffer for decoding */
+static uint8 jitter_packet[JITTER_MAX_PACKET];
 
 /* Codec packetsize */
 uint32 codec_frame_size;
 
+/* Encoder of this radio and the decoder of the remote talker */
+static void *codec = NULL;
+static void *talker = NULL;
+
+/* Stream format */
+static uint8 channels = CHANNELS;
+static uint32 frame_duration = FRAME_DURATION;
+static uint32 sampling_rate = SAMPLING_RATE;
+
+/* Frames per packet, trades accumulation delay for link overhead and writes */
+static uint8 packing = 1;
+
+/* Link probe at start-up in millisec., 0 skips it */
+static uint32 probe_duration = 0;
+
+/* Encoded packets queued from the audio thread to the master loop */
+#define LINK_QUEUE_PACKETS  (8)
+
+/* Packet numbered when encoded, timestamp is the sender media clock in millisec.
+ * (runs on through silence) */
+typedef struct
+{
+  uint16  sequence;
+  uint32  timestamp;
+  uint8   data[CODEC_MAX_PACKET];
+} link_packet_t;
+
+static void *link_queue = NULL;
+
+/* Link use since start-up, and packets the queue had no room for */
+static uint32 link_packets = 0;
+static uint32 link_bytes   = 0;
+static uint32 link_dropped = 0;
+
 /* Radio state & PTT */
 static int32 radio_state;
 
 /* Audio thread handle */
 static void *audio_thread = NULL;
 
-/* Serial I/O sync */
-void *serial_sync = NULL;
+/* Master loop notifier, audio thread signals an encoded packet on it */
+static int32 packet_ready = -1;
+
+/* Voice activity detection, silent frames are not sent */
+static int32 vad_enabled = 1;
+
+/* Expected link loss in percent for in-band FEC, 0 sends none */
+static int32 fec_loss = 0;
+
+/* Full-duplex audio, streams keep running across PTT switches */
+static int32 audio_duplex = 0;
 
+/* PTT turnaround instrumentation, switch time in millisec. or -1 */
+static int32 key_up_time = -1;
+static int32 unkey_time  = -1;
+
+/* Benchmark run, stop after this many frames (0 runs forever) */
+static uint32 frame_limit = 0;
+static uint32 frame_count = 0;
+static int32 radio_running = 1;
+
+/* Master loop notifier, wakes it up to stop */
+static int32 master_wake = -1;
+
+
+/* Frame buffers are sized for the format picked at start-up */
+static int32 buffer_init (void)
+{
+  int32 status = -1;
+
+  codec_frame_size = codec_packetsize (codec, packing);
+  audio_buffer = malloc (packing * channels * ((sampling_rate * frame_duration)/1000)
+                         * sizeof (int16));
+  codec_buffer = malloc (codec_frame_size);
+
+  if (codec_frame_size == 0)
+  {
+    printf ("Unable to pack %u frames of %u ms into a packet\n", packing, frame_duration);
+  }
+  else if ((audio_buffer != NULL) && (codec_buffer != NULL) &&
+           ((ring_create (sizeof (link_packet_t), LINK_QUEUE_PACKETS, &link_queue)) > 0))
+  {
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to allocate frame buffers\n");
+  }
+
+  return status;
+}
+
+static void buffer_deinit (void)
+{
+  free (audio_buffer);
+  audio_buffer = NULL;
+  free (codec_buffer);
+  codec_buffer = NULL;
+
+  if (link_queue != NULL)
+  {
+    ring_destroy (link_queue);
+    link_queue = NULL;
+  }
+}
+
+/* Count a processed frame, report and stop once the benchmark budget is spent */
+static void frame_done (int32 start_time)
+{
+  frame_count += packing;
+
+  /* Packets carry several frames, stop on the one that crosses the budget */
+  if ((frame_limit > 0) && (frame_count >= frame_limit) &&
+      ((frame_count - packing) < frame_limit))
+  {
+    int32 elapsed = (clock_get_count ()) - start_time;
+    int32 speed = (elapsed > 0) ? ((frame_count * frame_duration * 100)/elapsed) : 0;
+
+    LOG (LOG_MODULE_MAIN, LOG_INFO, "\n%u frames (%u ms audio) in %d ms, %d.%02dx real time\n",
+         frame_count, frame_count * frame_duration, elapsed, speed/100, speed%100);
+
+    __atomic_store_n (&radio_running, 0, __ATOMIC_RELEASE);
+    event_notify (master_wake);
+  }
+}
 
 static void * audio_main (void *data)
 {
   int32 start_time = clock_get_count ();
+  uint32 media_time = 0;
   int32 comfort_noise_gen = 5;
+  audio_health_t health;
+  jitter_stats_t jitter;
+  int32 fec;
+  static link_packet_t packet;
+  uint16 link_sequence = 0;
   
-  codec_frame_size = codec_packetsize ();
 
   /* Init codec decode to sane state with some valid decode frames;
    * This is required for generating comfort noise */
@@ -59,61 +187,130 @@ static void * audio_main (void *data)
   while (comfort_noise_gen)
   {
     if (((audio_capture (audio_buffer, 1)) > 0) &&
-        ((codec_encode (audio_buffer, codec_buffer, 1)) > 0))
+        ((codec_encode (codec, audio_buffer, codec_buffer, 1)) > 0))
     {
-      codec_decode (codec_buffer, audio_buffer, 1);
+      codec_decode (talker, codec_buffer, audio_buffer, 1);
     }
 
     comfort_noise_gen--;
   }
   audio_capture_pause (1);
 
-  while (1)
+  while (__atomic_load_n (&radio_running, __ATOMIC_ACQUIRE))
   {
-    if (radio_state == RADIO_STATE_TX_SWITCH)
+    int32 state = __atomic_load_n (&radio_state, __ATOMIC_ACQUIRE);
+
+    /* The master loop may move the state on meanwhile, the next pass picks that up */
+    if (state == RADIO_STATE_TX_SWITCH)
     {
+      os_alloc_guard (0);
       audio_capture_pause (1);
       audio_playback_pause (0);
+      jitter_reset ();
       
-      radio_state = RADIO_STATE_RX;
+      if (__atomic_compare_exchange_n (&radio_state, &state, RADIO_STATE_RX, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        state = RADIO_STATE_RX;
+      }
     }
-    else if (radio_state == RADIO_STATE_RX_SWITCH)
+    else if (state == RADIO_STATE_RX_SWITCH)
     {
+      os_alloc_guard (0);
       audio_playback_pause (1);
       audio_capture_pause (0);
       
-      radio_state = RADIO_STATE_TX;
+      if (__atomic_compare_exchange_n (&radio_state, &state, RADIO_STATE_TX, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        state = RADIO_STATE_TX;
+      }
     }
 
-    printf ("Radio:%s, Run time %d sec.",
-                radio_state > 0 ? "TX" : "RX",
-                ((clock_get_count ()) - start_time)/1000);
+    /* Capture/encode and decode/playback must not touch the heap */
+    os_alloc_guard (1);
+
+    audio_health (&health);
+    LOG (LOG_MODULE_STATUS, LOG_INFO, "Radio:%cX, Run time %d sec., XRUN %u/%u",
+         (state > 0) ? 'T' : 'R', ((clock_get_count ()) - start_time)/1000,
+         health.playback_underruns, health.capture_overruns);
     
-    if (radio_state > 0)
+    if (state > 0)
     {
-      if (((audio_capture (audio_buffer, 1)) > 0) &&
-          ((codec_encode (audio_buffer, codec_buffer, 1)) > 0))
+      if (((audio_capture (audio_buffer, packing)) > 0) &&
+          ((dsp_process (audio_buffer, packing)) > 0))
+      {
+        /* Pauses in speech stay off the link, the receiver plays comfort noise */
+        if ((vad_enabled) && ((vad_process (audio_buffer, packing)) == 0))
+        {
+          LOG (LOG_MODULE_STATUS, LOG_INFO, " | Silence, duty %u%%", vad_duty ());
+        }
+        else if ((codec_encode (codec, audio_buffer, packet.data, packing)) > 0)
+        {
+          /* Numbered here, a packet the queue can't take shows up as lost at the far end */
+          packet.sequence  = link_sequence++;
+          packet.timestamp = media_time;
+
+          if ((ring_write (link_queue, &packet, 1)) == 1)
+          {
+            event_notify (packet_ready);
+          }
+          else
+          {
+            link_dropped++;
+          }
+        }
+
+        media_time += packing * frame_duration;
+
+        frame_done (start_time);
+      }
+
+      if (audio_duplex)
       {
-        os_post_sem (serial_sync);
+        audio_playback (NULL, packing);
       }
     }
-    else if (radio_state < 0)
+    else if (state < 0)
     {
-      if ((os_wait_sem (serial_sync, 60)) > 0)
+      /* Capture paces the loop in duplex mode, the blocking playback write otherwise;
+       * the jitter buffer is read on that clock and decides what is due */
+      if (audio_duplex)
+      {
+        audio_capture (NULL, packing);
+      }
+
+      jitter_stats (&jitter);
+
+      if ((jitter_get (jitter_packet, &fec)) <= 0)
+      {
+        LOG (LOG_MODULE_STATUS, LOG_INFO, " | Noise");
+        codec_decode (talker, NULL, audio_buffer, packing);
+      }
+      else if (fec)
       {
-        printf (" | Voice");
-        codec_decode (codec_buffer, audio_buffer, 1);
+        /* Lost frame rebuilt from the redundancy in the packet after it */
+        LOG (LOG_MODULE_STATUS, LOG_INFO, " | FEC, JB %u/%u", jitter.depth, jitter.target);
+        codec_recover (talker, jitter_packet, audio_buffer, packing);
       }
       else
       {
-        printf (" | Noise");
-        codec_decode (NULL, audio_buffer, 1);
+        LOG (LOG_MODULE_STATUS, LOG_INFO, " | Voice, JB %u/%u", jitter.depth, jitter.target);
+        codec_decode (talker, jitter_packet, audio_buffer, packing);
       }
         
-      audio_playback (audio_buffer, 1);
+      audio_playback (audio_buffer, packing);
+      frame_done (start_time);
+
+      if (unkey_time >= 0)
+      {
+        LOG (LOG_MODULE_MAIN, LOG_INFO, "\nPTT unkey to first audio %d ms\n",
+             ((clock_get_count ()) - unkey_time) + (audio_playback_delay ()));
+        unkey_time = -1;
+      }
     }
 
-    printf ("\r");
+    LOG (LOG_MODULE_STATUS, LOG_INFO, "\r");
   }
 
   return NULL;
@@ -123,50 +320,150 @@ static void * audio_loopback (void *data)
 {
   int32 start_time = clock_get_count ();
   
-  while (1)
+  while (__atomic_load_n (&radio_running, __ATOMIC_ACQUIRE))
   {
-    if (radio_state == RADIO_STATE_TX_SWITCH)
+    int32 state = __atomic_load_n (&radio_state, __ATOMIC_ACQUIRE);
+
+    /* The master loop may move the state on meanwhile, the next pass picks that up */
+    if (state == RADIO_STATE_TX_SWITCH)
     {
       audio_capture_pause (1);
       audio_playback_pause (1);
       
-      radio_state = RADIO_STATE_RX;
+      if (__atomic_compare_exchange_n (&radio_state, &state, RADIO_STATE_RX, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        state = RADIO_STATE_RX;
+      }
     }
-    else if (radio_state == RADIO_STATE_RX_SWITCH)
+    else if (state == RADIO_STATE_RX_SWITCH)
     {
       audio_playback_pause (0);
       audio_capture_pause (0);
       
-      radio_state = RADIO_STATE_TX;
+      if (__atomic_compare_exchange_n (&radio_state, &state, RADIO_STATE_TX, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        state = RADIO_STATE_TX;
+      }
     }
 
-    printf ("Radio:%s, Run time %d sec.",
-                radio_state > 0 ? "TX" : "RX",
-                ((clock_get_count ()) - start_time)/1000);
+    LOG (LOG_MODULE_STATUS, LOG_INFO, "Radio:%cX, Run time %d sec.",
+         (state > 0) ? 'T' : 'R', ((clock_get_count ()) - start_time)/1000);
 
-    if (radio_state > 0)
+    if (state > 0)
     {
-      if (((audio_capture (audio_buffer, 1)) > 0) &&
-          ((codec_encode (audio_buffer, codec_buffer, 1)) > 0))
+      if (((audio_capture (audio_buffer, packing)) > 0) &&
+          ((dsp_process (audio_buffer, packing)) > 0) &&
+          ((codec_encode (codec, audio_buffer, codec_buffer, packing)) > 0))
       {
-        codec_decode (codec_buffer, audio_buffer, 1);
-        audio_playback (audio_buffer, 1);
+        codec_decode (talker, codec_buffer, audio_buffer, packing);
+        audio_playback (audio_buffer, packing);
+        frame_done (start_time);
       }
     }
+    else if ((state < 0) && (audio_duplex))
+    {
+      audio_capture (NULL, packing);
+      audio_playback (NULL, packing);
+    }
 
-    printf ("\r");
+    LOG (LOG_MODULE_STATUS, LOG_INFO, "\r");
   }
 
   return NULL;
 }
 
+/* Talk/PTT input changed (or polling tick without a pollable input) */
+static void master_input (void *data, uint32 events)
+{
+  uint32 talk = input_read ();
+  int32 state = __atomic_load_n (&radio_state, __ATOMIC_ACQUIRE);
+
+  if ((state > 0) && (talk == 0))
+  {
+    unkey_time = clock_get_count ();
+    __atomic_store_n (&radio_state, RADIO_STATE_TX_SWITCH, __ATOMIC_RELEASE);
+  }
+  else if ((state < 0) && (talk & (0x1 << INPUT_PTT)))
+  {
+    key_up_time = clock_get_count ();
+    __atomic_store_n (&radio_state, RADIO_STATE_RX_SWITCH, __ATOMIC_RELEASE);
+  }
+}
+
+/* Audio thread has encoded packets ready, notifications coalesce so take all.
+ * Only transmit encodes, so the last ones of an over go out after unkey too */
+static void master_packet (void *data, uint32 events)
+{
+  static link_packet_t packet;
+
+  os_alloc_guard (1);
+  while ((ring_read (link_queue, &packet, 1)) == 1)
+  {
+    serial_send (packet.sequence, packet.timestamp, packet.data, codec_frame_size);
+    link_packets++;
+    link_bytes += codec_frame_size + SERIAL_FRAME_OVERHEAD;
+  }
+  os_alloc_guard (0);
+
+  if (((__atomic_load_n (&radio_state, __ATOMIC_ACQUIRE)) > 0) && (key_up_time >= 0))
+  {
+    LOG (LOG_MODULE_MAIN, LOG_INFO, "\nPTT key-up to first packet %d ms\n",
+         (clock_get_count ()) - key_up_time);
+    key_up_time = -1;
+  }
+}
+
+/* Serial reader has new bytes */
+static void master_serial (void *data, uint32 events)
+{
+  static serial_frame_t serial_frame;
+
+  /* Drain everything the port has, nobody listens while transmitting */
+  os_alloc_guard (1);
+  while ((serial_receive (&serial_frame)) > 0)
+  {
+    if ((__atomic_load_n (&radio_state, __ATOMIC_ACQUIRE)) < 0)
+    {
+      jitter_put (serial_frame.sequence, serial_frame.timestamp, serial_frame.arrival,
+                  serial_frame.payload, serial_frame.bytes);
+    }
+  }
+  os_alloc_guard (0);
+}
+
+/* Audio thread is done, the loop condition does the rest */
+static void master_stop (void *data, uint32 events)
+{
+}
+
 static void master_loop (int32 radio_on)
 {
-  radio_state = RADIO_STATE_TX_SWITCH;
+  void *event = NULL;
+  uint32 input_events = 0;
+  int32 fd = input_fd (&input_events);
+
+  __atomic_store_n (&radio_state, RADIO_STATE_TX_SWITCH, __ATOMIC_RELEASE);
+
+  event_create (&event);
+  master_wake = event_notifier (event, master_stop, NULL);
+
+  /* Input edges wake the loop directly, fall back to polling every 10 ms */
+  if (((fd < 0) || ((event_add (event, fd, input_events, master_input, NULL)) < 0)) &&
+      ((event_timer (event, 10, 1, master_input, NULL)) < 0))
+  {
+    printf ("Unable to watch input\n");
+  }
 
-  os_create_sem (&serial_sync);
   if (radio_on)
   {
+    packet_ready = event_notifier (event, master_packet, NULL);
+
+    /* Port is drained on its own thread in either radio state, and fed from another */
+    serial_reader_start (event_notifier (event, master_serial, NULL));
+    serial_writer_start ();
+
     os_create_thread (audio_main, OS_THREAD_PRIORITY_NORMAL,
                       NULL, &audio_thread);
   }
@@ -176,40 +473,18 @@ static void master_loop (int32 radio_on)
                       NULL, &audio_thread);
   }
 
-  while (1)
+  /* Sleeps until input, serial data or an encoded packet needs attention */
+  while ((__atomic_load_n (&radio_running, __ATOMIC_ACQUIRE)) &&
+         ((event_dispatch (event, -1)) >= 0))
   {
-    uint32 talk = input_read ();
-
-    if ((radio_state > 0) && (talk == 0))
-    {
-      radio_state = RADIO_STATE_TX_SWITCH;
-    }
-    else if ((radio_state < 0) && (talk & (0x1 << INPUT_PTT)))
-    {
-      radio_state = RADIO_STATE_RX_SWITCH;
-    }
-
-    if (radio_on)
-    {
-      if (radio_state > 0)
-      {
-        if ((os_wait_sem (serial_sync, 60)) > 0)
-        {
-          serial_tx (codec_frame_size, codec_buffer);
-        }
-      }
-      else if (radio_state < 0)
-      {
-        if ((serial_rx (codec_frame_size, codec_buffer)) > 0)
-        {
-          os_post_sem (serial_sync);
-        }
-      }
-    }
   }
-  
+
   os_destroy_thread (audio_thread);
-  os_destroy_sem (serial_sync);
+  serial_writer_stop ();
+  serial_reader_stop ();
+  event_destroy (event);
+  packet_ready = -1;
+  master_wake  = -1;
 }
 
 int32 main (int32 argc, int8 * argv[])
@@ -217,7 +492,7 @@ int32 main (int32 argc, int8 * argv[])
   int32 radio_on = 0;
   int32 option;
 
-  while ((option = getopt (argc, argv, "r")) != -1)
+  while ((option = getopt (argc, argv, "rmftqvnALb:i:o:N:D:l:F:d:c:p:s:B:P:S:R:T:")) != -1)
   {
     switch (option)
     {
@@ -226,6 +501,162 @@ int32 main (int32 argc, int8 * argv[])
         radio_on = 1;
         break;
       }
+      case 'm':
+      {
+        audio_option (AUDIO_OPTION_MMAP, 1);
+        break;
+      }
+      case 'f':
+      {
+        audio_duplex = 1;
+        audio_option (AUDIO_OPTION_DUPLEX, 1);
+        break;
+      }
+      case 't':
+      {
+        audio_option (AUDIO_OPTION_THREAD, 1);
+        break;
+      }
+      case 'q':
+      {
+        log_level (LOG_MODULE_STATUS, LOG_WARNING);
+        break;
+      }
+      case 'v':
+      {
+        int32 module;
+
+        for (module = 0; module < NUM_LOG_MODULES; module++)
+        {
+          log_level (module, LOG_DEBUG);
+        }
+        break;
+      }
+      case 'b':
+      {
+        if ((strcmp (optarg, "wav")) == 0)
+        {
+          audio_option (AUDIO_OPTION_BACKEND, AUDIO_BACKEND_WAV);
+        }
+        else if ((strcmp (optarg, "synth")) == 0)
+        {
+          audio_option (AUDIO_OPTION_BACKEND, AUDIO_BACKEND_SYNTH);
+        }
+        else
+        {
+          audio_option (AUDIO_OPTION_BACKEND, AUDIO_BACKEND_ALSA);
+        }
+        break;
+      }
+      case 'A':
+      {
+        vad_enabled = 0;
+        break;
+      }
+      case 'F':
+      {
+        fec_loss = atoi (optarg);
+        codec_option (CODEC_OPTION_FEC, fec_loss);
+        break;
+      }
+      case 'd':
+      {
+        /* Stage letters: h(igh-pass), n(oise suppression), a(gc); "-" for none */
+        dsp_option (DSP_STAGE_HIGHPASS, ((strchr (optarg, 'h')) != NULL));
+        dsp_option (DSP_STAGE_NOISE, ((strchr (optarg, 'n')) != NULL));
+        dsp_option (DSP_STAGE_AGC, ((strchr (optarg, 'a')) != NULL));
+        break;
+      }
+      case 'n':
+      {
+        audio_option (AUDIO_OPTION_PACED, 0);
+        break;
+      }
+      case 'c':
+      {
+        channels = (uint8)atoi (optarg);
+        break;
+      }
+      case 'p':
+      {
+        /* Frame (packet) duration in millisec. */
+        frame_duration = (uint32)atoi (optarg);
+        break;
+      }
+      case 's':
+      {
+        sampling_rate = (uint32)atoi (optarg);
+        break;
+      }
+      case 'B':
+      {
+        codec_option (CODEC_OPTION_BITRATE, atoi (optarg));
+        break;
+      }
+      case 'P':
+      {
+        /* Frames packed into each packet */
+        packing = (uint8)atoi (optarg);
+        break;
+      }
+      case 'S':
+      {
+        /* Serial line rate, any the adapter can do */
+        serial_option (SERIAL_OPTION_BAUD, atoi (optarg));
+        break;
+      }
+      case 'T':
+      {
+        /* Serial port, a pty of linksim say */
+        serial_set_device (optarg);
+        break;
+      }
+      case 'L':
+      {
+        serial_option (SERIAL_OPTION_LOW_LATENCY, 0);
+        break;
+      }
+      case 'R':
+      {
+        probe_duration = (uint32)atoi (optarg);
+        break;
+      }
+      case 'i':
+      {
+        audio_set_device (NULL, optarg);
+        break;
+      }
+      case 'o':
+      {
+        audio_set_device (optarg, NULL);
+        break;
+      }
+      case 'N':
+      {
+        frame_limit = (uint32)atoi (optarg);
+        break;
+      }
+      case 'D':
+      {
+        audio_set_device (optarg, optarg);
+        break;
+      }
+      case 'l':
+      {
+        if ((strcmp (optarg, "low")) == 0)
+        {
+          audio_option (AUDIO_OPTION_LATENCY, AUDIO_LATENCY_LOW);
+        }
+        else if ((strcmp (optarg, "robust")) == 0)
+        {
+          audio_option (AUDIO_OPTION_LATENCY, AUDIO_LATENCY_ROBUST);
+        }
+        else
+        {
+          audio_option (AUDIO_OPTION_LATENCY, AUDIO_LATENCY_BALANCED);
+        }
+        break;
+      }
       default:
       {
         printf ("Unknown option -%c\n", option);
@@ -235,19 +666,114 @@ int32 main (int32 argc, int8 * argv[])
   }
 
   os_init ();
+  log_init ();
   
-  if (((input_init ()) > 0) &&
-      ((audio_init (CHANNELS, FRAME_DURATION, SAMPLING_RATE)) > 0) &&
-      ((codec_init (CHANNELS, FRAME_DURATION, SAMPLING_RATE)) > 0) &&
-      ((serial_open ()) > 0))
+  if ((channels < 1) || (channels > 2) || (frame_duration == 0) ||
+      (packing < 1) || (packing > AUDIO_MAX_FRAMES))
+  {
+    printf ("Unsupported format, %u channels, %u ms frames, %u per packet\n",
+            channels, frame_duration, packing);
+  }
+  else if (((input_init ()) > 0) &&
+           ((codec_create (channels, frame_duration, sampling_rate, &codec)) > 0) &&
+           ((codec_decoder_create (codec, &talker)) > 0) &&
+           ((buffer_init ()) > 0) &&
+           ((audio_init (channels, frame_duration, sampling_rate)) > 0) &&
+           ((dsp_init (channels, frame_duration, sampling_rate)) > 0) &&
+           ((!vad_enabled) || ((vad_init (channels, frame_duration, sampling_rate)) > 0)) &&
+           ((jitter_init (packing * frame_duration, (fec_loss > 0) ? 2 : 1)) > 0) &&
+           ((!radio_on) || ((serial_open ()) > 0)))
   {
+    uint32 link_frame = codec_frame_size + SERIAL_FRAME_OVERHEAD;
+    int32 link_delay = (link_frame * 1000)/(serial_rate ());
+    uint32 packet_duration = packing * frame_duration;
+    uint32 payload = packing * ((codec_packetsize (codec, 1)) - 1);
+    dsp_stats_t dsp;
+
+    /* Coded audio against what the link carries, the rest is packet framing */
+    printf ("Voice %u Hz, %u channels, %u ms frames, %u per %u byte packet, "
+            "%u packets/s, %u bps on the link, %u%% payload\n",
+            sampling_rate, channels, frame_duration, packing, link_frame,
+            1000/packet_duration, (link_frame * 8000)/packet_duration,
+            (payload * 100)/link_frame);
+
+    /* Packet accumulation, voice DSP, encoder lookahead, link transfer and both sound card paths */
+    printf ("Mouth-to-ear budget %d ms (frame %d, dsp %d, codec %d, link %d, audio %d)\n",
+            packet_duration + (dsp_delay ()) + (codec_delay (codec)) + link_delay
+            + (audio_latency ()),
+            packet_duration, dsp_delay (), codec_delay (codec), link_delay, audio_latency ());
+
+    if ((radio_on) && (probe_duration > 0))
+    {
+      serial_probe_t probe;
+
+      /* What the link really carries against what this format needs of it */
+      if ((serial_probe (probe_duration, &probe)) > 0)
+      {
+        uint32 needed = (link_frame * 1000)/packet_duration;
+
+        printf ("Link probe: %u of %u returned, round trip %u ms (%u to %u ms), "
+                "%u bytes/s, voice needs %u bytes/s\n", probe.returned, probe.sent,
+                probe.rtt, probe.rtt_min, probe.rtt_max, probe.throughput, needed);
+
+        if (needed > probe.throughput)
+        {
+          printf ("Link probe: too slow for this format, lower the bitrate (-B) "
+                  "or pack more frames (-P)\n");
+        }
+      }
+    }
+
     master_loop (radio_on);
+
+    dsp_stats (&dsp);
+    if (dsp.frames > 0)
+    {
+      /* CPU time per frame against the real-time budget of one frame */
+      printf ("\nVoice DSP per frame: high-pass %u us, noise %u us, AGC %u us, "
+              "total %u us (%u.%02u%% of %d ms)\n",
+              dsp.stage[DSP_STAGE_HIGHPASS], dsp.stage[DSP_STAGE_NOISE],
+              dsp.stage[DSP_STAGE_AGC], dsp.total, dsp.total/(frame_duration * 10),
+              ((dsp.total * 10)/frame_duration) % 100, frame_duration);
+    }
+
+    if (radio_on)
+    {
+      jitter_stats_t jitter;
+      codec_stats_t decoded;
+      serial_stats_t link;
+
+      jitter_stats (&jitter);
+      codec_stats (talker, &decoded);
+      serial_stats (&link);
+      printf ("Jitter buffer: %u received, %u late, %u lost, %u inserted, %u dropped, "
+              "jitter %u ms\n", jitter.received, jitter.late, jitter.lost,
+              jitter.inserted, jitter.dropped, jitter.jitter);
+      printf ("Decoder: %u frames decoded, %u recovered by FEC, %u concealed\n",
+              decoded.decoded, decoded.recovered, decoded.concealed);
+
+      printf ("Link: %u packets, %u bytes sent, %u of them coded audio, "
+              "%u dropped before the link\n", link_packets, link_bytes,
+              link_packets * payload, link_dropped);
+      printf ("Link: %u packets in %u writes, %u dropped, queueing %u ms (max %u ms), "
+              "flow control held %u ms\n", link.sent, link.tx_writes, link.tx_dropped,
+              link.tx_delay, link.tx_delay_max, link.flow_held);
+      printf ("Link: %u bytes received, %u overflowed, %u frames, %u lost, "
+              "%u header and %u CRC errors, %u bytes skipped\n", link.bytes, link.overflow,
+              link.frames, link.lost, link.header_errors, link.crc_errors, link.skipped);
+    }
   }
 
   serial_close ();
-  codec_deinit ();
+  jitter_deinit ();
+  vad_deinit ();
+  dsp_deinit ();
+  codec_decoder_destroy (talker);
+  codec_destroy (codec);
   audio_deinit ();
+  buffer_deinit ();
   input_deinit ();
+  log_deinit ();
 
   return 0;
 }
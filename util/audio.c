@@ -1,50 +1,546 @@
 
 /* System headers */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 
 /* Local/project headers */
 #include "types.h"
 #include "util.h"
+#include "audio.h"
 
-/* PCM device */
+/* Default PCM device */
 #define PLAYBACK_DEVICE    "hw:0,0"
 #define CAPTURE_DEVICE     "hw:0,0"
 
-/* HW sampling rate in Hz, frame duration in millisec */
-#define HW_SAMPLING_RATE                   (48000)
-#define SAMPLES_PER_FRAME(frame_duration)  ((HW_SAMPLING_RATE * frame_duration)/1000)
+/* Poll descriptors per PCM the I/O thread can watch */
+#define AUDIO_MAX_POLL_FDS  (4)
+
+/* Fallback HW sampling rate in Hz and channels, when the codec's are not supported */
+#define HW_SAMPLING_RATE  (48000)
+#define HW_CHANNELS       (2)
+
+/* Highest HW to codec rate ratio probed for */
+#define HW_MAX_RATIO      (6)
+
+/* Samples per frame at rate Hz, frame duration in millisec */
+#define SAMPLES_PER_FRAME(rate, frame_duration)  ((rate * frame_duration)/1000)
 
 /* Local structures */
 typedef struct
 {
-  snd_pcm_t     *playback_handle;
-  snd_pcm_t     *capture_handle;
-  unsigned char  channels;
-  unsigned int   frame_duration;
-  unsigned char  resample;
-  unsigned int   samples;
-  short int      prev_playback[2];
+  char          *name;
+  unsigned int   period_time;
+  unsigned int   periods;
+  unsigned int   start_periods;
+  unsigned int   avail_periods;
+} audio_profile_t;
+
+typedef struct
+{
+  const audio_backend_t *backend;
+  snd_pcm_t         *playback_handle;
+  snd_pcm_t         *capture_handle;
+  char              *playback_name;
+  char              *capture_name;
+  int                options[NUM_AUDIO_OPTIONS];
+  int                playback_mmap;
+  int                capture_mmap;
+  snd_pcm_uframes_t  playback_size;
+  snd_pcm_uframes_t  playback_threshold;
+  snd_pcm_uframes_t  capture_period;
+  unsigned char      channels;
+  unsigned int       frame_duration;
+  unsigned int       hw_rate;
+  unsigned char      hw_channels;
+  int                native;
+  unsigned char      resample;
+  unsigned int       samples;
+  void              *playback_resample;
+  void              *capture_resample;
+  short int         *playback_buffer;
+  short int         *capture_buffer;
+  void              *io_thread;
+  int                io_running;
+  int                playback_active;
+  int                capture_active;
+  void              *playback_ring;
+  void              *capture_ring;
+  void              *io_event;
+  int                io_wake;
+  struct pollfd      io_poll[AUDIO_MAX_POLL_FDS];
+  int                io_polls;
+  void              *capture_sem;
+  void              *playback_space;
+  int                playback_waiting;
+  short int         *io_playback;
+  short int         *io_capture;
+  short int         *io_silence;
+  unsigned int       playback_overflow;
+  unsigned int       capture_overflow;
+  short int         *playback_silence;
+  audio_health_t     health;
 } audio_device_t;
 
 /* File scope global variables */
+static const audio_profile_t audio_profile[NUM_AUDIO_LATENCY] =
+{
+  /* Period time (us), periods per buffer, playback start and capture wake-up in periods */
+  [AUDIO_LATENCY_LOW] =
+    {
+      .name          = "low-latency",
+      .period_time   = 5000,
+      .periods       = 4,
+      .start_periods = 2,
+      .avail_periods = 1
+    },
+  [AUDIO_LATENCY_BALANCED] =
+    {
+      .name          = "balanced",
+      .period_time   = 10000,
+      .periods       = 4,
+      .start_periods = 2,
+      .avail_periods = 1
+    },
+  [AUDIO_LATENCY_ROBUST] =
+    {
+      .name          = "robust",
+      .period_time   = 20000,
+      .periods       = 6,
+      .start_periods = 3,
+      .avail_periods = 1
+    }
+};
+
 static audio_device_t audio_device =
 {
-  .playback_handle = NULL,
-  .capture_handle  = NULL,
-  .channels        = 2,
-  .frame_duration  = 0,
-  .resample        = 1,
-  .samples         = 0,
-  .prev_playback   = {-1, -1}
+  .backend            = NULL,
+  .playback_handle    = NULL,
+  .capture_handle     = NULL,
+  .playback_name      = NULL,
+  .capture_name       = NULL,
+  .options            =
+    {
+      [AUDIO_OPTION_MMAP]    = 0,
+      [AUDIO_OPTION_DUPLEX]  = 0,
+      [AUDIO_OPTION_LATENCY] = AUDIO_LATENCY_BALANCED,
+      [AUDIO_OPTION_THREAD]  = 0,
+      [AUDIO_OPTION_BACKEND] = AUDIO_BACKEND_ALSA,
+      [AUDIO_OPTION_PACED]   = 1
+    },
+  .playback_mmap      = 0,
+  .capture_mmap       = 0,
+  .playback_size      = 0,
+  .playback_threshold = 0,
+  .capture_period     = 0,
+  .channels           = 2,
+  .frame_duration     = 0,
+  .hw_rate            = HW_SAMPLING_RATE,
+  .hw_channels        = HW_CHANNELS,
+  .native             = 0,
+  .resample           = 1,
+  .samples            = 0,
+  .playback_resample  = NULL,
+  .capture_resample   = NULL,
+  .playback_buffer    = NULL,
+  .capture_buffer     = NULL,
+  .io_thread          = NULL,
+  .io_running         = 0,
+  .playback_active    = 0,
+  .capture_active     = 0,
+  .playback_ring      = NULL,
+  .capture_ring       = NULL,
+  .io_event           = NULL,
+  .io_wake            = -1,
+  .io_polls           = 0,
+  .capture_sem        = NULL,
+  .playback_space     = NULL,
+  .playback_waiting   = 0,
+  .io_playback        = NULL,
+  .io_capture         = NULL,
+  .io_silence         = NULL,
+  .playback_overflow  = 0,
+  .capture_overflow   = 0,
+  .playback_silence   = NULL,
+  .health             = {0}
 };
 
 
-int32 audio_playback_pause (int32 pause)
+int32 audio_option (int32 option, int32 value)
+{
+  int status = -1;
+
+  if ((option >= 0) && (option < NUM_AUDIO_OPTIONS) && (audio_device.backend == NULL))
+  {
+    audio_device.options[option] = value;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set audio option %d\n", option);
+  }
+
+  return status;
+}
+
+int32 audio_set_device (int8 *playback_name, int8 *capture_name)
 {
   int status = -1;
 
-  if (pause)
+  if (audio_device.backend == NULL)
+  {
+    if (playback_name != NULL)
+    {
+      audio_device.playback_name = playback_name;
+    }
+    if (capture_name != NULL)
+    {
+      audio_device.capture_name = capture_name;
+    }
+
+    status = 1;
+  }
+
+  return status;
+}
+
+/* Only (re)prepare a duplex stream that is not already flowing */
+static int audio_duplex_resume (snd_pcm_t *handle, int pause)
+{
+  int status = 1;
+  snd_pcm_state_t state = snd_pcm_state (handle);
+
+  if ((!pause) && (state != SND_PCM_STATE_RUNNING) && (state != SND_PCM_STATE_PREPARED))
+  {
+    if ((snd_pcm_prepare (handle)) < 0)
+    {
+      printf ("Unable to start duplex stream\n");
+      status = -1;
+    }
+  }
+
+  return status;
+}
+
+/* Wait for the stream to have room/data, starting it if it is only prepared */
+static int audio_mmap_avail (snd_pcm_t *handle, snd_pcm_uframes_t wanted)
+{
+  snd_pcm_sframes_t avail;
+  int status;
+
+  while (1)
+  {
+    if ((avail = snd_pcm_avail_update (handle)) < 0)
+    {
+      status = (int)avail;
+      break;
+    }
+    else if ((snd_pcm_uframes_t)avail >= wanted)
+    {
+      status = (int)avail;
+      break;
+    }
+    else if ((snd_pcm_state (handle)) == SND_PCM_STATE_PREPARED)
+    {
+      /* Capture needs an explicit start in mmap mode; a prepared playback
+       * stream with no room left has a full buffer, so start it as well */
+      if ((status = snd_pcm_start (handle)) < 0)
+      {
+        break;
+      }
+    }
+    else if ((status = snd_pcm_wait (handle, 2 * audio_device.frame_duration)) < 0)
+    {
+      break;
+    }
+  }
+
+  return status;
+}
+
+static unsigned int audio_clock_us (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (unsigned int)((now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+}
+
+/* Queue silence up to the start threshold so a recovered playback stream
+ * restarts with the same cushion it was primed with */
+static void audio_playback_prime (void)
+{
+  snd_pcm_uframes_t pending = audio_device.playback_threshold;
+
+  if (audio_device.playback_mmap)
+  {
+    while (pending > 0)
+    {
+      const snd_pcm_channel_area_t *area;
+      snd_pcm_uframes_t offset;
+      snd_pcm_uframes_t frames = pending;
+
+      if (((snd_pcm_avail_update (audio_device.playback_handle)) < 0) ||
+          ((snd_pcm_mmap_begin (audio_device.playback_handle, &area, &offset, &frames)) < 0) ||
+          (frames == 0))
+      {
+        break;
+      }
+
+      memset (((unsigned char *)area[0].addr) + ((area[0].first + (offset * area[0].step))/8),
+              0, frames * audio_device.hw_channels * sizeof (short int));
+
+      if ((snd_pcm_mmap_commit (audio_device.playback_handle, offset, frames)) < 0)
+      {
+        break;
+      }
+
+      pending -= frames;
+    }
+
+    snd_pcm_start (audio_device.playback_handle);
+  }
+  else if ((pending > 0) && (audio_device.playback_silence != NULL))
+  {
+    snd_pcm_writei (audio_device.playback_handle, audio_device.playback_silence, pending);
+  }
+}
+
+/* Recover from xrun/suspend without losing the stream set-up, counted and timed */
+static int audio_recover (snd_pcm_t *handle, int error)
+{
+  int playback = (handle == audio_device.playback_handle);
+  unsigned int start = audio_clock_us ();
+  unsigned int elapsed;
+  int status;
+
+  if (error == -EPIPE)
+  {
+    __atomic_add_fetch (playback ? &(audio_device.health.playback_underruns)
+                                 : &(audio_device.health.capture_overruns), 1,
+                        __ATOMIC_RELAXED);
+  }
+  else if (error == -ESTRPIPE)
+  {
+    __atomic_add_fetch (&(audio_device.health.suspends), 1, __ATOMIC_RELAXED);
+  }
+
+  LOG (LOG_MODULE_AUDIO, LOG_WARNING,
+       playback ? " | Playback error %d, recovering\n" : " | Capture error %d, recovering\n",
+       error);
+
+  if ((status = snd_pcm_recover (handle, error, 1)) < 0)
+  {
+    LOG (LOG_MODULE_AUDIO, LOG_ERROR,
+         playback ? "Unable to recover playback, %d\n" : "Unable to recover capture, %d\n",
+         status);
+  }
+  else if (playback)
+  {
+    audio_playback_prime ();
+  }
+
+  elapsed = (audio_clock_us ()) - start;
+  __atomic_add_fetch (&(audio_device.health.recovery_time), elapsed, __ATOMIC_RELAXED);
+  if (elapsed > audio_device.health.recovery_max)
+  {
+    __atomic_store_n (&(audio_device.health.recovery_max), elapsed, __ATOMIC_RELAXED);
+  }
+
+  return status;
+}
+
+static void audio_alsa_health (audio_health_t *health)
+{
+  health->playback_underruns = __atomic_load_n (&(audio_device.health.playback_underruns),
+                                                __ATOMIC_RELAXED);
+  health->capture_overruns   = __atomic_load_n (&(audio_device.health.capture_overruns),
+                                                __ATOMIC_RELAXED);
+  health->suspends           = __atomic_load_n (&(audio_device.health.suspends),
+                                                __ATOMIC_RELAXED);
+  health->recovery_time      = __atomic_load_n (&(audio_device.health.recovery_time),
+                                                __ATOMIC_RELAXED);
+  health->recovery_max       = __atomic_load_n (&(audio_device.health.recovery_max),
+                                                __ATOMIC_RELAXED);
+  health->ring_overflows     = audio_device.playback_overflow + audio_device.capture_overflow;
+}
+
+/* Interpolate straight into the playback DMA area */
+static int audio_playback_mmap (short int *frame_buffer, unsigned int samples_pending)
+{
+  int status = 1;
+  unsigned int resample = audio_device.resample;
+  unsigned int hw_channels = audio_device.hw_channels;
+  unsigned int input_pending = (frame_buffer != NULL) ? (samples_pending/resample) : 0;
+  unsigned int silence_pending = (frame_buffer != NULL) ? 0 : samples_pending;
+  unsigned int stage_offset = 0;
+  unsigned int stage_pending = 0;
+  short int *stage = audio_device.playback_buffer;
+
+  while (((input_pending > 0) || (stage_pending > 0) || (silence_pending > 0)) &&
+         (status >= 0))
+  {
+    const snd_pcm_channel_area_t *area;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t done = 0;
+    short int *dma;
+
+    if ((status = audio_mmap_avail (audio_device.playback_handle, 1)) < 0)
+    {
+      status = audio_recover (audio_device.playback_handle, status);
+      continue;
+    }
+
+    frames = (snd_pcm_uframes_t)status;
+    if ((status = snd_pcm_mmap_begin (audio_device.playback_handle,
+                                      &area, &offset, &frames)) < 0)
+    {
+      status = audio_recover (audio_device.playback_handle, status);
+      continue;
+    }
+
+    dma = (short int *)(((unsigned char *)area[0].addr)
+                        + ((area[0].first + (offset * area[0].step))/8));
+
+    /* Flush the tail of a sample split over the ring wrap */
+    if (stage_pending > 0)
+    {
+      done = (stage_pending < frames) ? stage_pending : frames;
+      memcpy (dma, &(stage[hw_channels*stage_offset]), hw_channels * done * sizeof (short int));
+      stage_offset  += done;
+      stage_pending -= done;
+    }
+
+    if (silence_pending > 0)
+    {
+      unsigned int copy = ((frames - done) < silence_pending) ? (frames - done) : silence_pending;
+
+      memset (&(dma[hw_channels*done]), 0, hw_channels * copy * sizeof (short int));
+      silence_pending -= copy;
+      done            += copy;
+    }
+    else if ((input_pending > 0) && ((frames - done) >= resample))
+    {
+      unsigned int input = (frames - done)/resample;
+
+      input = (input < input_pending) ? input : input_pending;
+      done += resample_process (audio_device.playback_resample, frame_buffer, input,
+                                audio_device.channels, &(dma[hw_channels*done]), hw_channels);
+      frame_buffer  += input * audio_device.channels;
+      input_pending -= input;
+    }
+    else if ((input_pending > 0) && (frames > done))
+    {
+      unsigned int copy = frames - done;
+
+      resample_process (audio_device.playback_resample, frame_buffer, 1,
+                        audio_device.channels, stage, hw_channels);
+      memcpy (&(dma[hw_channels*done]), stage, hw_channels * copy * sizeof (short int));
+      frame_buffer  += audio_device.channels;
+      input_pending -= 1;
+      stage_offset   = copy;
+      stage_pending  = resample - copy;
+      done          += copy;
+    }
+
+    if ((status = snd_pcm_mmap_commit (audio_device.playback_handle,
+                                       offset, done)) >= 0)
+    {
+      snd_pcm_sframes_t avail = snd_pcm_avail_update (audio_device.playback_handle);
+
+      /* No automatic start for mmap access, honour the start threshold here */
+      if (((snd_pcm_state (audio_device.playback_handle)) == SND_PCM_STATE_PREPARED) &&
+          (avail >= 0) &&
+          ((audio_device.playback_size - (snd_pcm_uframes_t)avail)
+           >= audio_device.playback_threshold))
+      {
+        snd_pcm_start (audio_device.playback_handle);
+      }
+    }
+    else
+    {
+      status = audio_recover (audio_device.playback_handle, status);
+    }
+  }
+
+  return (status < 0) ? status : (int)samples_pending;
+}
+
+/* Decimate straight out of the capture DMA area */
+static int audio_capture_mmap (short int *frame_buffer, unsigned int samples_pending,
+                               unsigned int *output)
+{
+  int status = 1;
+  unsigned int samples_read = 0;
+  unsigned int samples_total = samples_pending;
+  short int *frame_start = frame_buffer;
+
+  while ((samples_pending > 0) && (status >= 0))
+  {
+    const snd_pcm_channel_area_t *area;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames;
+    short int *dma;
+
+    if ((status = audio_mmap_avail (audio_device.capture_handle, 1)) >= 0)
+    {
+      frames = ((unsigned int)status < samples_pending) ? (unsigned int)status : samples_pending;
+      status = snd_pcm_mmap_begin (audio_device.capture_handle, &area, &offset, &frames);
+    }
+
+    if (status >= 0)
+    {
+      dma = (short int *)(((unsigned char *)area[0].addr)
+                          + ((area[0].first + (offset * area[0].step))/8));
+
+      /* No destination means the frame is discarded */
+      if (frame_buffer != NULL)
+      {
+        unsigned int count = resample_process (audio_device.capture_resample, dma, frames,
+                                               audio_device.hw_channels,
+                                               frame_buffer, audio_device.channels);
+
+        frame_buffer += count * audio_device.channels;
+        *output      += count;
+      }
+
+      if ((status = snd_pcm_mmap_commit (audio_device.capture_handle,
+                                         offset, frames)) >= 0)
+      {
+        samples_read    += frames;
+        samples_pending -= frames;
+      }
+    }
+
+    if (status < 0)
+    {
+      /* Whatever was read before the gap is dropped, the frame restarts */
+      status          = audio_recover (audio_device.capture_handle, status);
+      frame_buffer    = frame_start;
+      samples_read    = 0;
+      samples_pending = samples_total;
+      *output         = 0;
+    }
+  }
+
+  return (status < 0) ? status : (int)samples_read;
+}
+
+static int audio_playback_stream (int pause)
+{
+  int status = -1;
+
+  if (audio_device.options[AUDIO_OPTION_DUPLEX])
+  {
+    /* Stream keeps running, caller feeds silence while paused */
+    status = audio_duplex_resume (audio_device.playback_handle, pause);
+  }
+  else if (pause)
   {
     if ((status = snd_pcm_drop (audio_device.playback_handle)) == 0)
     {
@@ -70,11 +566,16 @@ int32 audio_playback_pause (int32 pause)
   return status;
 }
 
-int32 audio_capture_pause (int32 pause)
+static int audio_capture_stream (int pause)
 {
   int status = -1;
 
-  if (pause)
+  if (audio_device.options[AUDIO_OPTION_DUPLEX])
+  {
+    /* Stream keeps running, caller discards capture while paused */
+    status = audio_duplex_resume (audio_device.capture_handle, pause);
+  }
+  else if (pause)
   {
     if ((status = snd_pcm_drop (audio_device.capture_handle)) == 0)
     {
@@ -100,177 +601,650 @@ int32 audio_capture_pause (int32 pause)
   return status;
 }
 
-int32 audio_playback (int16 *frame_buffer, uint8 frames)
+static int32 audio_alsa_playback_delay (void)
+{
+  snd_pcm_sframes_t delay = 0;
+
+  if ((snd_pcm_delay (audio_device.playback_handle, &delay)) < 0)
+  {
+    delay = 0;
+  }
+
+  if (audio_device.io_thread != NULL)
+  {
+    delay += (ring_count (audio_device.playback_ring)) * audio_device.resample;
+  }
+
+  return (int32)((delay * 1000)/audio_device.hw_rate);
+}
+
+static int32 audio_alsa_latency (void)
+{
+  unsigned int frames;
+
+  /* Capture waits up to a period, playback runs primed to its start threshold */
+  frames = audio_device.capture_period + audio_device.playback_threshold
+           + (resample_delay (audio_device.capture_resample))
+           + (resample_delay (audio_device.playback_resample));
+
+  return (int32)((frames * 1000)/audio_device.hw_rate);
+}
+
+/* Resample and write HW frames to the device, blocking */
+static int audio_playback_hw (short int *frame_buffer, unsigned int samples_pending)
+{
+  int status = -1;
+  unsigned int samples_written = 0;
+  short int *buffer = audio_device.playback_buffer;
+
+  if ((samples_pending > 0) && (audio_device.playback_mmap))
+  {
+    status = audio_playback_mmap (frame_buffer, samples_pending);
+    samples_pending = 0;
+  }
+  else if ((samples_pending > 0) && (frame_buffer == NULL))
+  {
+    memset (buffer, 0, audio_device.hw_channels * samples_pending * sizeof (short int));
+  }
+  else if ((samples_pending > 0) && (audio_device.native))
+  {
+    /* Device takes the codec format as is */
+    buffer = frame_buffer;
+  }
+  else if (samples_pending > 0)
+  {
+    resample_process (audio_device.playback_resample, frame_buffer,
+                      samples_pending/audio_device.resample,
+                      audio_device.channels, buffer, audio_device.hw_channels);
+  }
+
+  while (samples_pending > 0)
+  {
+    LOG (LOG_MODULE_AUDIO, LOG_DEBUG, " | Playback samples available %d\n",
+         (int)snd_pcm_avail (audio_device.playback_handle));
+    if ((status = snd_pcm_writei (audio_device.playback_handle,
+                                  &(buffer[audio_device.hw_channels*samples_written]),
+                                  samples_pending)) >= 0)
+    {
+      samples_written += status;
+      samples_pending -= status;
+    }
+    else if ((status = audio_recover (audio_device.playback_handle, status)) < 0)
+    {
+      break;
+    }
+  }
+
+  return status;
+}
+
+/* Read HW frames from the device and resample, blocking */
+static int audio_capture_hw (short int *frame_buffer, unsigned int samples_pending,
+                             unsigned int *output)
+{
+  int status = -1;
+  unsigned int samples_read = 0;
+  short int *buffer = audio_device.capture_buffer;
+  short int *frame_start = frame_buffer;
+
+  *output = 0;
+
+  if ((samples_pending > 0) && (audio_device.capture_mmap))
+  {
+    status = audio_capture_mmap (frame_buffer, samples_pending, output);
+    samples_pending = 0;
+  }
+
+  while (samples_pending > 0)
+  {
+    /* Sub-frame periods are resampled as they arrive and accumulated */
+    unsigned int chunk = ((audio_device.capture_period > 0) &&
+                          (audio_device.capture_period < samples_pending))
+                         ? audio_device.capture_period : samples_pending;
+
+    LOG (LOG_MODULE_AUDIO, LOG_DEBUG, " | Capture samples available %d",
+         (int)snd_pcm_avail (audio_device.capture_handle));
+    /* Native format reads land in the caller's frame directly */
+    if ((frame_buffer != NULL) && (audio_device.native))
+    {
+      buffer = frame_buffer;
+    }
+
+    if ((status = snd_pcm_readi (audio_device.capture_handle, buffer, chunk)) >= 0)
+    {
+      if ((frame_buffer != NULL) && (audio_device.native))
+      {
+        frame_buffer += status * audio_device.channels;
+        *output      += status;
+      }
+      else if (frame_buffer != NULL)
+      {
+        unsigned int count = resample_process (audio_device.capture_resample, buffer, status,
+                                               audio_device.hw_channels,
+                                               frame_buffer, audio_device.channels);
+
+        frame_buffer += count * audio_device.channels;
+        *output      += count;
+      }
+
+      samples_read    += status;
+      samples_pending -= status;
+    }
+    else if ((status = audio_recover (audio_device.capture_handle, status)) < 0)
+    {
+      break;
+    }
+    else
+    {
+      /* Realign, the frame restarts with audio from after the gap */
+      frame_buffer     = frame_start;
+      samples_pending += samples_read;
+      samples_read     = 0;
+      *output          = 0;
+    }
+  }
+
+  return ((status < 0) || (samples_read == 0)) ? status : (int)samples_read;
+}
+
+/* Capture PCM descriptor fired, read one period once ALSA agrees it is ready */
+static void audio_io_capture (void *data, uint32 events)
+{
+  struct pollfd *poll_fd = data;
+  unsigned short revents = 0;
+  unsigned int period = audio_device.capture_period;
+  unsigned int count;
+
+  period = ((period > 0) && (period < audio_device.samples)) ? period : audio_device.samples;
+
+  /* Plugins may signal on their own descriptors, let ALSA translate */
+  poll_fd->revents = ((events & EVENT_READ) ? POLLIN : 0) | ((events & EVENT_WRITE) ? POLLOUT : 0)
+                     | ((events & EVENT_ERROR) ? POLLERR : 0);
+  snd_pcm_poll_descriptors_revents (audio_device.capture_handle, audio_device.io_poll,
+                                    audio_device.io_polls, &revents);
+  poll_fd->revents = 0;
+
+  /* Errors are recovered by the read itself */
+  if ((revents & (POLLIN | POLLERR)) &&
+      ((audio_capture_hw (audio_device.io_capture, period, &count)) > 0) &&
+      (__atomic_load_n (&(audio_device.capture_active), __ATOMIC_ACQUIRE)))
+  {
+    if ((ring_write (audio_device.capture_ring, audio_device.io_capture, count)) < count)
+    {
+      audio_device.capture_overflow++;
+    }
+
+    os_post_sem (audio_device.capture_sem);
+  }
+}
+
+/* Codec thread handed over playback data or a stream state change */
+static void audio_io_wake (void *data, uint32 events)
+{
+}
+
+/* Watch (or stop watching) the capture PCM, it only signals while running */
+static void audio_io_capture_watch (int watch)
+{
+  int count;
+
+  if (watch)
+  {
+    if ((snd_pcm_state (audio_device.capture_handle)) == SND_PCM_STATE_PREPARED)
+    {
+      snd_pcm_start (audio_device.capture_handle);
+    }
+
+    audio_device.io_polls = snd_pcm_poll_descriptors (audio_device.capture_handle,
+                                                      audio_device.io_poll, AUDIO_MAX_POLL_FDS);
+    for (count = 0; count < audio_device.io_polls; count++)
+    {
+      struct pollfd *poll_fd = &(audio_device.io_poll[count]);
+
+      event_add (audio_device.io_event, poll_fd->fd,
+                 ((poll_fd->events & POLLIN) ? EVENT_READ : 0)
+                 | ((poll_fd->events & POLLOUT) ? EVENT_WRITE : 0),
+                 audio_io_capture, poll_fd);
+    }
+  }
+  else
+  {
+    for (count = 0; count < audio_device.io_polls; count++)
+    {
+      event_remove (audio_device.io_event, audio_device.io_poll[count].fd);
+    }
+
+    audio_device.io_polls = 0;
+  }
+}
+
+/* Real-time I/O thread, moves PCM between the device and the rings */
+static void * audio_io_main (void *data)
+{
+  int capture_active = 0;
+  int playback_active = 0;
+  unsigned int frame = audio_device.samples/audio_device.resample;
+
+  /* A duplex capture stream keeps flowing, it is just not handed over */
+  if (audio_device.options[AUDIO_OPTION_DUPLEX])
+  {
+    audio_io_capture_watch (1);
+  }
+
+  while (__atomic_load_n (&(audio_device.io_running), __ATOMIC_ACQUIRE))
+  {
+    int capture = __atomic_load_n (&(audio_device.capture_active), __ATOMIC_ACQUIRE);
+    int playback = __atomic_load_n (&(audio_device.playback_active), __ATOMIC_ACQUIRE);
+    unsigned int count;
+
+    /* Stream state changes are applied here, never under a blocking call */
+    if (capture != capture_active)
+    {
+      if (!(audio_device.options[AUDIO_OPTION_DUPLEX]))
+      {
+        audio_io_capture_watch (0);
+      }
+
+      audio_capture_stream (!capture);
+      capture_active = capture;
+
+      if ((capture_active) && (!(audio_device.options[AUDIO_OPTION_DUPLEX])))
+      {
+        audio_io_capture_watch (1);
+      }
+    }
+
+    if (playback != playback_active)
+    {
+      if (!playback)
+      {
+        ring_read (audio_device.playback_ring, NULL, ring_count (audio_device.playback_ring));
+      }
+
+      audio_playback_stream (!playback);
+      playback_active = playback;
+    }
+
+    /* Sleep until capture data, playback data or a state change */
+    if ((!playback_active) || ((ring_count (audio_device.playback_ring)) == 0))
+    {
+      event_dispatch (audio_device.io_event, 2 * audio_device.frame_duration);
+    }
+
+    if (playback_active)
+    {
+      while ((count = ring_read (audio_device.playback_ring,
+                                 audio_device.io_playback, frame)) > 0)
+      {
+        /* Only a producer blocked on a full ring is woken, posts don't pile up */
+        if (__atomic_exchange_n (&(audio_device.playback_waiting), 0, __ATOMIC_SEQ_CST))
+        {
+          os_post_sem (audio_device.playback_space);
+        }
+
+        audio_playback_hw (audio_device.io_playback, count * audio_device.resample);
+
+        /* Each write may block for a period, keep capture serviced in between */
+        event_dispatch (audio_device.io_event, 0);
+      }
+    }
+  }
+
+  audio_io_capture_watch (0);
+
+  return NULL;
+}
+
+static int32 audio_alsa_playback_pause (int32 pause)
+{
+  int status = 1;
+
+  if (audio_device.io_thread != NULL)
+  {
+    __atomic_store_n (&(audio_device.playback_active), !pause, __ATOMIC_RELEASE);
+    event_notify (audio_device.io_wake);
+  }
+  else
+  {
+    status = audio_playback_stream (pause);
+  }
+
+  return status;
+}
+
+static int32 audio_alsa_capture_pause (int32 pause)
+{
+  int status = 1;
+
+  if (audio_device.io_thread != NULL)
+  {
+    /* Consumer side, drop whatever was left over from the last burst */
+    if (!pause)
+    {
+      ring_read (audio_device.capture_ring, NULL, ring_count (audio_device.capture_ring));
+    }
+
+    __atomic_store_n (&(audio_device.capture_active), !pause, __ATOMIC_RELEASE);
+    event_notify (audio_device.io_wake);
+  }
+  else
+  {
+    status = audio_capture_stream (pause);
+  }
+
+  return status;
+}
+
+static int32 audio_alsa_playback (int16 *frame_buffer, uint8 frames)
+{
+  int status = -1;
+  unsigned int samples_pending = audio_device.samples * frames;
+
+  if (frames > AUDIO_MAX_FRAMES)
+  {
+    LOG (LOG_MODULE_AUDIO, LOG_ERROR, "Playback of %d frames exceeds maximum %d\n",
+         frames, AUDIO_MAX_FRAMES);
+  }
+  else if (audio_device.io_thread != NULL)
+  {
+    unsigned int pending = samples_pending/audio_device.resample;
+    unsigned int frame = audio_device.samples/audio_device.resample;
+
+    /* Producer side, NULL queues silence */
+    status = 0;
+    while (pending > 0)
+    {
+      unsigned int count = (pending < frame) ? pending : frame;
+      int16 *source = (frame_buffer != NULL) ? frame_buffer : audio_device.io_silence;
+      unsigned int written = ring_write (audio_device.playback_ring, source, count);
+
+      event_notify (audio_device.io_wake);
+
+      /* Ring full, block like a device write would until the I/O thread drains it;
+       * the flag goes up before the second try so a drain in between still posts */
+      if (written == 0)
+      {
+        __atomic_store_n (&(audio_device.playback_waiting), 1, __ATOMIC_SEQ_CST);
+
+        if (((written = ring_write (audio_device.playback_ring, source, count)) > 0) ||
+            ((os_wait_sem (audio_device.playback_space, 2 * audio_device.frame_duration)) <= 0))
+        {
+          /* Not waiting any more, absorb a post that raced with that */
+          if (!(__atomic_exchange_n (&(audio_device.playback_waiting), 0, __ATOMIC_ACQ_REL)))
+          {
+            os_wait_sem (audio_device.playback_space, 0);
+          }
+
+          if (written == 0)
+          {
+            audio_device.playback_overflow++;
+            break;
+          }
+        }
+      }
+
+      count = written;
+
+      if (frame_buffer != NULL)
+      {
+        frame_buffer += count * audio_device.channels;
+      }
+      pending -= count;
+      status  += count;
+    }
+  }
+  else
+  {
+    status = audio_playback_hw (frame_buffer, samples_pending);
+  }
+
+  return status;
+}
+
+static int32 audio_alsa_capture (int16 *frame_buffer, uint8 frames)
 {
   int status = -1;
-  unsigned int samples_written = 0;
   unsigned int samples_pending = audio_device.samples * frames;
-  short int resample = audio_device.resample;
-  short int *buffer = (short int *)malloc (2 * samples_pending * sizeof (short int));
-  
-  if (samples_pending > 0)
+
+  if (frames > AUDIO_MAX_FRAMES)
   {
-    unsigned int count;
-    short int sample;
-    short int interp[2];
+    LOG (LOG_MODULE_AUDIO, LOG_ERROR, "Capture of %d frames exceeds maximum %d\n",
+         frames, AUDIO_MAX_FRAMES);
+  }
+  else if (audio_device.io_thread != NULL)
+  {
+    unsigned int pending = samples_pending/audio_device.resample;
 
-    if (audio_device.channels > 1)
-    {
-      interp[0] = frame_buffer[0] - audio_device.prev_playback[0];
-      interp[1] = frame_buffer[1] - audio_device.prev_playback[1];
-      
-      for (sample = 0; sample < resample; sample++)
-      {
-        buffer[2*sample]
-          = audio_device.prev_playback[0] + ((sample * interp[0])/resample);
-        buffer[2*sample+1]
-          = audio_device.prev_playback[1] + ((sample * interp[1])/resample);
-      }
-    }
-    else
+    /* Consumer side, NULL discards */
+    status = 0;
+    while ((pending > 0) &&
+           (__atomic_load_n (&(audio_device.capture_active), __ATOMIC_ACQUIRE)))
     {
-      interp[0] = frame_buffer[0] - audio_device.prev_playback[0];
-      for (sample = 0; sample < resample; sample++)
-      {
-        buffer[2*sample]
-          = audio_device.prev_playback[0] + ((sample * interp[0])/resample);
-        buffer[2*sample+1] = buffer[2*sample];
-      }
-    }
+      unsigned int count = ring_read (audio_device.capture_ring, frame_buffer, pending);
 
-    for (count = 1; count < (samples_pending/resample); count++)
-    {
-      if (audio_device.channels > 1)
+      if ((count > 0) && (frame_buffer != NULL))
       {
-        interp[0] = frame_buffer[2*count] - frame_buffer[2*(count-1)];
-        interp[1] = frame_buffer[2*count+1] - frame_buffer[2*(count-1)+1];
-        for (sample = 0; sample < resample; sample++)
-        {
-          buffer[2*(resample*count+sample)]
-            = frame_buffer[2*(count-1)] + ((sample * interp[0])/resample);
-          buffer[2*(resample*count+sample)+1]
-            = frame_buffer[2*(count-1)+1] + ((sample * interp[1])/resample);
-        }
+        frame_buffer += count * audio_device.channels;
       }
-      else
+      pending -= count;
+      status  += count;
+
+      if (pending > 0)
       {
-        interp[0] = frame_buffer[count] - frame_buffer[count-1];
-        for (sample = 0; sample < resample; sample++)
-        {
-          buffer[2*(resample*count+sample)]
-            = frame_buffer[count-1] + ((sample * interp[0])/resample);
-          buffer[2*(resample*count+sample)+1] = buffer[2*(resample*count+sample)];
-        }
+        os_wait_sem (audio_device.capture_sem, 2 * audio_device.frame_duration);
       }
     }
 
-    if (audio_device.channels > 1)
-    {
-      audio_device.prev_playback[0] = frame_buffer[2*(count-1)];
-      audio_device.prev_playback[1] = frame_buffer[2*(count-1)+1];
-    }
-    else
-    {
-      audio_device.prev_playback[0] = frame_buffer[count-1];
-    }
+    status = (pending == 0) ? status : -1;
+  }
+  else
+  {
+    unsigned int output;
+
+    status = audio_capture_hw (frame_buffer, samples_pending, &output);
   }
 
-  while (samples_pending > 0)
+  return status;
+}
+
+static int audio_io_init (void)
+{
+  int status = -1;
+  unsigned int frame = audio_device.samples/audio_device.resample;
+  unsigned int period = ((audio_device.capture_period > 0) &&
+                         (audio_device.capture_period < audio_device.samples))
+                        ? audio_device.capture_period : audio_device.samples;
+  unsigned int element = audio_device.channels * sizeof (short int);
+
+  /* Everything the I/O and codec threads touch is sized here */
+  audio_device.io_playback = malloc (frame * element);
+  audio_device.io_capture  = malloc (((period/audio_device.resample) + 1) * element);
+  audio_device.io_silence  = calloc (frame, element);
+
+  if ((audio_device.io_playback != NULL) && (audio_device.io_capture != NULL) &&
+      (audio_device.io_silence != NULL) &&
+      ((ring_create (element, 2 * frame, &(audio_device.playback_ring))) > 0) &&
+      ((ring_create (element, 2 * AUDIO_MAX_FRAMES * frame,
+                     &(audio_device.capture_ring))) > 0) &&
+      ((event_create (&(audio_device.io_event))) > 0) &&
+      ((audio_device.io_wake = event_notifier (audio_device.io_event,
+                                               audio_io_wake, NULL)) >= 0) &&
+      ((os_create_sem (&(audio_device.capture_sem))) > 0) &&
+      ((os_create_sem (&(audio_device.playback_space))) > 0))
   {
-    printf (" | Playback samples available %d\n", (int)snd_pcm_avail (audio_device.playback_handle));
-    if ((status = snd_pcm_writei (audio_device.playback_handle,
-                                  &(buffer[2*samples_written]), samples_pending)) >= 0)
-    {
-      samples_written += status;
-      samples_pending -= status;
-    }
-    else
-    {
-      printf (" | Playback error: %s, restarting\n", snd_strerror (status));
-      if ((status = snd_pcm_prepare (audio_device.playback_handle)) < 0)
-      {
-        printf ("Unable to start playback\n");
-        break;
-      }
-    }
+    audio_device.io_running = 1;
+    status = os_create_thread (audio_io_main, OS_THREAD_PRIORITY_MAX,
+                               NULL, &(audio_device.io_thread));
   }
 
-  free (buffer);
+  if (status < 0)
+  {
+    printf ("Unable to start audio I/O thread\n");
+    audio_device.io_running = 0;
+    audio_device.io_thread  = NULL;
+  }
 
   return status;
 }
 
-int32 audio_capture (int16 *frame_buffer, uint8 frames)
+static void audio_io_deinit (void)
 {
-  int status = -1;
-  unsigned int samples_read = 0;
-  unsigned int samples_pending = audio_device.samples * frames;
-  short int resample = audio_device.resample;
-  short int *buffer = (short int *)malloc (2 * samples_pending * sizeof (short int));
+  if (audio_device.io_thread != NULL)
+  {
+    __atomic_store_n (&(audio_device.io_running), 0, __ATOMIC_RELEASE);
+    event_notify (audio_device.io_wake);
+    os_destroy_thread (audio_device.io_thread);
+    audio_device.io_thread = NULL;
+  }
 
-  while (samples_pending > 0)
+  if (audio_device.io_event != NULL)
   {
-    printf (" | Capture samples available %d", (int)snd_pcm_avail (audio_device.capture_handle));
-    if ((status = snd_pcm_readi (audio_device.capture_handle,
-                                 &(buffer[2*samples_read]), samples_pending)) >= 0)
-    {
-      samples_read    += status;
-      samples_pending -= status;
-    }
-    else
-    {
-      printf (" | Capture error: %s, restarting\n", snd_strerror (status));
-      if ((status = snd_pcm_prepare (audio_device.capture_handle)) < 0)
-      {
-        printf ("Unable to start capture\n");
-        break;
-      }
-    }
+    event_destroy (audio_device.io_event);
+    audio_device.io_event = NULL;
+    audio_device.io_wake  = -1;
   }
 
-  if (samples_read > 0)
+  if (audio_device.capture_sem != NULL)
   {
-    unsigned int count;
-    
-    if (audio_device.channels > 1)
+    os_destroy_sem (audio_device.capture_sem);
+    audio_device.capture_sem = NULL;
+  }
+
+  if (audio_device.playback_space != NULL)
+  {
+    os_destroy_sem (audio_device.playback_space);
+    audio_device.playback_space = NULL;
+  }
+
+  ring_destroy (audio_device.playback_ring);
+  audio_device.playback_ring = NULL;
+  ring_destroy (audio_device.capture_ring);
+  audio_device.capture_ring = NULL;
+
+  free (audio_device.io_playback);
+  audio_device.io_playback = NULL;
+  free (audio_device.io_capture);
+  audio_device.io_capture = NULL;
+  free (audio_device.io_silence);
+  audio_device.io_silence = NULL;
+
+  audio_device.playback_active = 0;
+  audio_device.capture_active  = 0;
+}
+
+/* Bit n set when the stream takes n times the codec rate, bit 0 when it takes
+ * the codec channel count */
+static unsigned int audio_probe (snd_pcm_t *handle, snd_pcm_hw_params_t *audio_hw,
+                                 unsigned char channels, unsigned int rate)
+{
+  unsigned int supported = 0;
+  unsigned int ratio;
+
+  if (((snd_pcm_hw_params_any (handle, audio_hw)) >= 0) &&
+      ((snd_pcm_hw_params_set_format (handle, audio_hw, SND_PCM_FORMAT_S16_LE)) == 0))
+  {
+    supported |= ((snd_pcm_hw_params_test_channels (handle, audio_hw, channels)) == 0);
+
+    for (ratio = 1; ratio <= HW_MAX_RATIO; ratio++)
     {
-      for (count = 0; count < (samples_read/resample); count++)
+      if ((snd_pcm_hw_params_test_rate (handle, audio_hw, rate * ratio, 0)) == 0)
       {
-        frame_buffer[2*count]   = buffer[2*resample*count];
-        frame_buffer[2*count+1] = buffer[2*resample*count+1];
+        supported |= (0x1 << ratio);
       }
     }
-    else
+  }
+
+  return supported;
+}
+
+/* Pick the lowest HW rate both streams share that the resampler can reach,
+ * the codec rate and channel count itself when possible */
+static int audio_negotiate (unsigned char channels, unsigned int rate)
+{
+  int status = -1;
+  snd_pcm_hw_params_t *audio_hw = NULL;
+
+  if ((snd_pcm_hw_params_malloc (&audio_hw)) == 0)
+  {
+    unsigned int supported = audio_probe (audio_device.playback_handle, audio_hw, channels, rate)
+                             & audio_probe (audio_device.capture_handle, audio_hw, channels, rate);
+    unsigned int ratio;
+
+    for (ratio = 1; ratio <= HW_MAX_RATIO; ratio++)
     {
-      for (count = 0; count < (samples_read/resample); count++)
+      if (supported & (0x1 << ratio))
       {
-        frame_buffer[count] = buffer[2*resample*count];
+        audio_device.hw_rate = rate * ratio;
+        status = 1;
+        break;
       }
     }
+
+    audio_device.hw_channels = (supported & 0x1) ? channels : HW_CHANNELS;
+    audio_device.native      = ((status > 0) && (ratio == 1) && (supported & 0x1));
+
+    snd_pcm_hw_params_free (audio_hw);
   }
 
-  free (buffer);
+  if (status > 0)
+  {
+    printf ("Audio HW %u Hz, %u channels%s\n", audio_device.hw_rate, audio_device.hw_channels,
+            audio_device.native ? ", native" : "");
+  }
+  else
+  {
+    printf ("No HW rate is a multiple of %u Hz\n", rate);
+  }
 
   return status;
 }
 
-int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
+static int32 audio_alsa_deinit (void);
+
+static int32 audio_alsa_init (uint8 channels, uint32 frame_duration, uint32 rate)
 {
   int status;
   snd_pcm_hw_params_t *audio_hw = NULL;
   snd_pcm_sw_params_t *audio_sw = NULL;
+  const audio_profile_t *profile;
   unsigned int buffer_time;
   unsigned int period_time;
-  snd_pcm_uframes_t buffer_size;
-  snd_pcm_uframes_t period_size;
+  snd_pcm_uframes_t buffer_size = 0;
+  snd_pcm_uframes_t period_size = 0;
+  snd_pcm_uframes_t start_threshold = 0;
+
+  if ((audio_device.options[AUDIO_OPTION_LATENCY] < 0) ||
+      (audio_device.options[AUDIO_OPTION_LATENCY] >= NUM_AUDIO_LATENCY))
+  {
+    audio_device.options[AUDIO_OPTION_LATENCY] = AUDIO_LATENCY_BALANCED;
+  }
+  profile = &(audio_profile[audio_device.options[AUDIO_OPTION_LATENCY]]);
 
   /* Playback configuration */
-  if ((status = snd_pcm_open (&(audio_device.playback_handle), PLAYBACK_DEVICE,
+  if ((status = snd_pcm_open (&(audio_device.playback_handle),
+                              (audio_device.playback_name != NULL)
+                              ? audio_device.playback_name : PLAYBACK_DEVICE,
                               SND_PCM_STREAM_PLAYBACK, 0)) < 0)
   {
     printf ("Unable to open PCM device for playback\n");
   }
 
+  if ((status == 0) &&
+      ((status = snd_pcm_open (&(audio_device.capture_handle),
+                               (audio_device.capture_name != NULL)
+                               ? audio_device.capture_name : CAPTURE_DEVICE,
+                               SND_PCM_STREAM_CAPTURE, 0)) < 0))
+  {
+    printf ("Unable to open PCM device for capture\n");
+  }
+
+  /* Both streams run at the same rate, the resample ratio is shared */
+  if ((status == 0) &&
+      ((status = audio_negotiate (channels, rate)) > 0))
+  {
+    status = 0;
+  }
+
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_malloc (&audio_hw)) < 0))
   {
@@ -284,7 +1258,22 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to fill default playback configuration\n");
   }
 
-  if ((status == 0) &&
+  /* Zero-copy access if requested and supported, read/write otherwise */
+  audio_device.playback_mmap = 0;
+  if ((status == 0) && (audio_device.options[AUDIO_OPTION_MMAP]))
+  {
+    if ((snd_pcm_hw_params_set_access (audio_device.playback_handle, audio_hw,
+                                       SND_PCM_ACCESS_MMAP_INTERLEAVED)) == 0)
+    {
+      audio_device.playback_mmap = 1;
+    }
+    else
+    {
+      printf ("Unable to set playback mmap access, using read/write\n");
+    }
+  }
+
+  if ((status == 0) && (!(audio_device.playback_mmap)) &&
       ((status = snd_pcm_hw_params_set_access (audio_device.playback_handle,
                                                audio_hw,
                                                SND_PCM_ACCESS_RW_INTERLEAVED)) < 0))
@@ -302,20 +1291,19 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
 
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_rate (audio_device.playback_handle,
-                                             audio_hw, HW_SAMPLING_RATE, 0)) < 0))
+                                             audio_hw, audio_device.hw_rate, 0)) < 0))
   {
     printf ("Unable to set playback sampling rate\n");
   }
 
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_channels (audio_device.playback_handle,
-                                                 audio_hw, 2)) < 0))
+                                                 audio_hw, audio_device.hw_channels)) < 0))
   {
     printf ("Unable to set playback channels\n");
   }
  
-  buffer_time = 2 * frame_duration * 1000;
-  period_time = buffer_time/4;
+  period_time = profile->period_time;
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_period_time_near (audio_device.playback_handle,
                                                          audio_hw, &period_time, 0)) < 0))
@@ -323,6 +1311,7 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to set playback period time\n");
   }
   
+  buffer_time = period_time * profile->periods;
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_buffer_time_near (audio_device.playback_handle,
                                                          audio_hw, &buffer_time, 0)) < 0))
@@ -330,14 +1319,6 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to set playback buffer time\n");
   }
 
-  printf ("Playback buffer time %d (us)\n", buffer_time); 
-
-  if ((status == 0) &&
-      ((status = snd_pcm_hw_params_get_buffer_size (audio_hw, &buffer_size)) < 0))
-  {
-    printf ("Unable to get capture period size\n");
-  }
-
   if ((status == 0) &&
       ((status = snd_pcm_hw_params (audio_device.playback_handle, audio_hw)) < 0))
   {
@@ -345,11 +1326,12 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
   }
 
   if ((status == 0) &&
-      ((status = snd_pcm_sw_params_malloc (&audio_sw)) < 0))
+      (((status = snd_pcm_hw_params_get_buffer_size (audio_hw, &buffer_size)) < 0) ||
+       ((status = snd_pcm_hw_params_get_period_size (audio_hw, &period_size, 0)) < 0)))
   {
-    printf ("Unable to allocate memory for playback software configuration\n");
+    printf ("Unable to get playback buffer/period size\n");
   }
-  
+
   if ((status == 0) &&
       ((status = snd_pcm_sw_params_malloc (&audio_sw)) < 0))
   {
@@ -362,13 +1344,32 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to get playback current software configuration\n");
   }
   
+  /* Start once the profile's priming depth is queued */
+  start_threshold = period_size * profile->start_periods;
+  start_threshold = (start_threshold < buffer_size) ? start_threshold : buffer_size;
   if ((status == 0) &&
       ((status = snd_pcm_sw_params_set_start_threshold (audio_device.playback_handle,
-                                                        audio_sw, buffer_size)) < 0))
+                                                        audio_sw, start_threshold)) < 0))
   {
     printf ("Unable to set playback start threshold\n");
   }
 
+  if ((status == 0) &&
+      ((status = snd_pcm_sw_params_set_avail_min (audio_device.playback_handle,
+                                                  audio_sw, period_size)) < 0))
+  {
+    printf ("Unable to set playback minimum available samples\n");
+  }
+
+  if (status == 0)
+  {
+    printf ("Playback %s: period %lu, buffer %lu, start %lu, avail min %lu (frames)\n",
+            profile->name, period_size, buffer_size, start_threshold, period_size);
+  }
+
+  audio_device.playback_size      = buffer_size;
+  audio_device.playback_threshold = start_threshold;
+
   if ((status == 0) &&
       ((status = snd_pcm_sw_params (audio_device.playback_handle, audio_sw)) < 0))
   {
@@ -388,13 +1389,6 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
   }
   
   /* Capture configuration */
-  if ((status == 0) &&
-      ((status = snd_pcm_open (&(audio_device.capture_handle), CAPTURE_DEVICE,
-                               SND_PCM_STREAM_CAPTURE, 0)) < 0))
-  {
-    printf ("Unable to open PCM device for capture\n");
-  }
-
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_malloc (&audio_hw)) < 0))
   {
@@ -408,7 +1402,22 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to fill default capture configuration\n");
   }
 
-  if ((status == 0) &&
+  /* Zero-copy access if requested and supported, read/write otherwise */
+  audio_device.capture_mmap = 0;
+  if ((status == 0) && (audio_device.options[AUDIO_OPTION_MMAP]))
+  {
+    if ((snd_pcm_hw_params_set_access (audio_device.capture_handle, audio_hw,
+                                       SND_PCM_ACCESS_MMAP_INTERLEAVED)) == 0)
+    {
+      audio_device.capture_mmap = 1;
+    }
+    else
+    {
+      printf ("Unable to set capture mmap access, using read/write\n");
+    }
+  }
+
+  if ((status == 0) && (!(audio_device.capture_mmap)) &&
       ((status = snd_pcm_hw_params_set_access (audio_device.capture_handle,
                                                audio_hw,
                                                SND_PCM_ACCESS_RW_INTERLEAVED)) < 0))
@@ -426,20 +1435,19 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
 
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_rate (audio_device.capture_handle,
-                                             audio_hw, HW_SAMPLING_RATE, 0)) < 0))
+                                             audio_hw, audio_device.hw_rate, 0)) < 0))
   {
     printf ("Unable to set capture sampling rate\n");
   }
 
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_channels (audio_device.capture_handle,
-                                                 audio_hw, 2)) < 0))
+                                                 audio_hw, audio_device.hw_channels)) < 0))
   {
     printf ("Unable to set capture channels\n");
   }
  
-  buffer_time = 2 * frame_duration * 1000;
-  period_time = buffer_time/4;
+  period_time = profile->period_time;
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_period_time_near (audio_device.capture_handle,
                                                          audio_hw, &period_time, 0)) < 0))
@@ -447,6 +1455,7 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to set capture period time\n");
   }
   
+  buffer_time = period_time * profile->periods;
   if ((status == 0) &&
       ((status = snd_pcm_hw_params_set_buffer_time_near (audio_device.capture_handle,
                                                          audio_hw, &buffer_time, 0)) < 0))
@@ -454,20 +1463,19 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to set capture buffer time\n");
   }
 
-  printf ("Capture buffer time %d (us)\n", buffer_time); 
-
-  if ((status == 0) &&
-      ((status = snd_pcm_hw_params_get_period_size (audio_hw, &period_size, 0)) < 0))
-  {
-    printf ("Unable to get capture period size\n");
-  }
-  
   if ((status == 0) &&
       ((status = snd_pcm_hw_params (audio_device.capture_handle, audio_hw)) < 0))
   {
     printf ("Unable to apply capture configuration\n");
   }
     
+  if ((status == 0) &&
+      (((status = snd_pcm_hw_params_get_buffer_size (audio_hw, &buffer_size)) < 0) ||
+       ((status = snd_pcm_hw_params_get_period_size (audio_hw, &period_size, 0)) < 0)))
+  {
+    printf ("Unable to get capture buffer/period size\n");
+  }
+  
   if ((status == 0) &&
       ((status = snd_pcm_sw_params_malloc (&audio_sw)) < 0))
   {
@@ -480,13 +1488,22 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     printf ("Unable to get capture current software configuration\n");
   }
   
+  /* Wake up per period, frames are accumulated from several periods */
   if ((status == 0) &&
       ((status = snd_pcm_sw_params_set_avail_min (audio_device.capture_handle,
-                                                  audio_sw, period_size)) < 0))
+                                                  audio_sw, period_size * profile->avail_periods)) < 0))
   {
     printf ("Unable to set capture minimum available samples\n");
   }
 
+  if (status == 0)
+  {
+    printf ("Capture %s: period %lu, buffer %lu, start 1, avail min %lu (frames)\n",
+            profile->name, period_size, buffer_size, period_size * profile->avail_periods);
+  }
+
+  audio_device.capture_period = period_size;
+
   if ((status == 0) &&
       ((status = snd_pcm_sw_params_set_start_threshold (audio_device.capture_handle,
                                                         audio_sw, 1)) < 0))
@@ -506,7 +1523,7 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
     audio_hw = NULL;
   }
   
-  if (audio_hw != NULL)
+  if (audio_sw != NULL)
   {
     snd_pcm_sw_params_free (audio_sw);
     audio_sw = NULL;
@@ -516,25 +1533,55 @@ int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
   {
     audio_device.channels         = channels;
     audio_device.frame_duration   = frame_duration;
-    audio_device.resample         = HW_SAMPLING_RATE/rate;
-    audio_device.samples          = SAMPLES_PER_FRAME (frame_duration);
-    audio_device.prev_playback[0] = -1;
-    audio_device.prev_playback[1] = -1;
-    
-    status = 1;
+    audio_device.resample         = audio_device.hw_rate/rate;
+    audio_device.samples          = SAMPLES_PER_FRAME (audio_device.hw_rate, frame_duration);
+
+    /* Interleaved HW scratch, sized once for the largest request */
+    audio_device.playback_buffer
+      = malloc (audio_device.hw_channels * audio_device.samples * AUDIO_MAX_FRAMES
+                * sizeof (short int));
+    audio_device.capture_buffer
+      = malloc (audio_device.hw_channels * audio_device.samples * AUDIO_MAX_FRAMES
+                * sizeof (short int));
+    audio_device.playback_silence
+      = calloc (audio_device.hw_channels * audio_device.playback_threshold, sizeof (short int));
+
+    /* Streaming polyphase filters, state is kept across frames */
+    if ((audio_device.playback_buffer != NULL) &&
+        (audio_device.capture_buffer != NULL) &&
+        (audio_device.playback_silence != NULL) &&
+        ((resample_create (RESAMPLE_INTERPOLATE, audio_device.resample, channels,
+                           audio_device.hw_channels, audio_device.samples/audio_device.resample,
+                           &(audio_device.playback_resample))) > 0) &&
+        ((resample_create (RESAMPLE_DECIMATE, audio_device.resample, channels,
+                           audio_device.hw_channels, audio_device.samples,
+                           &(audio_device.capture_resample))) > 0) &&
+        ((!(audio_device.options[AUDIO_OPTION_THREAD])) ||
+         ((audio_io_init ()) > 0)))
+    {
+      status = 1;
+    }
+    else
+    {
+      audio_alsa_deinit ();
+      status = -1;
+    }
   }
   else
   {
-    audio_deinit ();
+    audio_alsa_deinit ();
   }
 
   return status;
 }
 
-int32 audio_deinit (void)
+static int32 audio_alsa_deinit (void)
 {
   int status = 1;
 
+  /* Stop the I/O thread before the streams go away underneath it */
+  audio_io_deinit ();
+
   if (audio_device.playback_handle != NULL)
   {
     if (((snd_pcm_drain (audio_device.playback_handle)) == 0) &&
@@ -556,18 +1603,148 @@ int32 audio_deinit (void)
   if ((audio_device.playback_handle == NULL) &&
       (audio_device.capture_handle == NULL))
   {
+    audio_device.playback_mmap      = 0;
+    audio_device.capture_mmap       = 0;
+    audio_device.playback_size      = 0;
+    audio_device.playback_threshold = 0;
+    audio_device.capture_period     = 0;
     audio_device.channels         = 2;
     audio_device.frame_duration   = 0;
+    audio_device.hw_rate          = HW_SAMPLING_RATE;
+    audio_device.hw_channels      = HW_CHANNELS;
+    audio_device.native           = 0;
     audio_device.resample         = 1;
     audio_device.samples          = 0;
-    audio_device.prev_playback[0] = -1;
-    audio_device.prev_playback[1] = -1;
   }
   else
   {
     status = -1;
   }
 
+  if (audio_device.playback_resample != NULL)
+  {
+    resample_destroy (audio_device.playback_resample);
+    audio_device.playback_resample = NULL;
+  }
+
+  if (audio_device.capture_resample != NULL)
+  {
+    resample_destroy (audio_device.capture_resample);
+    audio_device.capture_resample = NULL;
+  }
+
+  free (audio_device.playback_buffer);
+  audio_device.playback_buffer = NULL;
+  free (audio_device.capture_buffer);
+  audio_device.capture_buffer = NULL;
+  free (audio_device.playback_silence);
+  audio_device.playback_silence = NULL;
+
+  return status;
+}
+
+static int32 audio_alsa_open (const audio_config_t *config)
+{
+  return audio_alsa_init (config->channels, config->frame_duration, config->rate);
+}
+
+static const audio_backend_t audio_alsa_backend =
+{
+  .name           = "alsa",
+  .init           = audio_alsa_open,
+  .deinit         = audio_alsa_deinit,
+  .playback       = audio_alsa_playback,
+  .capture        = audio_alsa_capture,
+  .playback_pause = audio_alsa_playback_pause,
+  .capture_pause  = audio_alsa_capture_pause,
+  .playback_delay = audio_alsa_playback_delay,
+  .latency        = audio_alsa_latency,
+  .health         = audio_alsa_health
+};
+
+static const audio_backend_t *audio_backend[NUM_AUDIO_BACKENDS] =
+{
+  [AUDIO_BACKEND_ALSA]  = &audio_alsa_backend,
+  [AUDIO_BACKEND_WAV]   = &audio_wav_backend,
+  [AUDIO_BACKEND_SYNTH] = &audio_synth_backend
+};
+
+int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate)
+{
+  int status = -1;
+  int backend = audio_device.options[AUDIO_OPTION_BACKEND];
+  audio_config_t config =
+  {
+    .options        = audio_device.options,
+    .playback_name  = audio_device.playback_name,
+    .capture_name   = audio_device.capture_name,
+    .channels       = channels,
+    .frame_duration = frame_duration,
+    .rate           = rate
+  };
+
+  /* Format conversions and filters use the widest vector unit present */
+  pcm_init ();
+  printf ("PCM kernels: %s\n", pcm_path ());
+
+  if ((backend >= 0) && (backend < NUM_AUDIO_BACKENDS) &&
+      ((status = audio_backend[backend]->init (&config)) > 0))
+  {
+    audio_device.backend = audio_backend[backend];
+  }
+  else
+  {
+    printf ("Unable to start audio backend %d\n", backend);
+  }
+
+  return status;
+}
+
+int32 audio_deinit (void)
+{
+  int status = 1;
+
+  if (audio_device.backend != NULL)
+  {
+    status = audio_device.backend->deinit ();
+    audio_device.backend = NULL;
+  }
+
   return status;
 }
 
+int32 audio_playback (int16 *frame_buffer, uint8 frames)
+{
+  return audio_device.backend->playback (frame_buffer, frames);
+}
+
+int32 audio_capture (int16 *frame_buffer, uint8 frames)
+{
+  return audio_device.backend->capture (frame_buffer, frames);
+}
+
+int32 audio_playback_pause (int32 pause)
+{
+  return audio_device.backend->playback_pause (pause);
+}
+
+int32 audio_capture_pause (int32 pause)
+{
+  return audio_device.backend->capture_pause (pause);
+}
+
+int32 audio_playback_delay (void)
+{
+  return audio_device.backend->playback_delay ();
+}
+
+int32 audio_latency (void)
+{
+  return audio_device.backend->latency ();
+}
+
+void audio_health (audio_health_t *health)
+{
+  audio_device.backend->health (health);
+}
+
@@ -0,0 +1,33 @@
+#ifndef __AUDIO_H__
+#define __AUDIO_H__
+
+/* Audio backend API, one implementation behind the public audio_* calls */
+typedef struct
+{
+  const int      *options;
+  char           *playback_name;
+  char           *capture_name;
+  unsigned char   channels;
+  unsigned int    frame_duration;
+  unsigned int    rate;
+} audio_config_t;
+
+typedef struct
+{
+  char   *name;
+  int32 (*init) (const audio_config_t *config);
+  int32 (*deinit) (void);
+  int32 (*playback) (int16 *frame_buffer, uint8 frames);
+  int32 (*capture) (int16 *frame_buffer, uint8 frames);
+  int32 (*playback_pause) (int32 pause);
+  int32 (*capture_pause) (int32 pause);
+  int32 (*playback_delay) (void);
+  int32 (*latency) (void);
+  void  (*health) (audio_health_t *health);
+} audio_backend_t;
+
+extern const audio_backend_t audio_wav_backend;
+
+extern const audio_backend_t audio_synth_backend;
+
+#endif
@@ -0,0 +1,555 @@
+
+/* System headers */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+#include "audio.h"
+
+/* Synthetic source defaults, tone at -12 dBFS */
+#define SYNTH_TONE_FREQUENCY  (1000)
+#define SYNTH_AMPLITUDE       (8192)
+#define SYNTH_TABLE_BITS      (10)
+#define SYNTH_TABLE_SIZE      (0x1 << SYNTH_TABLE_BITS)
+
+/* Emulated playback buffer depth in frames */
+#define AUDIO_FILE_BUFFER     (2)
+
+/* Canonical 44 byte RIFF/WAVE header, 16 bit PCM */
+#define WAV_HEADER_SIZE       (44)
+
+/* Local structures */
+enum
+{
+  SYNTH_TONE,
+  SYNTH_NOISE
+};
+
+typedef struct
+{
+  int              paced;
+  unsigned char    channels;
+  unsigned int     rate;
+  unsigned int     frame_duration;
+  unsigned int     samples;
+  long long        playback_time;
+  long long        capture_time;
+  int              capture_fd;
+  unsigned char    capture_channels;
+  off_t            capture_start;
+  unsigned int     capture_size;
+  unsigned int     capture_remaining;
+  int              playback_fd;
+  unsigned int     playback_size;
+  short int       *buffer;
+  int              synth;
+  unsigned int     synth_phase;
+  unsigned int     synth_step;
+  unsigned int     synth_seed;
+  short int        synth_table[SYNTH_TABLE_SIZE];
+} audio_file_t;
+
+/* File scope global variables */
+static audio_file_t audio_file =
+{
+  .paced             = 1,
+  .channels          = 1,
+  .rate              = 0,
+  .frame_duration    = 0,
+  .samples           = 0,
+  .playback_time     = 0,
+  .capture_time      = 0,
+  .capture_fd        = -1,
+  .capture_channels  = 0,
+  .capture_start     = 0,
+  .capture_size      = 0,
+  .capture_remaining = 0,
+  .playback_fd       = -1,
+  .playback_size     = 0,
+  .buffer            = NULL,
+  .synth             = SYNTH_TONE,
+  .synth_phase       = 0,
+  .synth_step        = 0,
+  .synth_seed        = 1
+};
+
+
+/* Advance the stream's timeline and block until at most 'lead' frames are
+ * ahead of real time, unless running flat out */
+static void audio_file_pace (long long *due, uint8 frames, unsigned int lead)
+{
+  long long frame = (long long)audio_file.frame_duration * 1000000;
+  struct timespec now;
+  struct timespec wake;
+  long long time;
+
+  if (audio_file.paced)
+  {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    time = ((long long)now.tv_sec * 1000000000) + now.tv_nsec;
+
+    /* First frame or fell more than a frame behind, restart the timeline */
+    if (((*due) + frame) < time)
+    {
+      *due = time;
+    }
+
+    *due += frames * frame;
+
+    time = (*due) - (lead * frame);
+    wake.tv_sec  = time / 1000000000;
+    wake.tv_nsec = time % 1000000000;
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+  }
+}
+
+static void audio_file_le32 (unsigned char *dest, unsigned int value)
+{
+  dest[0] = value & 0xff;
+  dest[1] = (value >> 8) & 0xff;
+  dest[2] = (value >> 16) & 0xff;
+  dest[3] = (value >> 24) & 0xff;
+}
+
+static unsigned int audio_file_get32 (unsigned char *src)
+{
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((unsigned int)src[3] << 24);
+}
+
+static void audio_file_header (unsigned char *header, unsigned int data_size)
+{
+  unsigned int block = audio_file.channels * sizeof (short int);
+
+  memcpy (&(header[0]), "RIFF", 4);
+  audio_file_le32 (&(header[4]), (WAV_HEADER_SIZE - 8) + data_size);
+  memcpy (&(header[8]), "WAVEfmt ", 8);
+  audio_file_le32 (&(header[16]), 16);
+  header[20] = 1;
+  header[21] = 0;
+  header[22] = audio_file.channels;
+  header[23] = 0;
+  audio_file_le32 (&(header[24]), audio_file.rate);
+  audio_file_le32 (&(header[28]), audio_file.rate * block);
+  header[32] = block;
+  header[33] = 0;
+  header[34] = 16;
+  header[35] = 0;
+  memcpy (&(header[36]), "data", 4);
+  audio_file_le32 (&(header[40]), data_size);
+}
+
+/* Walk the RIFF chunks up to the sample data, only 16 bit PCM at the codec rate */
+static int audio_file_open_wav (char *name)
+{
+  int status = -1;
+  unsigned char chunk[16];
+  unsigned int size;
+
+  if ((audio_file.capture_fd = open (name, O_RDONLY)) < 0)
+  {
+    printf ("Can't open %s\n", name);
+  }
+  else if (((read (audio_file.capture_fd, chunk, 12)) != 12) ||
+           ((memcmp (&(chunk[0]), "RIFF", 4)) != 0) ||
+           ((memcmp (&(chunk[8]), "WAVE", 4)) != 0))
+  {
+    printf ("%s is not a WAV file\n", name);
+  }
+  else
+  {
+    while ((read (audio_file.capture_fd, chunk, 8)) == 8)
+    {
+      size = audio_file_get32 (&(chunk[4]));
+
+      if ((memcmp (chunk, "fmt ", 4)) == 0)
+      {
+        if ((size < 16) || ((read (audio_file.capture_fd, chunk, 16)) != 16))
+        {
+          break;
+        }
+
+        audio_file.capture_channels = chunk[2];
+        if ((chunk[0] != 1) || (chunk[14] != 16) ||
+            (audio_file_get32 (&(chunk[4])) != audio_file.rate) ||
+            (audio_file.capture_channels < 1) || (audio_file.capture_channels > 2))
+        {
+          printf ("%s must be 16 bit mono/stereo PCM at %u Hz\n", name, audio_file.rate);
+          break;
+        }
+
+        lseek (audio_file.capture_fd, (size - 16) + (size & 0x1), SEEK_CUR);
+      }
+      else if ((memcmp (chunk, "data", 4)) == 0)
+      {
+        if (audio_file.capture_channels > 0)
+        {
+          audio_file.capture_start     = lseek (audio_file.capture_fd, 0, SEEK_CUR);
+          /* Whole sample frames only, a stray odd byte at the end is never read */
+          size -= size % (audio_file.capture_channels * sizeof (short int));
+          audio_file.capture_size      = size;
+          audio_file.capture_remaining = size;
+          status = 1;
+        }
+        break;
+      }
+      else
+      {
+        lseek (audio_file.capture_fd, size + (size & 0x1), SEEK_CUR);
+      }
+    }
+  }
+
+  return status;
+}
+
+static int32 audio_file_init (const audio_config_t *config)
+{
+  int status = -1;
+
+  audio_file.paced          = config->options[AUDIO_OPTION_PACED];
+  audio_file.channels       = config->channels;
+  audio_file.rate           = config->rate;
+  audio_file.frame_duration = config->frame_duration;
+  audio_file.samples        = (config->rate * config->frame_duration)/1000;
+  audio_file.playback_time  = 0;
+  audio_file.capture_time   = 0;
+
+  /* Largest request at the widest channel count */
+  audio_file.buffer = malloc (2 * audio_file.samples * AUDIO_MAX_FRAMES * sizeof (short int));
+
+  if (audio_file.buffer != NULL)
+  {
+    status = 1;
+  }
+
+  /* No playback file means playback is paced and discarded */
+  if ((status > 0) && (config->playback_name != NULL))
+  {
+    unsigned char header[WAV_HEADER_SIZE];
+
+    audio_file_header (header, 0);
+    audio_file.playback_size = 0;
+    if (((audio_file.playback_fd = open (config->playback_name,
+                                         (O_WRONLY | O_CREAT | O_TRUNC), 0644)) < 0) ||
+        ((write (audio_file.playback_fd, header, WAV_HEADER_SIZE)) != WAV_HEADER_SIZE))
+    {
+      printf ("Can't create %s\n", config->playback_name);
+      status = -1;
+    }
+  }
+
+  printf ("Audio %s, %s\n", (config->playback_name != NULL) ? config->playback_name : "discard",
+          (audio_file.paced) ? "real time" : "unpaced");
+
+  return status;
+}
+
+static int32 audio_file_deinit (void)
+{
+  if (audio_file.playback_fd >= 0)
+  {
+    unsigned char header[WAV_HEADER_SIZE];
+
+    /* Sizes are only known now */
+    audio_file_header (header, audio_file.playback_size);
+    if ((pwrite (audio_file.playback_fd, header, WAV_HEADER_SIZE, 0)) != WAV_HEADER_SIZE)
+    {
+      printf ("Unable to finish WAV header\n");
+    }
+
+    close (audio_file.playback_fd);
+    audio_file.playback_fd = -1;
+  }
+
+  if (audio_file.capture_fd >= 0)
+  {
+    close (audio_file.capture_fd);
+    audio_file.capture_fd = -1;
+  }
+
+  free (audio_file.buffer);
+  audio_file.buffer = NULL;
+
+  return 1;
+}
+
+static int32 audio_file_playback (int16 *frame_buffer, uint8 frames)
+{
+  unsigned int bytes = audio_file.samples * frames * audio_file.channels * sizeof (short int);
+
+  if (frames > AUDIO_MAX_FRAMES)
+  {
+    return -1;
+  }
+
+  if (audio_file.playback_fd >= 0)
+  {
+    /* NULL keeps the timeline with silence */
+    if (frame_buffer == NULL)
+    {
+      memset (audio_file.buffer, 0, bytes);
+      frame_buffer = audio_file.buffer;
+    }
+
+    if ((write (audio_file.playback_fd, frame_buffer, bytes)) == bytes)
+    {
+      audio_file.playback_size += bytes;
+    }
+  }
+
+  /* Behaves like a device buffer, writes only block once it is full */
+  audio_file_pace (&(audio_file.playback_time), frames, AUDIO_FILE_BUFFER);
+
+  return audio_file.samples * frames;
+}
+
+static int32 audio_file_pause (int32 pause)
+{
+  return 1;
+}
+
+static int32 audio_file_delay (void)
+{
+  return 0;
+}
+
+static void audio_file_health (audio_health_t *health)
+{
+  memset (health, 0, sizeof (audio_health_t));
+}
+
+static int32 audio_wav_init (const audio_config_t *config)
+{
+  int status = audio_file_init (config);
+
+  if ((status > 0) && (config->capture_name == NULL))
+  {
+    printf ("WAV backend needs a capture file\n");
+    status = -1;
+  }
+  else if (status > 0)
+  {
+    status = audio_file_open_wav (config->capture_name);
+  }
+
+  if (status < 0)
+  {
+    audio_file_deinit ();
+  }
+
+  return status;
+}
+
+/* Capture loops over the file's sample data */
+static int32 audio_wav_capture (int16 *frame_buffer, uint8 frames)
+{
+  unsigned int pending = audio_file.samples * frames;
+  unsigned int block = audio_file.capture_channels * sizeof (short int);
+  short int *buffer = audio_file.buffer;
+  int rewound = 0;
+
+  if (frames > AUDIO_MAX_FRAMES)
+  {
+    return -1;
+  }
+
+  while (pending > 0)
+  {
+    unsigned int count = (pending * block < audio_file.capture_remaining)
+                         ? pending : (audio_file.capture_remaining / block);
+    int bytes;
+
+    if (count == 0)
+    {
+      lseek (audio_file.capture_fd, audio_file.capture_start, SEEK_SET);
+      audio_file.capture_remaining = audio_file.capture_size;
+      rewound = 1;
+      if (audio_file.capture_size < block)
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    /* The file ends short of what its header claims: loop over what is there,
+     * nothing there at all (or a read error) ends the capture */
+    bytes = read (audio_file.capture_fd, buffer, count * block);
+    count = (bytes > 0) ? ((unsigned int)bytes / block) : 0;
+
+    if (count == 0)
+    {
+      if (rewound)
+      {
+        LOG (LOG_MODULE_AUDIO, LOG_ERROR, "Unable to read capture file\n");
+        return -1;
+      }
+
+      audio_file.capture_remaining = 0;
+      continue;
+    }
+
+    /* A partial sample frame is read again next time */
+    if (((unsigned int)bytes % block) != 0)
+    {
+      lseek (audio_file.capture_fd, -(off_t)((unsigned int)bytes % block), SEEK_CUR);
+    }
+
+    audio_file.capture_remaining -= count * block;
+    rewound = 0;
+
+    /* Map file channels onto the codec's */
+    if ((frame_buffer != NULL) && (audio_file.capture_channels == audio_file.channels))
+    {
+      memcpy (frame_buffer, buffer, count * block);
+      frame_buffer += count * audio_file.channels;
+    }
+    else if ((frame_buffer != NULL) && (audio_file.channels == 1))
+    {
+      /* Left channel of a stereo file */
+      pcm_deinterleave (buffer, frame_buffer, NULL, count);
+      frame_buffer += count;
+    }
+    else if ((frame_buffer != NULL) && (audio_file.channels == 2))
+    {
+      pcm_interleave (buffer, buffer, frame_buffer, count);
+      frame_buffer += 2 * count;
+    }
+    else if (frame_buffer != NULL)
+    {
+      unsigned int sample;
+      unsigned char channel;
+
+      for (sample = 0; sample < count; sample++)
+      {
+        for (channel = 0; channel < audio_file.channels; channel++)
+        {
+          *frame_buffer++ = buffer[(sample * audio_file.capture_channels)
+                                   + (channel % audio_file.capture_channels)];
+        }
+      }
+    }
+
+    pending -= count;
+  }
+
+  audio_file_pace (&(audio_file.capture_time), frames, 0);
+
+  return audio_file.samples * frames;
+}
+
+/* Capture name picks the source, "tone", "tone:<Hz>" or "noise" */
+static int32 audio_synth_init (const audio_config_t *config)
+{
+  int status = audio_file_init (config);
+  unsigned int frequency = SYNTH_TONE_FREQUENCY;
+  unsigned int count;
+
+  audio_file.synth = SYNTH_TONE;
+  if ((config->capture_name != NULL) && ((strcmp (config->capture_name, "noise")) == 0))
+  {
+    audio_file.synth = SYNTH_NOISE;
+  }
+  else if ((config->capture_name != NULL) &&
+           ((strncmp (config->capture_name, "tone:", 5)) == 0))
+  {
+    frequency = atoi (&(config->capture_name[5]));
+  }
+
+  if ((frequency == 0) || (frequency >= (config->rate/2)))
+  {
+    printf ("Synthetic tone must be below %u Hz\n", config->rate/2);
+    status = -1;
+  }
+
+  for (count = 0; count < SYNTH_TABLE_SIZE; count++)
+  {
+    audio_file.synth_table[count]
+      = (short int)lrint (SYNTH_AMPLITUDE * sin ((2.0 * M_PI * count)/SYNTH_TABLE_SIZE));
+  }
+
+  /* 32 bit phase accumulator, top bits index the table */
+  audio_file.synth_phase = 0;
+  audio_file.synth_step  = (unsigned int)((((double)frequency)/config->rate) * 4294967296.0);
+  audio_file.synth_seed  = 1;
+
+  if (status < 0)
+  {
+    audio_file_deinit ();
+  }
+
+  return status;
+}
+
+static int32 audio_synth_capture (int16 *frame_buffer, uint8 frames)
+{
+  unsigned int samples = audio_file.samples * frames;
+  unsigned int sample;
+  unsigned char channel;
+
+  if (frames > AUDIO_MAX_FRAMES)
+  {
+    return -1;
+  }
+
+  for (sample = 0; ((frame_buffer != NULL) && (sample < samples)); sample++)
+  {
+    short int value;
+
+    if (audio_file.synth == SYNTH_NOISE)
+    {
+      /* LCG, top bits scaled to the same peak as the tone */
+      audio_file.synth_seed = (audio_file.synth_seed * 1664525) + 1013904223;
+      value = (short int)(((int)(audio_file.synth_seed >> 16) - 32768) / (32768/SYNTH_AMPLITUDE));
+    }
+    else
+    {
+      value = audio_file.synth_table[audio_file.synth_phase >> (32 - SYNTH_TABLE_BITS)];
+      audio_file.synth_phase += audio_file.synth_step;
+    }
+
+    for (channel = 0; channel < audio_file.channels; channel++)
+    {
+      *frame_buffer++ = value;
+    }
+  }
+
+  audio_file_pace (&(audio_file.capture_time), frames, 0);
+
+  return samples;
+}
+
+const audio_backend_t audio_wav_backend =
+{
+  .name           = "wav",
+  .init           = audio_wav_init,
+  .deinit         = audio_file_deinit,
+  .playback       = audio_file_playback,
+  .capture        = audio_wav_capture,
+  .playback_pause = audio_file_pause,
+  .capture_pause  = audio_file_pause,
+  .playback_delay = audio_file_delay,
+  .latency        = audio_file_delay,
+  .health         = audio_file_health
+};
+
+const audio_backend_t audio_synth_backend =
+{
+  .name           = "synth",
+  .init           = audio_synth_init,
+  .deinit         = audio_file_deinit,
+  .playback       = audio_file_playback,
+  .capture        = audio_synth_capture,
+  .playback_pause = audio_file_pause,
+  .capture_pause  = audio_file_pause,
+  .playback_delay = audio_file_delay,
+  .latency        = audio_file_delay,
+  .health         = audio_file_health
+};
+
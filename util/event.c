@@ -0,0 +1,384 @@
+
+/* System headers */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+
+/* Sources per reactor and events handled per wake-up */
+#define EVENT_MAX_SOURCES  (16)
+#define EVENT_MAX_READY    (8)
+
+/* Local structures */
+enum
+{
+  EVENT_SOURCE_FD,
+  EVENT_SOURCE_TIMER,
+  EVENT_SOURCE_NOTIFY
+};
+
+typedef struct
+{
+  int     fd;
+  int     type;
+  void  (*callback)(void *, uint32);
+  void   *data;
+} event_source_t;
+
+typedef struct
+{
+  int             epoll_fd;
+  event_source_t  source[EVENT_MAX_SOURCES];
+} event_t;
+
+
+static unsigned int event_to_epoll (unsigned int events)
+{
+  return ((events & EVENT_READ) ? EPOLLIN : 0)
+         | ((events & EVENT_WRITE) ? EPOLLOUT : 0)
+         | ((events & EVENT_PRIORITY) ? EPOLLPRI : 0);
+}
+
+static unsigned int event_from_epoll (unsigned int events)
+{
+  return ((events & EPOLLIN) ? EVENT_READ : 0)
+         | ((events & EPOLLOUT) ? EVENT_WRITE : 0)
+         | ((events & EPOLLPRI) ? EVENT_PRIORITY : 0)
+         | ((events & (EPOLLERR | EPOLLHUP)) ? EVENT_ERROR : 0);
+}
+
+static int event_register (event_t *event, int fd, int type, unsigned int events,
+                           void (*callback)(void *, uint32), void *data)
+{
+  int status = -1;
+  int count;
+
+  for (count = 0; count < EVENT_MAX_SOURCES; count++)
+  {
+    if (event->source[count].fd < 0)
+    {
+      event_source_t *source = &(event->source[count]);
+      struct epoll_event epoll_event;
+
+      memset (&epoll_event, 0, sizeof (epoll_event));
+      epoll_event.events   = event_to_epoll (events);
+      epoll_event.data.ptr = source;
+
+      if ((epoll_ctl (event->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event)) == 0)
+      {
+        source->fd       = fd;
+        source->type     = type;
+        source->callback = callback;
+        source->data     = data;
+        status = 1;
+      }
+
+      break;
+    }
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to add event source %d\n", fd);
+  }
+
+  return status;
+}
+
+int32 event_create (void **handle)
+{
+  int status = -1;
+  event_t *event = malloc (sizeof (event_t));
+
+  if (event != NULL)
+  {
+    int count;
+
+    for (count = 0; count < EVENT_MAX_SOURCES; count++)
+    {
+      event->source[count].fd = -1;
+    }
+
+    if ((event->epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) >= 0)
+    {
+      *handle = event;
+      status  = 1;
+    }
+    else
+    {
+      free (event);
+    }
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to create event reactor\n");
+  }
+
+  return status;
+}
+
+int32 event_destroy (void *handle)
+{
+  event_t *event = handle;
+
+  if (event != NULL)
+  {
+    int count;
+
+    for (count = 0; count < EVENT_MAX_SOURCES; count++)
+    {
+      if (event->source[count].fd >= 0)
+      {
+        event_remove (event, event->source[count].fd);
+      }
+    }
+
+    close (event->epoll_fd);
+    free (event);
+  }
+
+  return 1;
+}
+
+int32 event_add (void *handle, int32 fd, uint32 events,
+                 void (*callback)(void *, uint32), void *data)
+{
+  return event_register (handle, fd, EVENT_SOURCE_FD, events, callback, data);
+}
+
+int32 event_remove (void *handle, int32 fd)
+{
+  event_t *event = handle;
+  int status = -1;
+  int count;
+
+  for (count = 0; count < EVENT_MAX_SOURCES; count++)
+  {
+    event_source_t *source = &(event->source[count]);
+
+    if (source->fd == fd)
+    {
+      epoll_ctl (event->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+      /* Timers and notifiers belong to the reactor, plain fds to the caller */
+      if (source->type != EVENT_SOURCE_FD)
+      {
+        close (fd);
+      }
+
+      source->fd = -1;
+      status = 1;
+      break;
+    }
+  }
+
+  return status;
+}
+
+/* Returns the timer id (its fd) to pass to event_remove */
+int32 event_timer (void *handle, int32 millisec, int32 periodic,
+                   void (*callback)(void *, uint32), void *data)
+{
+  int fd = timerfd_create (CLOCK_MONOTONIC, (TFD_NONBLOCK | TFD_CLOEXEC));
+
+  if (fd >= 0)
+  {
+    struct itimerspec timer_spec;
+
+    timer_spec.it_value.tv_sec  = millisec / 1000;
+    timer_spec.it_value.tv_nsec = (millisec % 1000) * 1000000;
+    timer_spec.it_interval      = periodic ? timer_spec.it_value : (struct timespec){0, 0};
+
+    if (((timerfd_settime (fd, 0, &timer_spec, NULL)) != 0) ||
+        ((event_register (handle, fd, EVENT_SOURCE_TIMER, EVENT_READ, callback, data)) < 0))
+    {
+      close (fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0)
+  {
+    printf ("Unable to start event timer\n");
+  }
+
+  return fd;
+}
+
+/* Returns the notifier id (its fd), any thread may then call event_notify on it */
+int32 event_notifier (void *handle, void (*callback)(void *, uint32), void *data)
+{
+  int fd = eventfd (0, (EFD_NONBLOCK | EFD_CLOEXEC));
+
+  if ((fd >= 0) &&
+      ((event_register (handle, fd, EVENT_SOURCE_NOTIFY, EVENT_READ, callback, data)) < 0))
+  {
+    close (fd);
+    fd = -1;
+  }
+
+  if (fd < 0)
+  {
+    printf ("Unable to create event notifier\n");
+  }
+
+  return fd;
+}
+
+int32 event_notify (int32 id)
+{
+  uint64_t value = 1;
+
+  return ((write (id, &value, sizeof (value))) == sizeof (value)) ? 1 : -1;
+}
+
+/* Sleep until a source fires or timeout millisec. expire (-1 waits forever),
+ * returns the number of callbacks run */
+int32 event_dispatch (void *handle, int32 timeout)
+{
+  event_t *event = handle;
+  struct epoll_event ready[EVENT_MAX_READY];
+  int status;
+  int count;
+
+  if ((status = epoll_wait (event->epoll_fd, ready, EVENT_MAX_READY, timeout)) < 0)
+  {
+    status = (errno == EINTR) ? 0 : -1;
+  }
+
+  for (count = 0; count < status; count++)
+  {
+    event_source_t *source = ready[count].data.ptr;
+    int fd = source->fd;
+
+    /* An earlier callback may have removed this source */
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    /* Consume expirations/wake-ups so level triggering does not spin */
+    if (source->type != EVENT_SOURCE_FD)
+    {
+      uint64_t value;
+
+      if ((read (fd, &value, sizeof (value))) != sizeof (value))
+      {
+        continue;
+      }
+    }
+
+    source->callback (source->data, event_from_epoll (ready[count].events));
+  }
+
+  return status;
+}
+
+#ifdef UTIL_EVENT_TEST
+
+#include <time.h>
+#include <pthread.h>
+
+static int event_timer_count = 0;
+static int event_notify_count = 0;
+static int event_pipe_count = 0;
+
+static void timer_callback (void *data, uint32 events)
+{
+  event_timer_count++;
+}
+
+static void notify_callback (void *data, uint32 events)
+{
+  event_notify_count++;
+}
+
+static void pipe_callback (void *data, uint32 events)
+{
+  int *pipe_fd = data;
+  char value;
+
+  if ((read (pipe_fd[0], &value, 1)) == 1)
+  {
+    event_pipe_count++;
+  }
+}
+
+static void * notify_main (void *data)
+{
+  int id = *((int *)data);
+  struct timespec delay = {0, 20000000};
+
+  nanosleep (&delay, NULL);
+  event_notify (id);
+
+  return NULL;
+}
+
+int main (void)
+{
+  void *event = NULL;
+  int pipe_fd[2];
+  int timer;
+  int notifier;
+  int failures = 0;
+  int start;
+  pthread_t thread;
+
+  event_create (&event);
+  pipe (pipe_fd);
+
+  /* Periodic timer, 10 expirations of 10 ms */
+  timer = event_timer (event, 10, 1, timer_callback, NULL);
+  start = clock_get_count ();
+  while (event_timer_count < 10)
+  {
+    event_dispatch (event, -1);
+  }
+  printf ("Timer: 10 x 10 ms in %d ms\n", (clock_get_count ()) - start);
+  failures += ((clock_get_count ()) - start) < 90;
+  event_remove (event, timer);
+
+  /* Idle reactor sleeps out its timeout */
+  start = clock_get_count ();
+  failures += ((event_dispatch (event, 50)) != 0);
+  failures += ((clock_get_count ()) - start) < 45;
+
+  /* Cross thread wake-up */
+  notifier = event_notifier (event, notify_callback, NULL);
+  pthread_create (&thread, NULL, notify_main, &notifier);
+  start = clock_get_count ();
+  event_dispatch (event, 1000);
+  pthread_join (thread, NULL);
+  printf ("Notify: woken after %d ms\n", (clock_get_count ()) - start);
+  failures += (event_notify_count != 1);
+  event_remove (event, notifier);
+
+  /* Plain fd, level triggered until drained */
+  event_add (event, pipe_fd[0], EVENT_READ, pipe_callback, pipe_fd);
+  write (pipe_fd[1], "ab", 2);
+  event_dispatch (event, 0);
+  event_dispatch (event, 0);
+  failures += (event_pipe_count != 2);
+  failures += ((event_dispatch (event, 0)) != 0);
+
+  event_destroy (event);
+  close (pipe_fd[0]);
+  close (pipe_fd[1]);
+
+  printf ("Event: %s\n", failures ? "FAIL" : "OK");
+
+  return failures ? 1 : 0;
+}
+
+#endif
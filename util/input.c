@@ -16,10 +16,7 @@ static struct termios read_fd_config;
 #define SYS_GPIO_BASE             "/sys/class/gpio"
 #define SYS_GPIO_EXPORT           SYS_GPIO_BASE "/export"
 #define SYS_GPIO_UNEXPORT         SYS_GPIO_BASE "/unexport"
-#define SYS_GPIO_NUMBER(gpio)     #gpio
-#define SYS_GPIO_DIRECTION(gpio)  SYS_GPIO_BASE "/gpio" #gpio "/direction"
-#define SYS_GPIO_VALUE(gpio)      SYS_GPIO_BASE "/gpio" #gpio "/value"
-#define SYS_GPIO_EDGE(gpio)       SYS_GPIO_BASE "/gpio" #gpio "/edge"
+#define SYS_GPIO_FILE             SYS_GPIO_BASE "/gpio%s/%s"
 
 typedef struct
 {
@@ -29,13 +26,15 @@ typedef struct
   int value_fd;
 } gpio_info_t;
 
+static char gpio_path[64];
+
 static gpio_info_t gpio_info[NUM_INPUTS] =
 {
   [INPUT_PTT] =
     {
       .number    = "0",
       .direction = "in",
-      .edge      = "none",
+      .edge      = "both",
       .value_fd  = -1,
     },
   [INPUT_AAA] =
@@ -60,6 +59,14 @@ static gpio_info_t gpio_info[NUM_INPUTS] =
       .value_fd  = -1,
     }
 }; 
+
+/* Path of a per pin sysfs attribute file */
+static char * gpio_file (char *number, char *attribute)
+{
+  snprintf (gpio_path, sizeof (gpio_path), SYS_GPIO_FILE, number, attribute);
+
+  return gpio_path;
+}
 #endif
 
 
@@ -120,7 +127,7 @@ int32 input_init (void)
     {
       char *gpio_direction = gpio_info[count].direction;
       
-      fd = open (SYS_GPIO_DIRECTION (atoi (gpio_info[count].number)), O_WRONLY);
+      fd = open (gpio_file (gpio_info[count].number, "direction"), O_WRONLY);
 	    if ((write (fd, gpio_direction, strlen (gpio_direction))) <= 0)
       {
         printf ("Unable to set gpio %s direction %s\n", gpio_info[count].number,
@@ -134,7 +141,7 @@ int32 input_init (void)
     {
       char *gpio_edge = gpio_info[count].edge;
       
-      fd = open (SYS_GPIO_DIRECTION (atoi (gpio_info[count].number)), O_WRONLY);
+      fd = open (gpio_file (gpio_info[count].number, "edge"), O_WRONLY);
 	    if ((write (fd, gpio_edge, strlen (gpio_edge))) <= 0)
       {
         printf ("Unable to set gpio %s edge %s\n", gpio_info[count].number,
@@ -146,7 +153,7 @@ int32 input_init (void)
     /* Open value FD */
     for (count = 0; count < NUM_INPUTS; count++)
     {
-      fd = open (SYS_GPIO_VALUE (atoi (gpio_info[count].number)), O_WRONLY);
+      fd = open (gpio_file (gpio_info[count].number, "value"), O_RDONLY);
       if (fd > 0)
       {
         gpio_info[count].value_fd = fd;
@@ -207,6 +214,19 @@ int32 input_deinit (void)
 #endif
 }
 
+/* Descriptor to watch for input changes, and the events it signals them with */
+int32 input_fd (uint32 *events)
+{
+#if defined (INPUT_KEYBOARD)
+  *events = EVENT_READ;
+  return 0;
+#else
+  /* sysfs value files always read ready, edges come in as priority events */
+  *events = EVENT_PRIORITY;
+  return gpio_info[INPUT_PTT].value_fd;
+#endif
+}
+
 uint32 input_read (void)
 {
   unsigned int input = 0;
@@ -235,9 +255,12 @@ uint32 input_read (void)
   for (count = 0; count < NUM_INPUTS; count++)
   {
     char value;
-    if ((read (gpio_info[count].value_fd, &value, 1)) > 0)
+
+    /* The value file reads once per open, rewinding rereads it and acknowledges the edge */
+    if (((lseek (gpio_info[count].value_fd, 0, SEEK_SET)) == 0) &&
+        ((read (gpio_info[count].value_fd, &value, 1)) > 0))
     {
-      if (value > 0)
+      if (value == '1')
       {
         input |= (0x1 << count);
       }
@@ -0,0 +1,289 @@
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+
+/* Threads that can log, records buffered per thread */
+#define LOG_MAX_THREADS  (8)
+#define LOG_RECORDS      (256)
+
+/* Background flush interval, millisec. */
+#define LOG_FLUSH_TIME   (10)
+
+/* Local structures */
+typedef struct
+{
+  unsigned int   time;
+  unsigned char  module;
+  unsigned char  args;
+  const char    *format;
+  int            arg[LOG_MAX_ARGS];
+} log_record_t;
+
+typedef struct
+{
+  int            levels[NUM_LOG_MODULES];
+  void          *ring[LOG_MAX_THREADS];
+  log_record_t   pending[LOG_MAX_THREADS];
+  int            pending_valid[LOG_MAX_THREADS];
+  int            threads;
+  unsigned int   dropped;
+  int            running;
+  void          *thread;
+  void          *sem;
+} log_t;
+
+/* File scope global variables */
+static log_t log_state =
+{
+  .levels =
+    {
+      [LOG_MODULE_MAIN]   = LOG_INFO,
+      [LOG_MODULE_STATUS] = LOG_INFO,
+      [LOG_MODULE_AUDIO]  = LOG_INFO,
+      [LOG_MODULE_CODEC]  = LOG_INFO,
+      [LOG_MODULE_SERIAL] = LOG_INFO
+    },
+  .threads  = 0,
+  .dropped  = 0,
+  .running  = 0,
+  .thread   = NULL,
+  .sem      = NULL
+};
+
+/* Ring each thread writes to, claimed on its first record */
+static __thread int log_slot = -1;
+
+
+static void log_emit (log_record_t *record)
+{
+  int *arg = record->arg;
+
+  /* Unused trailing arguments are ignored by printf */
+  printf (record->format, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
+
+/* Emit everything buffered, oldest record first across all threads */
+static void log_flush (void)
+{
+  int threads = __atomic_load_n (&(log_state.threads), __ATOMIC_ACQUIRE);
+  int count;
+
+  threads = (threads < LOG_MAX_THREADS) ? threads : LOG_MAX_THREADS;
+
+  while (1)
+  {
+    int oldest = -1;
+
+    for (count = 0; count < threads; count++)
+    {
+      if ((!(log_state.pending_valid[count])) &&
+          ((ring_read (log_state.ring[count], &(log_state.pending[count]), 1)) == 1))
+      {
+        log_state.pending_valid[count] = 1;
+      }
+
+      if ((log_state.pending_valid[count]) &&
+          ((oldest < 0) ||
+           (((int)(log_state.pending[count].time - log_state.pending[oldest].time)) < 0)))
+      {
+        oldest = count;
+      }
+    }
+
+    if (oldest < 0)
+    {
+      break;
+    }
+
+    log_emit (&(log_state.pending[oldest]));
+    log_state.pending_valid[oldest] = 0;
+  }
+
+  fflush (stdout);
+}
+
+static void * log_main (void *data)
+{
+  while (__atomic_load_n (&(log_state.running), __ATOMIC_ACQUIRE))
+  {
+    os_wait_sem (log_state.sem, LOG_FLUSH_TIME);
+    log_flush ();
+  }
+
+  return NULL;
+}
+
+int32 log_init (void)
+{
+  int status = 1;
+  int count;
+
+  for (count = 0; ((status > 0) && (count < LOG_MAX_THREADS)); count++)
+  {
+    status = ring_create (sizeof (log_record_t), LOG_RECORDS, &(log_state.ring[count]));
+  }
+
+  if ((status > 0) &&
+      ((status = os_create_sem (&(log_state.sem))) > 0))
+  {
+    log_state.running = 1;
+    status = os_create_thread (log_main, OS_THREAD_PRIORITY_MIN, NULL, &(log_state.thread));
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to start logger\n");
+    log_deinit ();
+  }
+
+  return status;
+}
+
+void log_deinit (void)
+{
+  int count;
+
+  if (log_state.thread != NULL)
+  {
+    __atomic_store_n (&(log_state.running), 0, __ATOMIC_RELEASE);
+    os_post_sem (log_state.sem);
+    os_destroy_thread (log_state.thread);
+    log_state.thread = NULL;
+    log_flush ();
+  }
+
+  if (log_state.sem != NULL)
+  {
+    os_destroy_sem (log_state.sem);
+    log_state.sem = NULL;
+  }
+
+  for (count = 0; count < LOG_MAX_THREADS; count++)
+  {
+    ring_destroy (log_state.ring[count]);
+    log_state.ring[count] = NULL;
+  }
+
+  log_state.running = 0;
+}
+
+void log_level (int32 module, int32 level)
+{
+  if ((module >= 0) && (module < NUM_LOG_MODULES))
+  {
+    __atomic_store_n (&(log_state.levels[module]), level, __ATOMIC_RELAXED);
+  }
+}
+
+int32 log_enabled (int32 module, int32 level)
+{
+  return (level <= __atomic_load_n (&(log_state.levels[module]), __ATOMIC_RELAXED));
+}
+
+uint32 log_dropped (void)
+{
+  return __atomic_load_n (&(log_state.dropped), __ATOMIC_RELAXED);
+}
+
+/* Real-time safe, copies the record into the calling thread's ring; format
+ * must be a string literal, it is only formatted later by the log thread */
+void log_write (int32 module, const int8 *format, int32 *args, uint32 count)
+{
+  log_record_t record;
+  struct timespec now;
+
+  if (!(__atomic_load_n (&(log_state.running), __ATOMIC_ACQUIRE)))
+  {
+    /* No log thread, print in place */
+    record.format = format;
+    memset (record.arg, 0, sizeof (record.arg));
+    memcpy (record.arg, args, ((count < LOG_MAX_ARGS) ? count : LOG_MAX_ARGS) * sizeof (int));
+    log_emit (&record);
+    return;
+  }
+
+  if (log_slot < 0)
+  {
+    log_slot = __atomic_fetch_add (&(log_state.threads), 1, __ATOMIC_ACQ_REL);
+  }
+
+  if (log_slot >= LOG_MAX_THREADS)
+  {
+    __atomic_add_fetch (&(log_state.dropped), 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  record.time   = (unsigned int)((now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+  record.module = (unsigned char)module;
+  record.args   = (unsigned char)((count < LOG_MAX_ARGS) ? count : LOG_MAX_ARGS);
+  record.format = format;
+  memset (record.arg, 0, sizeof (record.arg));
+  memcpy (record.arg, args, record.args * sizeof (int));
+
+  if ((ring_write (log_state.ring[log_slot], &record, 1)) == 0)
+  {
+    __atomic_add_fetch (&(log_state.dropped), 1, __ATOMIC_RELAXED);
+  }
+}
+
+#ifdef UTIL_LOG_TEST
+
+static void * log_test_main (void *data)
+{
+  int count;
+
+  for (count = 0; count < 100; count++)
+  {
+    LOG (LOG_MODULE_AUDIO, LOG_DEBUG, "Thread %d record %d\n", (int)(long)data, count);
+  }
+
+  return NULL;
+}
+
+int main (void)
+{
+  void *thread[2];
+  struct timespec start, stop;
+  int count;
+
+  LOG (LOG_MODULE_MAIN, LOG_INFO, "Before init, printed in place %d\n", 1);
+
+  log_init ();
+  log_level (LOG_MODULE_AUDIO, LOG_DEBUG);
+
+  LOG (LOG_MODULE_MAIN, LOG_INFO, "No arguments\n");
+  LOG (LOG_MODULE_MAIN, LOG_INFO, "Six arguments %d %d %d %d %d %d\n", 1, 2, 3, 4, 5, 6);
+  LOG (LOG_MODULE_MAIN, LOG_DEBUG, "Filtered, never printed\n");
+
+  os_create_thread (log_test_main, OS_THREAD_PRIORITY_NORMAL, (void *)1, &(thread[0]));
+  os_create_thread (log_test_main, OS_THREAD_PRIORITY_NORMAL, (void *)2, &(thread[1]));
+  os_destroy_thread (thread[0]);
+  os_destroy_thread (thread[1]);
+
+  /* Writer side cost, one burst that fits the ring */
+  log_level (LOG_MODULE_STATUS, LOG_DEBUG);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (count = 0; count < (LOG_RECORDS/2); count++)
+  {
+    LOG (LOG_MODULE_STATUS, LOG_DEBUG, "", count);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &stop);
+
+  LOG (LOG_MODULE_MAIN, LOG_INFO, "Record write %d ns, %u dropped\n",
+       (int)((((stop.tv_sec - start.tv_sec) * 1000000000) + (stop.tv_nsec - start.tv_nsec))
+             /(LOG_RECORDS/2)), log_dropped ());
+
+  log_deinit ();
+
+  return 0;
+}
+
+#endif
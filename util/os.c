@@ -4,10 +4,50 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <assert.h>
 
 #include "types.h"
 #include "util.h"
 
+/* Trap heap allocation on guarded real-time paths */
+/* #define DEBUG_ALLOC_GUARD  (1) */
+
+#ifdef DEBUG_ALLOC_GUARD
+extern void * __libc_malloc (size_t size);
+extern void * __libc_calloc (size_t count, size_t size);
+extern void * __libc_realloc (void *pointer, size_t size);
+
+static __thread int alloc_guard = 0;
+
+static void os_alloc_check (void)
+{
+  if (alloc_guard)
+  {
+    /* Drop the guard first, assert reporting allocates too */
+    alloc_guard = 0;
+    assert (!"Heap allocation on real-time path");
+  }
+}
+
+void * malloc (size_t size)
+{
+  os_alloc_check ();
+  return __libc_malloc (size);
+}
+
+void * calloc (size_t count, size_t size)
+{
+  os_alloc_check ();
+  return __libc_calloc (count, size);
+}
+
+void * realloc (void *pointer, size_t size)
+{
+  os_alloc_check ();
+  return __libc_realloc (pointer, size);
+}
+#endif
+
 
 void os_init (void)
 {
@@ -170,3 +210,10 @@ int32 os_destroy_thread (void *handle)
   return status;
 }
 
+void os_alloc_guard (int32 enable)
+{
+#ifdef DEBUG_ALLOC_GUARD
+  alloc_guard = enable;
+#endif
+}
+
@@ -0,0 +1,759 @@
+
+/* System headers */
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#define PCM_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+
+/* Local structures */
+typedef struct
+{
+  const char  *name;
+  void       (*deinterleave)(const short int *, short int *, short int *, unsigned int);
+  void       (*interleave)(const short int *, const short int *, short int *, unsigned int);
+  void       (*downmix)(const short int *, short int *, unsigned int);
+  void       (*gain)(short int *, unsigned int, short int);
+  void       (*saturate)(const int *, short int *, unsigned int);
+  int        (*dot)(const short int *, const short int *, unsigned int);
+} pcm_kernels_t;
+
+
+/* Scalar reference, every other path must match it bit for bit */
+static void pcm_scalar_deinterleave (const short int *stereo, short int *left,
+                                     short int *right, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; count < frames; count++)
+  {
+    left[count] = stereo[2 * count];
+    if (right != NULL)
+    {
+      right[count] = stereo[(2 * count) + 1];
+    }
+  }
+}
+
+static void pcm_scalar_interleave (const short int *left, const short int *right,
+                                   short int *stereo, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; count < frames; count++)
+  {
+    stereo[2 * count]       = left[count];
+    stereo[(2 * count) + 1] = right[count];
+  }
+}
+
+static void pcm_scalar_downmix (const short int *stereo, short int *mono, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; count < frames; count++)
+  {
+    mono[count] = (short int)(((int)stereo[2 * count] + (int)stereo[(2 * count) + 1]) >> 1);
+  }
+}
+
+static inline short int pcm_clamp (int value)
+{
+  return (short int)((value > 32767) ? 32767 : ((value < -32768) ? -32768 : value));
+}
+
+static void pcm_scalar_gain (short int *buffer, unsigned int samples, short int gain)
+{
+  unsigned int count;
+
+  for (count = 0; count < samples; count++)
+  {
+    buffer[count] = pcm_clamp ((((int)buffer[count] * gain) + (0x1 << (PCM_GAIN_SHIFT - 1)))
+                               >> PCM_GAIN_SHIFT);
+  }
+}
+
+static void pcm_scalar_saturate (const int *input, short int *output, unsigned int samples)
+{
+  unsigned int count;
+
+  for (count = 0; count < samples; count++)
+  {
+    output[count] = pcm_clamp (input[count]);
+  }
+}
+
+/* Wraps modulo 2^32 like the vector multiply-adds */
+static int pcm_scalar_dot (const short int *a, const short int *b, unsigned int count)
+{
+  unsigned int index;
+  unsigned int sum = 0;
+
+  for (index = 0; index < count; index++)
+  {
+    sum += (unsigned int)((int)a[index] * (int)b[index]);
+  }
+
+  return (int)sum;
+}
+
+#ifdef PCM_X86
+
+/* SSE2, 8 samples per vector */
+__attribute__((target("sse2")))
+static void pcm_sse2_deinterleave (const short int *stereo, short int *left,
+                                   short int *right, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    __m128i first = _mm_loadu_si128 ((const __m128i *)&(stereo[2 * count]));
+    __m128i second = _mm_loadu_si128 ((const __m128i *)&(stereo[(2 * count) + 8]));
+
+    /* Sign extend each half of the 32 bit pairs, then pack back down */
+    _mm_storeu_si128 ((__m128i *)&(left[count]),
+                      _mm_packs_epi32 (_mm_srai_epi32 (_mm_slli_epi32 (first, 16), 16),
+                                       _mm_srai_epi32 (_mm_slli_epi32 (second, 16), 16)));
+    if (right != NULL)
+    {
+      _mm_storeu_si128 ((__m128i *)&(right[count]),
+                        _mm_packs_epi32 (_mm_srai_epi32 (first, 16),
+                                         _mm_srai_epi32 (second, 16)));
+    }
+  }
+
+  pcm_scalar_deinterleave (&(stereo[2 * count]), &(left[count]),
+                           (right != NULL) ? &(right[count]) : NULL, frames - count);
+}
+
+__attribute__((target("sse2")))
+static void pcm_sse2_interleave (const short int *left, const short int *right,
+                                 short int *stereo, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    __m128i l = _mm_loadu_si128 ((const __m128i *)&(left[count]));
+    __m128i r = _mm_loadu_si128 ((const __m128i *)&(right[count]));
+
+    _mm_storeu_si128 ((__m128i *)&(stereo[2 * count]), _mm_unpacklo_epi16 (l, r));
+    _mm_storeu_si128 ((__m128i *)&(stereo[(2 * count) + 8]), _mm_unpackhi_epi16 (l, r));
+  }
+
+  pcm_scalar_interleave (&(left[count]), &(right[count]), &(stereo[2 * count]),
+                         frames - count);
+}
+
+__attribute__((target("sse2")))
+static void pcm_sse2_downmix (const short int *stereo, short int *mono, unsigned int frames)
+{
+  const __m128i ones = _mm_set1_epi16 (1);
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    __m128i first = _mm_loadu_si128 ((const __m128i *)&(stereo[2 * count]));
+    __m128i second = _mm_loadu_si128 ((const __m128i *)&(stereo[(2 * count) + 8]));
+
+    /* Pairwise L + R in 32 bits, halved, always in range for the pack */
+    _mm_storeu_si128 ((__m128i *)&(mono[count]),
+                      _mm_packs_epi32 (_mm_srai_epi32 (_mm_madd_epi16 (first, ones), 1),
+                                       _mm_srai_epi32 (_mm_madd_epi16 (second, ones), 1)));
+  }
+
+  pcm_scalar_downmix (&(stereo[2 * count]), &(mono[count]), frames - count);
+}
+
+__attribute__((target("sse2")))
+static void pcm_sse2_gain (short int *buffer, unsigned int samples, short int gain)
+{
+  const __m128i factor = _mm_set1_epi16 (gain);
+  const __m128i round = _mm_set1_epi32 (0x1 << (PCM_GAIN_SHIFT - 1));
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= samples; count += 8)
+  {
+    __m128i value = _mm_loadu_si128 ((const __m128i *)&(buffer[count]));
+    __m128i low = _mm_mullo_epi16 (value, factor);
+    __m128i high = _mm_mulhi_epi16 (value, factor);
+
+    /* Full 32 bit products from the two halves */
+    __m128i first = _mm_add_epi32 (_mm_unpacklo_epi16 (low, high), round);
+    __m128i second = _mm_add_epi32 (_mm_unpackhi_epi16 (low, high), round);
+
+    _mm_storeu_si128 ((__m128i *)&(buffer[count]),
+                      _mm_packs_epi32 (_mm_srai_epi32 (first, PCM_GAIN_SHIFT),
+                                       _mm_srai_epi32 (second, PCM_GAIN_SHIFT)));
+  }
+
+  pcm_scalar_gain (&(buffer[count]), samples - count, gain);
+}
+
+__attribute__((target("sse2")))
+static void pcm_sse2_saturate (const int *input, short int *output, unsigned int samples)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= samples; count += 8)
+  {
+    _mm_storeu_si128 ((__m128i *)&(output[count]),
+                      _mm_packs_epi32 (_mm_loadu_si128 ((const __m128i *)&(input[count])),
+                                       _mm_loadu_si128 ((const __m128i *)&(input[count + 4]))));
+  }
+
+  pcm_scalar_saturate (&(input[count]), &(output[count]), samples - count);
+}
+
+__attribute__((target("sse2")))
+static int pcm_sse2_dot (const short int *a, const short int *b, unsigned int count)
+{
+  __m128i sum = _mm_setzero_si128 ();
+  unsigned int index;
+
+  for (index = 0; (index + 8) <= count; index += 8)
+  {
+    sum = _mm_add_epi32 (sum, _mm_madd_epi16 (_mm_loadu_si128 ((const __m128i *)&(a[index])),
+                                              _mm_loadu_si128 ((const __m128i *)&(b[index]))));
+  }
+
+  sum = _mm_add_epi32 (sum, _mm_shuffle_epi32 (sum, _MM_SHUFFLE (1, 0, 3, 2)));
+  sum = _mm_add_epi32 (sum, _mm_shuffle_epi32 (sum, _MM_SHUFFLE (2, 3, 0, 1)));
+
+  return (int)((unsigned int)_mm_cvtsi128_si32 (sum)
+               + (unsigned int)pcm_scalar_dot (&(a[index]), &(b[index]), count - index));
+}
+
+/* AVX2, 16 samples per vector; packs and unpacks work per 128 bit lane so
+ * results are put back in order with a cross lane permute */
+__attribute__((target("avx2")))
+static void pcm_avx2_deinterleave (const short int *stereo, short int *left,
+                                   short int *right, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 16) <= frames; count += 16)
+  {
+    __m256i first = _mm256_loadu_si256 ((const __m256i *)&(stereo[2 * count]));
+    __m256i second = _mm256_loadu_si256 ((const __m256i *)&(stereo[(2 * count) + 16]));
+    __m256i l = _mm256_packs_epi32 (_mm256_srai_epi32 (_mm256_slli_epi32 (first, 16), 16),
+                                    _mm256_srai_epi32 (_mm256_slli_epi32 (second, 16), 16));
+
+    _mm256_storeu_si256 ((__m256i *)&(left[count]),
+                         _mm256_permute4x64_epi64 (l, _MM_SHUFFLE (3, 1, 2, 0)));
+    if (right != NULL)
+    {
+      __m256i r = _mm256_packs_epi32 (_mm256_srai_epi32 (first, 16),
+                                      _mm256_srai_epi32 (second, 16));
+
+      _mm256_storeu_si256 ((__m256i *)&(right[count]),
+                           _mm256_permute4x64_epi64 (r, _MM_SHUFFLE (3, 1, 2, 0)));
+    }
+  }
+
+  pcm_sse2_deinterleave (&(stereo[2 * count]), &(left[count]),
+                         (right != NULL) ? &(right[count]) : NULL, frames - count);
+}
+
+__attribute__((target("avx2")))
+static void pcm_avx2_interleave (const short int *left, const short int *right,
+                                 short int *stereo, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 16) <= frames; count += 16)
+  {
+    __m256i l = _mm256_loadu_si256 ((const __m256i *)&(left[count]));
+    __m256i r = _mm256_loadu_si256 ((const __m256i *)&(right[count]));
+    __m256i low = _mm256_unpacklo_epi16 (l, r);
+    __m256i high = _mm256_unpackhi_epi16 (l, r);
+
+    _mm256_storeu_si256 ((__m256i *)&(stereo[2 * count]),
+                         _mm256_permute2x128_si256 (low, high, 0x20));
+    _mm256_storeu_si256 ((__m256i *)&(stereo[(2 * count) + 16]),
+                         _mm256_permute2x128_si256 (low, high, 0x31));
+  }
+
+  pcm_sse2_interleave (&(left[count]), &(right[count]), &(stereo[2 * count]),
+                       frames - count);
+}
+
+__attribute__((target("avx2")))
+static void pcm_avx2_downmix (const short int *stereo, short int *mono, unsigned int frames)
+{
+  const __m256i ones = _mm256_set1_epi16 (1);
+  unsigned int count;
+
+  for (count = 0; (count + 16) <= frames; count += 16)
+  {
+    __m256i first = _mm256_loadu_si256 ((const __m256i *)&(stereo[2 * count]));
+    __m256i second = _mm256_loadu_si256 ((const __m256i *)&(stereo[(2 * count) + 16]));
+    __m256i sum = _mm256_packs_epi32 (_mm256_srai_epi32 (_mm256_madd_epi16 (first, ones), 1),
+                                      _mm256_srai_epi32 (_mm256_madd_epi16 (second, ones), 1));
+
+    _mm256_storeu_si256 ((__m256i *)&(mono[count]),
+                         _mm256_permute4x64_epi64 (sum, _MM_SHUFFLE (3, 1, 2, 0)));
+  }
+
+  pcm_sse2_downmix (&(stereo[2 * count]), &(mono[count]), frames - count);
+}
+
+__attribute__((target("avx2")))
+static void pcm_avx2_gain (short int *buffer, unsigned int samples, short int gain)
+{
+  const __m256i factor = _mm256_set1_epi16 (gain);
+  const __m256i round = _mm256_set1_epi32 (0x1 << (PCM_GAIN_SHIFT - 1));
+  unsigned int count;
+
+  for (count = 0; (count + 16) <= samples; count += 16)
+  {
+    __m256i value = _mm256_loadu_si256 ((const __m256i *)&(buffer[count]));
+    __m256i low = _mm256_mullo_epi16 (value, factor);
+    __m256i high = _mm256_mulhi_epi16 (value, factor);
+    __m256i first = _mm256_add_epi32 (_mm256_unpacklo_epi16 (low, high), round);
+    __m256i second = _mm256_add_epi32 (_mm256_unpackhi_epi16 (low, high), round);
+
+    /* Unpack and pack are both per lane, so the order comes back as it was */
+    _mm256_storeu_si256 ((__m256i *)&(buffer[count]),
+                         _mm256_packs_epi32 (_mm256_srai_epi32 (first, PCM_GAIN_SHIFT),
+                                             _mm256_srai_epi32 (second, PCM_GAIN_SHIFT)));
+  }
+
+  pcm_sse2_gain (&(buffer[count]), samples - count, gain);
+}
+
+__attribute__((target("avx2")))
+static void pcm_avx2_saturate (const int *input, short int *output, unsigned int samples)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 16) <= samples; count += 16)
+  {
+    __m256i packed
+      = _mm256_packs_epi32 (_mm256_loadu_si256 ((const __m256i *)&(input[count])),
+                            _mm256_loadu_si256 ((const __m256i *)&(input[count + 8])));
+
+    _mm256_storeu_si256 ((__m256i *)&(output[count]),
+                         _mm256_permute4x64_epi64 (packed, _MM_SHUFFLE (3, 1, 2, 0)));
+  }
+
+  pcm_sse2_saturate (&(input[count]), &(output[count]), samples - count);
+}
+
+__attribute__((target("avx2")))
+static int pcm_avx2_dot (const short int *a, const short int *b, unsigned int count)
+{
+  __m256i sum = _mm256_setzero_si256 ();
+  __m128i half;
+  unsigned int index;
+
+  for (index = 0; (index + 16) <= count; index += 16)
+  {
+    sum = _mm256_add_epi32 (sum,
+                            _mm256_madd_epi16 (_mm256_loadu_si256 ((const __m256i *)&(a[index])),
+                                               _mm256_loadu_si256 ((const __m256i *)&(b[index]))));
+  }
+
+  half = _mm_add_epi32 (_mm256_castsi256_si128 (sum), _mm256_extracti128_si256 (sum, 1));
+  half = _mm_add_epi32 (half, _mm_shuffle_epi32 (half, _MM_SHUFFLE (1, 0, 3, 2)));
+  half = _mm_add_epi32 (half, _mm_shuffle_epi32 (half, _MM_SHUFFLE (2, 3, 0, 1)));
+
+  return (int)((unsigned int)_mm_cvtsi128_si32 (half)
+               + (unsigned int)pcm_sse2_dot (&(a[index]), &(b[index]), count - index));
+}
+
+#endif
+
+#ifdef PCM_NEON
+
+/* NEON, 8 samples per vector; structured loads/stores do the (de)interleave */
+static void pcm_neon_deinterleave (const short int *stereo, short int *left,
+                                   short int *right, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    int16x8x2_t pair = vld2q_s16 (&(stereo[2 * count]));
+
+    vst1q_s16 (&(left[count]), pair.val[0]);
+    if (right != NULL)
+    {
+      vst1q_s16 (&(right[count]), pair.val[1]);
+    }
+  }
+
+  pcm_scalar_deinterleave (&(stereo[2 * count]), &(left[count]),
+                           (right != NULL) ? &(right[count]) : NULL, frames - count);
+}
+
+static void pcm_neon_interleave (const short int *left, const short int *right,
+                                 short int *stereo, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    int16x8x2_t pair;
+
+    pair.val[0] = vld1q_s16 (&(left[count]));
+    pair.val[1] = vld1q_s16 (&(right[count]));
+    vst2q_s16 (&(stereo[2 * count]), pair);
+  }
+
+  pcm_scalar_interleave (&(left[count]), &(right[count]), &(stereo[2 * count]),
+                         frames - count);
+}
+
+static void pcm_neon_downmix (const short int *stereo, short int *mono, unsigned int frames)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= frames; count += 8)
+  {
+    int16x8x2_t pair = vld2q_s16 (&(stereo[2 * count]));
+
+    /* Halving add is (L + R) >> 1 without overflow */
+    vst1q_s16 (&(mono[count]), vhaddq_s16 (pair.val[0], pair.val[1]));
+  }
+
+  pcm_scalar_downmix (&(stereo[2 * count]), &(mono[count]), frames - count);
+}
+
+static void pcm_neon_gain (short int *buffer, unsigned int samples, short int gain)
+{
+  const int16x4_t factor = vdup_n_s16 (gain);
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= samples; count += 8)
+  {
+    int16x8_t value = vld1q_s16 (&(buffer[count]));
+
+    /* Rounding shift adds the same half LSB as the reference */
+    int32x4_t low = vrshrq_n_s32 (vmull_s16 (vget_low_s16 (value), factor), PCM_GAIN_SHIFT);
+    int32x4_t high = vrshrq_n_s32 (vmull_s16 (vget_high_s16 (value), factor), PCM_GAIN_SHIFT);
+
+    vst1q_s16 (&(buffer[count]), vcombine_s16 (vqmovn_s32 (low), vqmovn_s32 (high)));
+  }
+
+  pcm_scalar_gain (&(buffer[count]), samples - count, gain);
+}
+
+static void pcm_neon_saturate (const int *input, short int *output, unsigned int samples)
+{
+  unsigned int count;
+
+  for (count = 0; (count + 8) <= samples; count += 8)
+  {
+    vst1q_s16 (&(output[count]), vcombine_s16 (vqmovn_s32 (vld1q_s32 (&(input[count]))),
+                                               vqmovn_s32 (vld1q_s32 (&(input[count + 4])))));
+  }
+
+  pcm_scalar_saturate (&(input[count]), &(output[count]), samples - count);
+}
+
+static int pcm_neon_dot (const short int *a, const short int *b, unsigned int count)
+{
+  int32x4_t sum = vdupq_n_s32 (0);
+  int32x2_t half;
+  unsigned int index;
+
+  for (index = 0; (index + 8) <= count; index += 8)
+  {
+    int16x8_t x = vld1q_s16 (&(a[index]));
+    int16x8_t y = vld1q_s16 (&(b[index]));
+
+    sum = vmlal_s16 (sum, vget_low_s16 (x), vget_low_s16 (y));
+    sum = vmlal_s16 (sum, vget_high_s16 (x), vget_high_s16 (y));
+  }
+
+  half = vadd_s32 (vget_low_s32 (sum), vget_high_s32 (sum));
+  half = vpadd_s32 (half, half);
+
+  return (int)((unsigned int)vget_lane_s32 (half, 0)
+               + (unsigned int)pcm_scalar_dot (&(a[index]), &(b[index]), count - index));
+}
+
+#endif
+
+static const pcm_kernels_t pcm_paths[NUM_PCM_PATHS] =
+{
+  [PCM_PATH_SCALAR] =
+    {
+      "scalar", pcm_scalar_deinterleave, pcm_scalar_interleave, pcm_scalar_downmix,
+      pcm_scalar_gain, pcm_scalar_saturate, pcm_scalar_dot
+    },
+#ifdef PCM_X86
+  [PCM_PATH_SSE2] =
+    {
+      "SSE2", pcm_sse2_deinterleave, pcm_sse2_interleave, pcm_sse2_downmix,
+      pcm_sse2_gain, pcm_sse2_saturate, pcm_sse2_dot
+    },
+  [PCM_PATH_AVX2] =
+    {
+      "AVX2", pcm_avx2_deinterleave, pcm_avx2_interleave, pcm_avx2_downmix,
+      pcm_avx2_gain, pcm_avx2_saturate, pcm_avx2_dot
+    },
+#endif
+#ifdef PCM_NEON
+  [PCM_PATH_NEON] =
+    {
+      "NEON", pcm_neon_deinterleave, pcm_neon_interleave, pcm_neon_downmix,
+      pcm_neon_gain, pcm_neon_saturate, pcm_neon_dot
+    },
+#endif
+};
+
+/* File scope global variables */
+static const pcm_kernels_t *pcm = &(pcm_paths[PCM_PATH_SCALAR]);
+
+
+/* 1 when this CPU can run the path */
+int32 pcm_supported (int32 path)
+{
+  int status = 0;
+
+  if ((path >= 0) && (path < NUM_PCM_PATHS) && (pcm_paths[path].name != NULL))
+  {
+    switch (path)
+    {
+#ifdef PCM_X86
+      case PCM_PATH_SSE2:
+      {
+        status = __builtin_cpu_supports ("sse2");
+        break;
+      }
+      case PCM_PATH_AVX2:
+      {
+        status = __builtin_cpu_supports ("avx2");
+        break;
+      }
+#endif
+#ifdef PCM_NEON
+      case PCM_PATH_NEON:
+      {
+#ifdef __aarch64__
+        status = 1;
+#else
+        status = ((getauxval (AT_HWCAP) & HWCAP_NEON) != 0);
+#endif
+        break;
+      }
+#endif
+      default:
+      {
+        status = 1;
+        break;
+      }
+    }
+  }
+
+  return (status != 0);
+}
+
+/* Force a path, -1 when this CPU (or build) does not have it */
+int32 pcm_select (int32 path)
+{
+  int status = -1;
+
+  if (pcm_supported (path))
+  {
+    pcm    = &(pcm_paths[path]);
+    status = 1;
+  }
+
+  return status;
+}
+
+/* Widest supported path, kernels run scalar until this is called */
+void pcm_init (void)
+{
+  if (((pcm_select (PCM_PATH_AVX2)) < 0) &&
+      ((pcm_select (PCM_PATH_SSE2)) < 0) &&
+      ((pcm_select (PCM_PATH_NEON)) < 0))
+  {
+    pcm_select (PCM_PATH_SCALAR);
+  }
+}
+
+const int8 * pcm_path (void)
+{
+  return pcm->name;
+}
+
+void pcm_deinterleave (int16 *stereo, int16 *left, int16 *right, uint32 frames)
+{
+  pcm->deinterleave (stereo, left, right, frames);
+}
+
+void pcm_interleave (int16 *left, int16 *right, int16 *stereo, uint32 frames)
+{
+  pcm->interleave (left, right, stereo, frames);
+}
+
+void pcm_downmix (int16 *stereo, int16 *mono, uint32 frames)
+{
+  pcm->downmix (stereo, mono, frames);
+}
+
+void pcm_gain (int16 *buffer, uint32 samples, int16 gain)
+{
+  pcm->gain (buffer, samples, gain);
+}
+
+void pcm_saturate (int32 *input, int16 *output, uint32 samples)
+{
+  pcm->saturate (input, output, samples);
+}
+
+int32 pcm_dot (int16 *a, int16 *b, uint32 count)
+{
+  return pcm->dot (a, b, count);
+}
+
+#ifdef UTIL_PCM_TEST
+
+#include <stdlib.h>
+#include <time.h>
+
+#define PCM_TEST_FRAMES  (1000)
+
+static short int pcm_test_sample (void)
+{
+  /* Plenty of full scale values to hit saturation and sign edges */
+  switch (rand () % 8)
+  {
+    case 0:
+      return 32767;
+    case 1:
+      return -32768;
+    default:
+      return (short int)((rand () % 65536) - 32768);
+  }
+}
+
+/* Every kernel on every length up to a few vectors plus a long run,
+ * compared against the scalar reference; returns mismatches */
+static int pcm_test_path (int32 path)
+{
+  static short int stereo[2 * PCM_TEST_FRAMES];
+  static short int left[2][PCM_TEST_FRAMES];
+  static short int right[2][PCM_TEST_FRAMES];
+  static short int output[2][2 * PCM_TEST_FRAMES];
+  static int wide[PCM_TEST_FRAMES];
+  const pcm_kernels_t *reference = &(pcm_paths[PCM_PATH_SCALAR]);
+  const pcm_kernels_t *kernels = &(pcm_paths[path]);
+  int failures = 0;
+  unsigned int frames;
+  unsigned int count;
+
+  for (frames = 0; frames <= PCM_TEST_FRAMES; frames += ((frames < 70) ? 1 : 310))
+  {
+    short int gain = (short int)((rand () % 65536) - 32768);
+
+    for (count = 0; count < (2 * PCM_TEST_FRAMES); count++)
+    {
+      stereo[count] = pcm_test_sample ();
+    }
+    for (count = 0; count < PCM_TEST_FRAMES; count++)
+    {
+      wide[count] = (rand () % 2) ? ((rand () % 131072) - 65536) : (int)stereo[count];
+    }
+
+    memset (output, 0, sizeof (output));
+    reference->deinterleave (stereo, left[0], right[0], frames);
+    kernels->deinterleave (stereo, left[1], right[1], frames);
+    failures += ((memcmp (left[0], left[1], frames * sizeof (short int))) != 0);
+    failures += ((memcmp (right[0], right[1], frames * sizeof (short int))) != 0);
+    kernels->deinterleave (stereo, left[1], NULL, frames);
+    failures += ((memcmp (left[0], left[1], frames * sizeof (short int))) != 0);
+
+    reference->interleave (left[0], right[0], output[0], frames);
+    kernels->interleave (left[0], right[0], output[1], frames);
+    failures += ((memcmp (output[0], output[1], 2 * frames * sizeof (short int))) != 0);
+
+    reference->downmix (stereo, output[0], frames);
+    kernels->downmix (stereo, output[1], frames);
+    failures += ((memcmp (output[0], output[1], frames * sizeof (short int))) != 0);
+
+    memcpy (output[0], stereo, 2 * frames * sizeof (short int));
+    memcpy (output[1], stereo, 2 * frames * sizeof (short int));
+    reference->gain (output[0], 2 * frames, gain);
+    kernels->gain (output[1], 2 * frames, gain);
+    failures += ((memcmp (output[0], output[1], 2 * frames * sizeof (short int))) != 0);
+
+    reference->saturate (wide, output[0], frames);
+    kernels->saturate (wide, output[1], frames);
+    failures += ((memcmp (output[0], output[1], frames * sizeof (short int))) != 0);
+
+    failures += ((reference->dot (left[0], right[0], frames))
+                 != (kernels->dot (left[0], right[0], frames)));
+  }
+
+  return failures;
+}
+
+/* Filter sized dot products and a frame of downmix, nanosec. per call */
+static double pcm_test_bench (int32 path)
+{
+  static short int stereo[2 * 960];
+  static short int mono[960];
+  const pcm_kernels_t *kernels = &(pcm_paths[path]);
+  struct timespec start, stop;
+  volatile int sink = 0;
+  int count;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (count = 0; count < 20000; count++)
+  {
+    sink += kernels->dot (stereo, &(stereo[count & 0xff]), 96);
+    kernels->downmix (stereo, mono, 960);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &stop);
+
+  return (((stop.tv_sec - start.tv_sec) * 1e9) + (stop.tv_nsec - start.tv_nsec))/20000;
+}
+
+int main (void)
+{
+  int failures = 0;
+  int32 path;
+
+  srand (1);
+
+  for (path = 0; path < NUM_PCM_PATHS; path++)
+  {
+    if (pcm_supported (path))
+    {
+      int path_failures = pcm_test_path (path);
+
+      printf ("PCM %-6s: %s, %.0f ns per 96 tap dot + 960 frame downmix\n",
+              pcm_paths[path].name, path_failures ? "FAIL" : "bit-exact",
+              pcm_test_bench (path));
+      failures += path_failures;
+    }
+  }
+
+  pcm_init ();
+  printf ("PCM selected %s: %s\n", pcm_path (), failures ? "FAIL" : "OK");
+
+  return failures ? 1 : 0;
+}
+
+#endif
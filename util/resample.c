@@ -0,0 +1,687 @@
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+
+/* Filter taps per polyphase branch */
+#define RESAMPLE_TAPS_PER_PHASE  (16)
+
+/* Pass band edge as a fraction of the low rate Nyquist frequency */
+#define RESAMPLE_CUTOFF          (0.90)
+
+/* Coefficient fixed point format */
+#define RESAMPLE_COEF_SHIFT      (15)
+
+/* Ratios with compile time specialized kernels: 1, 2, 3 and 6 */
+#define RESAMPLE_RATIOS          (4)
+
+/* Local structures */
+typedef struct resample_s
+{
+  int             direction;
+  unsigned int    ratio;
+  unsigned char   channels;
+  unsigned int    block;
+  unsigned int    taps;
+  unsigned int    phase;
+  unsigned int    history_size;
+  short int      *coef;
+  short int      *history[2];
+  unsigned char   input_channels;
+  unsigned char   output_channels;
+  unsigned int  (*kernel)(struct resample_s *, const short int *, unsigned int, short int *);
+} resample_t;
+
+typedef unsigned int (*resample_kernel_t)(resample_t *, const short int *, unsigned int,
+                                          short int *);
+
+
+/* Fixed point dot product, kept branch free so the compiler vectorizes it */
+static inline int resample_dot (const short int * __restrict sample,
+                                const short int * __restrict coef,
+                                unsigned int taps)
+{
+  unsigned int count;
+  int sum = 0;
+
+  for (count = 0; count < taps; count++)
+  {
+    sum += (int)sample[count] * (int)coef[count];
+  }
+
+  return sum;
+}
+
+static inline short int resample_round (int sum)
+{
+  sum = (sum + (0x1 << (RESAMPLE_COEF_SHIFT - 1))) >> RESAMPLE_COEF_SHIFT;
+
+  if (sum > 32767)
+  {
+    sum = 32767;
+  }
+  else if (sum < -32768)
+  {
+    sum = -32768;
+  }
+
+  return (short int)sum;
+}
+
+/* Windowed sinc low pass prototype, cutoff at the low rate Nyquist */
+static void resample_design (resample_t *resample)
+{
+  unsigned int length = resample->ratio * RESAMPLE_TAPS_PER_PHASE;
+  double *prototype = malloc (length * sizeof (double));
+  double cutoff = (0.5 * RESAMPLE_CUTOFF)/resample->ratio;
+  double gain = 0.0;
+  unsigned int count;
+
+  for (count = 0; count < length; count++)
+  {
+    double time = (double)count - ((double)(length - 1)/2.0);
+    double window = 0.42 - (0.5 * cos ((2.0 * M_PI * count)/(length - 1)))
+                    + (0.08 * cos ((4.0 * M_PI * count)/(length - 1)));
+    double sinc = (time == 0.0) ? (2.0 * cutoff)
+                  : ((sin (2.0 * M_PI * cutoff * time))/(M_PI * time));
+
+    prototype[count] = sinc * window;
+    gain += prototype[count];
+  }
+
+  /* Unity DC gain for decimation, ratio gain to make up for zero stuffing */
+  if (resample->direction == RESAMPLE_INTERPOLATE)
+  {
+    gain /= resample->ratio;
+  }
+
+  if (resample->direction == RESAMPLE_DECIMATE)
+  {
+    /* Single branch over the full filter, time reversed */
+    for (count = 0; count < length; count++)
+    {
+      resample->coef[count]
+        = (short int)lrint ((prototype[length - 1 - count]/gain)
+                            * (0x1 << RESAMPLE_COEF_SHIFT));
+    }
+  }
+  else
+  {
+    unsigned int phase;
+    unsigned int tap;
+
+    /* Branch 'phase' holds every ratio-th tap, time reversed */
+    for (phase = 0; phase < resample->ratio; phase++)
+    {
+      for (tap = 0; tap < resample->taps; tap++)
+      {
+        double value = prototype[((resample->taps - 1 - tap) * resample->ratio) + phase];
+
+        resample->coef[(phase * resample->taps) + tap]
+          = (short int)lrint ((value/gain) * (0x1 << RESAMPLE_COEF_SHIFT));
+      }
+    }
+  }
+
+  free (prototype);
+}
+
+/* One block through the filter (or the channel map at ratio 1). Direction,
+ * ratio and channel counts are compile time constants in the specialized
+ * kernels below, so taps, strides and modulos fold away; the generic path
+ * passes the runtime values */
+static inline __attribute__((always_inline))
+unsigned int resample_block (resample_t *resample, const short int *input, unsigned int block,
+                             short int *output, const int direction, const unsigned int ratio,
+                             const unsigned char channels, const unsigned char input_channels,
+                             const unsigned char output_channels)
+{
+  unsigned int count;
+  unsigned int written = 0;
+  unsigned char channel;
+
+  if (ratio == 1)
+  {
+    /* Channel mapping only, the second channel of a pair is the one dropped */
+    if (input_channels == output_channels)
+    {
+      memcpy (output, input, block * input_channels * sizeof (short int));
+    }
+    else if ((input_channels == 2) && (output_channels == 1))
+    {
+      pcm_deinterleave ((short int *)input, output, NULL, block);
+    }
+    else if ((input_channels == 1) && (output_channels == 2))
+    {
+      pcm_interleave ((short int *)input, (short int *)input, output, block);
+    }
+    else
+    {
+      for (count = 0; count < block; count++)
+      {
+        for (channel = 0; channel < output_channels; channel++)
+        {
+          output[(count * output_channels) + channel]
+            = input[(count * input_channels) + (channel % input_channels)];
+        }
+      }
+    }
+
+    return block;
+  }
+
+  /* Append de-interleaved input after the filter memory */
+  if (input_channels == 2)
+  {
+    pcm_deinterleave ((short int *)input, &(resample->history[0][resample->history_size]),
+                      (channels > 1) ? &(resample->history[1][resample->history_size]) : NULL,
+                      block);
+  }
+  else
+  {
+    for (channel = 0; channel < channels; channel++)
+    {
+      short int *history = &(resample->history[channel][resample->history_size]);
+      unsigned char source = channel % input_channels;
+
+      for (count = 0; count < block; count++)
+      {
+        history[count] = input[(count * input_channels) + source];
+      }
+    }
+  }
+
+  if (direction == RESAMPLE_DECIMATE)
+  {
+    const unsigned int taps = ratio * RESAMPLE_TAPS_PER_PHASE;
+
+    for (count = resample->phase; count < block; count += ratio)
+    {
+      for (channel = 0; channel < output_channels; channel++)
+      {
+        short int *history = resample->history[channel % channels];
+
+        output[(written * output_channels) + channel]
+          = resample_round (resample_dot (&(history[count]), resample->coef, taps));
+      }
+
+      written++;
+    }
+
+    resample->phase = count - block;
+  }
+  else
+  {
+    unsigned int phase;
+
+    for (count = 0; count < block; count++)
+    {
+      for (phase = 0; phase < ratio; phase++)
+      {
+        short int *coef = &(resample->coef[phase * RESAMPLE_TAPS_PER_PHASE]);
+
+        for (channel = 0; channel < output_channels; channel++)
+        {
+          short int *history = resample->history[channel % channels];
+
+          /* Short branches gain from the CPU's widest multiply-add; the long
+           * decimation filter is faster inlined with its constant length */
+          output[(written * output_channels) + channel]
+            = resample_round (pcm_dot (&(history[count]), coef, RESAMPLE_TAPS_PER_PHASE));
+        }
+
+        written++;
+      }
+    }
+  }
+
+  return written;
+}
+
+static unsigned int resample_generic (resample_t *resample, const short int *input,
+                                      unsigned int block, short int *output,
+                                      unsigned char input_channels,
+                                      unsigned char output_channels)
+{
+  return resample_block (resample, input, block, output, resample->direction,
+                         resample->ratio, resample->channels, input_channels,
+                         output_channels);
+}
+
+/* Specializations; the filter side channel count is the codec one, output
+ * for decimation and input for interpolation */
+#define RESAMPLE_DECIMATOR(ratio, input_channels, output_channels)                  \
+  static unsigned int resample_decimate_##ratio##_##input_channels##_##output_channels \
+    (resample_t *resample, const short int *input, unsigned int block,             \
+     short int *output)                                                            \
+  {                                                                                \
+    return resample_block (resample, input, block, output, RESAMPLE_DECIMATE,      \
+                           ratio, output_channels, input_channels, output_channels); \
+  }
+
+#define RESAMPLE_INTERPOLATOR(ratio, input_channels, output_channels)                  \
+  static unsigned int resample_interpolate_##ratio##_##input_channels##_##output_channels \
+    (resample_t *resample, const short int *input, unsigned int block,                \
+     short int *output)                                                               \
+  {                                                                                   \
+    return resample_block (resample, input, block, output, RESAMPLE_INTERPOLATE,      \
+                           ratio, input_channels, input_channels, output_channels);    \
+  }
+
+#define RESAMPLE_KERNELS(ratio)        \
+  RESAMPLE_DECIMATOR (ratio, 1, 1)     \
+  RESAMPLE_DECIMATOR (ratio, 2, 1)     \
+  RESAMPLE_DECIMATOR (ratio, 1, 2)     \
+  RESAMPLE_DECIMATOR (ratio, 2, 2)     \
+  RESAMPLE_INTERPOLATOR (ratio, 1, 1)  \
+  RESAMPLE_INTERPOLATOR (ratio, 2, 1)  \
+  RESAMPLE_INTERPOLATOR (ratio, 1, 2)  \
+  RESAMPLE_INTERPOLATOR (ratio, 2, 2)
+
+RESAMPLE_KERNELS (1)
+RESAMPLE_KERNELS (2)
+RESAMPLE_KERNELS (3)
+RESAMPLE_KERNELS (6)
+
+#define RESAMPLE_TABLE(direction, ratio)                          \
+  {                                                               \
+    { resample_##direction##_##ratio##_1_1,                       \
+      resample_##direction##_##ratio##_1_2 },                     \
+    { resample_##direction##_##ratio##_2_1,                       \
+      resample_##direction##_##ratio##_2_2 }                      \
+  }
+
+/* Indexed by direction, ratio slot, input channels - 1, output channels - 1 */
+static const resample_kernel_t resample_kernels[2][RESAMPLE_RATIOS][2][2] =
+{
+  [RESAMPLE_DECIMATE] =
+    {
+      RESAMPLE_TABLE (decimate, 1),
+      RESAMPLE_TABLE (decimate, 2),
+      RESAMPLE_TABLE (decimate, 3),
+      RESAMPLE_TABLE (decimate, 6)
+    },
+  [RESAMPLE_INTERPOLATE] =
+    {
+      RESAMPLE_TABLE (interpolate, 1),
+      RESAMPLE_TABLE (interpolate, 2),
+      RESAMPLE_TABLE (interpolate, 3),
+      RESAMPLE_TABLE (interpolate, 6)
+    }
+};
+
+static resample_kernel_t resample_select (int direction, unsigned int ratio,
+                                          unsigned char input_channels,
+                                          unsigned char output_channels)
+{
+  resample_kernel_t kernel = NULL;
+  int slot = (ratio == 1) ? 0 : (ratio == 2) ? 1 : (ratio == 3) ? 2 : (ratio == 6) ? 3 : -1;
+
+  if ((slot >= 0) && (input_channels >= 1) && (input_channels <= 2) &&
+      (output_channels >= 1) && (output_channels <= 2))
+  {
+    kernel = resample_kernels[direction][slot][input_channels - 1][output_channels - 1];
+  }
+
+  return kernel;
+}
+
+/* channels is the codec side count, device_channels the sound card one */
+int32 resample_create (int32 direction, uint32 ratio, uint8 channels, uint8 device_channels,
+                       uint32 block, void **handle)
+{
+  int status = -1;
+  resample_t *resample = calloc (1, sizeof (resample_t));
+
+  if ((resample != NULL) && (ratio > 0) && (channels > 0) && (channels <= 2))
+  {
+    unsigned char channel;
+
+    resample->direction = direction;
+    resample->ratio     = ratio;
+    resample->channels  = channels;
+    resample->block     = block;
+    resample->taps      = (direction == RESAMPLE_DECIMATE)
+                          ? (ratio * RESAMPLE_TAPS_PER_PHASE) : RESAMPLE_TAPS_PER_PHASE;
+    resample->phase     = 0;
+
+    /* Pick the specialized kernel once, process falls back to the generic loop */
+    resample->input_channels  = (direction == RESAMPLE_DECIMATE) ? device_channels : channels;
+    resample->output_channels = (direction == RESAMPLE_DECIMATE) ? channels : device_channels;
+    resample->kernel          = resample_select (direction, ratio, resample->input_channels,
+                                                 resample->output_channels);
+
+    /* Filter memory followed by one block of new input */
+    resample->history_size = resample->taps - 1;
+    resample->coef = calloc (ratio * RESAMPLE_TAPS_PER_PHASE, sizeof (short int));
+    status = (resample->coef != NULL) ? 1 : -1;
+
+    for (channel = 0; ((status > 0) && (channel < channels)); channel++)
+    {
+      resample->history[channel]
+        = calloc (resample->history_size + block, sizeof (short int));
+      if (resample->history[channel] == NULL)
+      {
+        status = -1;
+      }
+    }
+
+    if ((status > 0) && (ratio > 1))
+    {
+      resample_design (resample);
+    }
+  }
+
+  if (status > 0)
+  {
+    *handle = resample;
+  }
+  else
+  {
+    printf ("Unable to create resampler, ratio %u\n", ratio);
+    resample_destroy (resample);
+  }
+
+  return status;
+}
+
+int32 resample_destroy (void *handle)
+{
+  resample_t *resample = handle;
+
+  if (resample != NULL)
+  {
+    free (resample->coef);
+    free (resample->history[0]);
+    free (resample->history[1]);
+    free (resample);
+  }
+
+  return 1;
+}
+
+uint32 resample_delay (void *handle)
+{
+  resample_t *resample = handle;
+  unsigned int delay = 0;
+
+  /* Linear phase group delay, in high rate frames */
+  if ((resample != NULL) && (resample->ratio > 1))
+  {
+    delay = (resample->direction == RESAMPLE_DECIMATE)
+            ? ((resample->taps - 1)/2) : (((resample->taps - 1) * resample->ratio)/2);
+  }
+
+  return delay;
+}
+
+int32 resample_process (void *handle, int16 *input, uint32 frames, uint8 input_channels,
+                        int16 *output, uint8 output_channels)
+{
+  resample_t *resample = handle;
+  unsigned int written = 0;
+
+  while (frames > 0)
+  {
+    unsigned int block = (frames > resample->block) ? resample->block : frames;
+    unsigned char channel;
+
+    if ((resample->kernel != NULL) &&
+        (input_channels == resample->input_channels) &&
+        (output_channels == resample->output_channels))
+    {
+      written += resample->kernel (resample, input, block, &(output[written * output_channels]));
+    }
+    else
+    {
+      written += resample_generic (resample, input, block, &(output[written * output_channels]),
+                                   input_channels, output_channels);
+    }
+
+    /* Keep the newest samples as filter memory */
+    for (channel = 0; ((resample->ratio > 1) && (channel < resample->channels)); channel++)
+    {
+      memmove (resample->history[channel], &(resample->history[channel][block]),
+               resample->history_size * sizeof (short int));
+    }
+
+    input  += block * input_channels;
+    frames -= block;
+  }
+
+  return written;
+}
+
+#ifdef UTIL_RESAMPLE_TEST
+
+#include <time.h>
+
+#define RESAMPLE_TEST_BLOCK   (960)
+#define RESAMPLE_TEST_BLOCKS  (500)
+
+/* Tone frequencies as a fraction of the low rate: within the pass band, and
+ * its mirror at the high rate is past the transition band */
+#define RESAMPLE_TEST_PASS      (0.25)
+
+/* Pass band ripple and stop band attenuation (Blackman window) in dB */
+#define RESAMPLE_TEST_RIPPLE    (0.1)
+#define RESAMPLE_TEST_STOPBAND  (70.0)
+
+static double elapsed (struct timespec *start, struct timespec *stop)
+{
+  return ((stop->tv_sec - start->tv_sec) * 1e3) + ((stop->tv_nsec - start->tv_nsec) * 1e-6);
+}
+
+/* Same input through the specialized and the generic path, outputs must
+ * match bit for bit; returns the number of mismatches */
+static int bench (int direction, unsigned int ratio, unsigned char channels,
+                  unsigned char device_channels)
+{
+  static short int input[RESAMPLE_TEST_BLOCK * 6 * 2];
+  static short int output[2][RESAMPLE_TEST_BLOCK * 6 * 2];
+  unsigned int frames = (direction == RESAMPLE_DECIMATE) ? (RESAMPLE_TEST_BLOCK * ratio)
+                                                         : RESAMPLE_TEST_BLOCK;
+  unsigned char input_channels = (direction == RESAMPLE_DECIMATE) ? device_channels : channels;
+  unsigned char output_channels = (direction == RESAMPLE_DECIMATE) ? channels : device_channels;
+  void *handle[2] = {NULL, NULL};
+  double time[2];
+  unsigned int written[2];
+  int failures = 0;
+  int path;
+  int count;
+
+  for (path = 0; path < 2; path++)
+  {
+    struct timespec start, stop;
+
+    resample_create (direction, ratio, channels, device_channels, frames, &(handle[path]));
+
+    /* Second instance is forced onto the generic loop */
+    if (path == 1)
+    {
+      ((resample_t *)handle[path])->kernel = NULL;
+    }
+
+    srand (1);
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (count = 0; count < RESAMPLE_TEST_BLOCKS; count++)
+    {
+      unsigned int index;
+
+      /* Fresh input every few blocks keeps both paths honest without
+       * timing the generator */
+      if ((count % 50) == 0)
+      {
+        for (index = 0; index < (frames * input_channels); index++)
+        {
+          input[index] = (short int)((rand () % 65536) - 32768);
+        }
+      }
+
+      written[path] = resample_process (handle[path], input, frames, input_channels,
+                                        output[path], output_channels);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &stop);
+    time[path] = elapsed (&start, &stop);
+  }
+
+  failures += (written[0] != written[1]);
+  failures += ((memcmp (output[0], output[1],
+                        written[0] * output_channels * sizeof (short int))) != 0);
+
+  printf ("%s x%u %u->%u ch: specialized %6.1f ms, generic %6.1f ms, %.2fx %s\n",
+          (direction == RESAMPLE_DECIMATE) ? "Decimate   " : "Interpolate", ratio,
+          input_channels, output_channels, time[0], time[1], time[1]/time[0],
+          failures ? "MISMATCH" : "OK");
+
+  resample_destroy (handle[0]);
+  resample_destroy (handle[1]);
+
+  return failures;
+}
+
+/* Level of one tone in a signal, Hann windowed so the other tones present
+ * don't leak into it; frequency in cycles per sample */
+static double level (const short int *signal, unsigned int frames, double frequency)
+{
+  double real = 0.0;
+  double imaginary = 0.0;
+  double window = 0.0;
+  unsigned int count;
+
+  for (count = 0; count < frames; count++)
+  {
+    double hann = 0.5 - (0.5 * cos ((2.0 * M_PI * count)/frames));
+
+    real      += hann * signal[count] * cos (2.0 * M_PI * frequency * count);
+    imaginary += hann * signal[count] * sin (2.0 * M_PI * frequency * count);
+    window    += hann;
+  }
+
+  return (2.0 * sqrt ((real * real) + (imaginary * imaginary)))/window;
+}
+
+/* Mono tone through the filter, returns its gain at the output in dB: at
+ * the tone itself for the pass band, at its alias (decimation) or its
+ * strongest image (interpolation) for the stop band */
+static double response (int direction, unsigned int ratio, double frequency, int stopband)
+{
+  static short int input[RESAMPLE_TEST_BLOCK * 6 * 8];
+  static short int output[RESAMPLE_TEST_BLOCK * 6 * 8];
+  unsigned int frames = (direction == RESAMPLE_DECIMATE) ? (RESAMPLE_TEST_BLOCK * ratio * 8)
+                                                         : (RESAMPLE_TEST_BLOCK * 8);
+  void *handle = NULL;
+  unsigned int written;
+  unsigned int skip;
+  unsigned int count;
+  double gain = -1000.0;
+
+  resample_create (direction, ratio, 1, 1, RESAMPLE_TEST_BLOCK, &handle);
+
+  for (count = 0; count < frames; count++)
+  {
+    input[count] = (short int)lrint (16384.0 * sin (2.0 * M_PI * frequency * count));
+  }
+
+  written = resample_process (handle, input, frames, 1, output, 1);
+
+  /* Leave out the filter's fill up */
+  skip = (direction == RESAMPLE_DECIMATE) ? (RESAMPLE_TEST_BLOCK/2)
+                                          : (RESAMPLE_TEST_BLOCK * ratio/2);
+
+  if (direction == RESAMPLE_DECIMATE)
+  {
+    double alias = (frequency * ratio) - floor ((frequency * ratio) + 0.5);
+
+    gain = level (&(output[skip]), written - skip, fabs (alias));
+  }
+  else if (!stopband)
+  {
+    gain = level (&(output[skip]), written - skip, frequency/ratio);
+  }
+  else
+  {
+    unsigned int image;
+
+    for (image = 1; image < ratio; image++)
+    {
+      double above = (image + frequency)/ratio;
+      double below = (image - frequency)/ratio;
+      double value;
+
+      above = (above > 0.5) ? (1.0 - above) : above;
+      below = (below > 0.5) ? (1.0 - below) : below;
+
+      value = level (&(output[skip]), written - skip, above);
+      gain  = (value > gain) ? value : gain;
+      value = level (&(output[skip]), written - skip, below);
+      gain  = (value > gain) ? value : gain;
+    }
+  }
+
+  resample_destroy (handle);
+
+  /* -inf when it is all below one LSB */
+  return 20.0 * log10 (gain/16384.0);
+}
+
+/* Pass band tone at unity gain, a tone beyond the transition band down by the
+ * stop band attenuation; frequencies as fractions of the low rate */
+static int filter (int direction, unsigned int ratio)
+{
+  double passband = response (direction, ratio, (direction == RESAMPLE_DECIMATE)
+                              ? (RESAMPLE_TEST_PASS/ratio) : RESAMPLE_TEST_PASS, 0);
+  double stopband = -INFINITY;
+  int failures = (fabs (passband) > RESAMPLE_TEST_RIPPLE);
+
+  /* Ratio 1 maps channels only, nothing to stop (reported as -inf) */
+  if (ratio > 1)
+  {
+    stopband  = (direction == RESAMPLE_DECIMATE)
+                ? response (direction, ratio, (1.0 - RESAMPLE_TEST_PASS)/ratio, 1)
+                : response (direction, ratio, RESAMPLE_TEST_PASS, 1);
+    failures += (stopband > -RESAMPLE_TEST_STOPBAND);
+  }
+
+  printf ("%s x%u response: pass band %+.3f dB, stop band %.1f dB %s\n",
+          (direction == RESAMPLE_DECIMATE) ? "Decimate   " : "Interpolate", ratio,
+          passband, stopband, failures ? "FAIL" : "OK");
+
+  return failures;
+}
+
+int main (void)
+{
+  static const unsigned int ratio[] = {1, 2, 3, 6};
+  int failures = 0;
+  unsigned int count;
+
+  pcm_init ();
+  printf ("PCM kernels: %s\n", pcm_path ());
+
+  for (count = 0; count < (sizeof (ratio)/sizeof (ratio[0])); count++)
+  {
+    failures += bench (RESAMPLE_DECIMATE, ratio[count], 1, 2);
+    failures += bench (RESAMPLE_DECIMATE, ratio[count], 1, 1);
+    failures += bench (RESAMPLE_INTERPOLATE, ratio[count], 1, 2);
+    failures += bench (RESAMPLE_INTERPOLATE, ratio[count], 2, 2);
+  }
+
+  for (count = 0; count < (sizeof (ratio)/sizeof (ratio[0])); count++)
+  {
+    failures += filter (RESAMPLE_DECIMATE, ratio[count]);
+    failures += filter (RESAMPLE_INTERPOLATE, ratio[count]);
+  }
+
+  printf ("Resample: %s\n", failures ? "FAIL" : "OK");
+
+  return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,296 @@
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Local/project headers */
+#include "types.h"
+#include "util.h"
+
+/* Producer and consumer state live on separate cache lines */
+#define RING_CACHE_LINE  (64)
+#define CACHE_ALIGNED    __attribute__((aligned(RING_CACHE_LINE)))
+
+/* Local structures */
+typedef struct
+{
+  /* Written by the producer only */
+  unsigned int   head CACHE_ALIGNED;
+  unsigned int   tail_cache;
+
+  /* Written by the consumer only */
+  unsigned int   tail CACHE_ALIGNED;
+  unsigned int   head_cache;
+
+  /* Read-only after creation */
+  unsigned int   mask CACHE_ALIGNED;
+  unsigned int   element_size;
+  unsigned char *data;
+} ring_t;
+
+
+int32 ring_create (uint32 element_size, uint32 elements, void **handle)
+{
+  int status = -1;
+  unsigned int capacity = 1;
+  ring_t *ring = NULL;
+
+  /* Round up to a power of two so indices wrap with a mask */
+  while (capacity < elements)
+  {
+    capacity <<= 1;
+  }
+
+  if ((element_size > 0) && (elements > 0) &&
+      ((posix_memalign ((void **)&ring, RING_CACHE_LINE, sizeof (ring_t))) == 0))
+  {
+    memset (ring, 0, sizeof (ring_t));
+    ring->mask         = capacity - 1;
+    ring->element_size = element_size;
+
+    if ((posix_memalign ((void **)&(ring->data), RING_CACHE_LINE,
+                         capacity * element_size)) == 0)
+    {
+      *handle = ring;
+      status  = 1;
+    }
+    else
+    {
+      free (ring);
+    }
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to create ring of %u elements\n", elements);
+  }
+
+  return status;
+}
+
+int32 ring_destroy (void *handle)
+{
+  ring_t *ring = handle;
+
+  if (ring != NULL)
+  {
+    free (ring->data);
+    free (ring);
+  }
+
+  return 1;
+}
+
+void ring_reset (void *handle)
+{
+  ring_t *ring = handle;
+
+  /* Only safe while neither side is running */
+  ring->head       = 0;
+  ring->tail_cache = 0;
+  ring->tail       = 0;
+  ring->head_cache = 0;
+}
+
+uint32 ring_count (void *handle)
+{
+  ring_t *ring = handle;
+
+  return (__atomic_load_n (&(ring->head), __ATOMIC_ACQUIRE))
+         - (__atomic_load_n (&(ring->tail), __ATOMIC_ACQUIRE));
+}
+
+uint32 ring_space (void *handle)
+{
+  ring_t *ring = handle;
+
+  return (ring->mask + 1) - (ring_count (handle));
+}
+
+/* Producer side, copies as many elements as fit and returns that count */
+uint32 ring_write (void *handle, void *elements, uint32 count)
+{
+  ring_t *ring = handle;
+  unsigned int head = ring->head;
+  unsigned int space = (ring->mask + 1) - (head - ring->tail_cache);
+
+  /* Only touch the consumer's cache line when the cached view is short */
+  if (space < count)
+  {
+    ring->tail_cache = __atomic_load_n (&(ring->tail), __ATOMIC_ACQUIRE);
+    space = (ring->mask + 1) - (head - ring->tail_cache);
+  }
+
+  count = (count < space) ? count : space;
+
+  if (count > 0)
+  {
+    unsigned int offset = head & ring->mask;
+    unsigned int first = ((ring->mask + 1) - offset);
+
+    first = (count < first) ? count : first;
+    memcpy (&(ring->data[offset * ring->element_size]), elements,
+            first * ring->element_size);
+    memcpy (ring->data, ((unsigned char *)elements) + (first * ring->element_size),
+            (count - first) * ring->element_size);
+
+    __atomic_store_n (&(ring->head), head + count, __ATOMIC_RELEASE);
+  }
+
+  return count;
+}
+
+/* Consumer side, copies out (or drops if elements is NULL) up to count elements */
+uint32 ring_read (void *handle, void *elements, uint32 count)
+{
+  ring_t *ring = handle;
+  unsigned int tail = ring->tail;
+  unsigned int available = ring->head_cache - tail;
+
+  if (available < count)
+  {
+    ring->head_cache = __atomic_load_n (&(ring->head), __ATOMIC_ACQUIRE);
+    available = ring->head_cache - tail;
+  }
+
+  count = (count < available) ? count : available;
+
+  if (count > 0)
+  {
+    unsigned int offset = tail & ring->mask;
+    unsigned int first = ((ring->mask + 1) - offset);
+
+    if (elements != NULL)
+    {
+      first = (count < first) ? count : first;
+      memcpy (elements, &(ring->data[offset * ring->element_size]),
+              first * ring->element_size);
+      memcpy (((unsigned char *)elements) + (first * ring->element_size), ring->data,
+              (count - first) * ring->element_size);
+    }
+
+    __atomic_store_n (&(ring->tail), tail + count, __ATOMIC_RELEASE);
+  }
+
+  return count;
+}
+
+#ifdef UTIL_RING_TEST
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define RING_TEST_ELEMENTS  (1000000)
+
+static void * producer (void *handle)
+{
+  unsigned int value = 0;
+
+  while (value < RING_TEST_ELEMENTS)
+  {
+    unsigned int block[7];
+    unsigned int count;
+
+    for (count = 0; count < 7; count++)
+    {
+      block[count] = value + count;
+    }
+
+    count = (RING_TEST_ELEMENTS - value) < 7 ? (RING_TEST_ELEMENTS - value) : 7;
+    if ((count = ring_write (handle, block, count)) == 0)
+    {
+      sched_yield ();
+    }
+    value += count;
+  }
+
+  return NULL;
+}
+
+static double bench (unsigned int element_size, unsigned int block, unsigned int total)
+{
+  void *ring = NULL;
+  unsigned char *buffer = calloc (block, element_size);
+  unsigned int written = 0;
+  unsigned int read = 0;
+  struct timespec start, stop;
+
+  ring_create (element_size, 4 * block, &ring);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  while (read < total)
+  {
+    written += ring_write (ring, buffer, block);
+    read    += ring_read (ring, buffer, block);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &stop);
+  ring_destroy (ring);
+  free (buffer);
+
+  return ((double)total * element_size)
+         / (((stop.tv_sec - start.tv_sec) + ((stop.tv_nsec - start.tv_nsec) * 1e-9)) * 1e6);
+}
+
+int main (void)
+{
+  void *ring = NULL;
+  unsigned int elements[16];
+  unsigned int count;
+  unsigned int expected = 0;
+  int failures = 0;
+  pthread_t thread;
+
+  /* Capacity rounds up, wrap around keeps order */
+  ring_create (sizeof (unsigned int), 5, &ring);
+  for (count = 0; count < 16; count++)
+  {
+    elements[count] = count;
+  }
+  failures += ((ring_write (ring, elements, 16)) != 8);
+  failures += ((ring_space (ring)) != 0);
+  failures += ((ring_read (ring, elements, 6)) != 6);
+  failures += ((ring_write (ring, &(elements[8]), 4)) != 4);
+  failures += ((ring_count (ring)) != 6);
+  failures += ((ring_read (ring, elements, 16)) != 6);
+  failures += ((elements[0] != 6) || (elements[1] != 7) || (elements[2] != 8) ||
+               (elements[5] != 11));
+  failures += ((ring_read (ring, elements, 1)) != 0);
+  ring_destroy (ring);
+  printf ("Ring basic: %s\n", failures ? "FAIL" : "OK");
+
+  /* Producer/consumer on separate threads must see an unbroken sequence */
+  ring_create (sizeof (unsigned int), 64, &ring);
+  pthread_create (&thread, NULL, producer, ring);
+  while (expected < RING_TEST_ELEMENTS)
+  {
+    unsigned int read = ring_read (ring, elements, 16);
+
+    if (read == 0)
+    {
+      sched_yield ();
+    }
+
+    for (count = 0; count < read; count++)
+    {
+      if (elements[count] != expected)
+      {
+        failures++;
+      }
+      expected++;
+    }
+  }
+  pthread_join (thread, NULL);
+  ring_destroy (ring);
+  printf ("Ring threaded: %s\n", failures ? "FAIL" : "OK");
+
+  /* Single thread throughput, PCM frame and byte sized elements */
+  printf ("Ring throughput: 960 x 2 bytes %.0f MB/s, 64 x 1 byte %.0f MB/s\n",
+          bench (sizeof (short int), 960, 10000000), bench (1, 64, 10000000));
+
+  return failures ? 1 : 0;
+}
+
+#endif
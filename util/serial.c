@@ -5,11 +5,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
-#include <termios.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 
+/* termios2 for arbitrary rates, glibc's termios.h has no BOTHER and clashes with these */
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
 /* Local/project headers */
 #include "types.h"
 #include "util.h"
@@ -18,8 +23,44 @@
 /* Verbose serial output */
 /* #define DEBUG_VERBOSE  (1) */
 
-/* Defines, 10 ms */
-#define SERIAL_TIMEOUT  (1)
+/* Default line rate in bits per second, 8N1 framing */
+#define SERIAL_BAUD_RATE      (115200)
+#define SERIAL_BITS_PER_BYTE  (10)
+
+/* Link frame, big endian fields:
+ * sync word (2), payload length (2), sequence (2), timestamp (4), header CRC (2),
+ * payload, payload CRC (2). The header has its own CRC so a corrupted length
+ * is caught before waiting for that many bytes. The top bits of the length
+ * mark probe frames, the far end sends those back with the echo bit set */
+#define SERIAL_SYNC_0         (0xEB)
+#define SERIAL_SYNC_1         (0x90)
+#define SERIAL_HEADER_SIZE    (12)
+#define SERIAL_CRC_SIZE       (2)
+#define SERIAL_MAX_FRAME      (SERIAL_MAX_PAYLOAD + SERIAL_FRAME_OVERHEAD)
+#define SERIAL_LENGTH_MASK    (0x3FFF)
+#define SERIAL_FLAG_PROBE     (0x8000)
+#define SERIAL_FLAG_ECHO      (0x4000)
+
+/* Probe: short frames timed one at a time, how long to wait for each (and for
+ * the last echo of the burst) in millisec., and the payload of the burst frames */
+#define SERIAL_PROBE_PINGS    (8)
+#define SERIAL_PROBE_TIMEOUT  (500)
+#define SERIAL_PROBE_NONCE    (4)
+#define SERIAL_PROBE_PAYLOAD  (250)
+
+/* Reader thread ring, a few frames of slack for a busy consumer */
+#define SERIAL_RING_SIZE      (4 * SERIAL_MAX_FRAME)
+
+/* Reader poll timeout in millisec., bounds how long a stop takes */
+#define SERIAL_POLL_TIMEOUT   (100)
+
+/* Frames the writer holds, a power of two, and the line time in millisec.
+ * it lets sit in the driver's queue */
+#define SERIAL_TX_SLOTS       (8)
+#define SERIAL_TX_DEPTH       (10)
+
+/* Drain shortfall in millisec. of line time put down to clock resolution, not flow control */
+#define SERIAL_CLOCK_SLACK    (2)
 
 /* Local structures */
 typedef struct
@@ -27,37 +68,366 @@ typedef struct
   char       *vendor_id;
   char       *product_id;
   int         file_desc;
+  uint32      baud_rate;
+  int32       low_latency;
+  uint32      line_rate;
   usb_info_t  usb_info;
 } serial_device_t;
 
+typedef struct
+{
+  int32   queued;
+  uint32  bytes;
+  uint8   data[SERIAL_MAX_FRAME];
+} serial_tx_slot_t;
+
+/* Our probe frames that came back, the nonce tells them from the far end's */
+typedef struct
+{
+  uint32  nonce;
+  uint32  returned;
+  uint32  bytes;
+  uint32  rtt_total;
+  uint32  rtt_min;
+  uint32  rtt_max;
+  int32   first;
+  int32   last;
+} serial_probing_t;
+
+typedef struct
+{
+  /* Received bytes not parsed into a frame yet */
+  uint8           rx[2 * SERIAL_MAX_FRAME];
+  uint32          rx_count;
+  serial_tx_slot_t tx;
+  int32           synced;
+  uint16          last_sequence;
+  int32           arrival;
+  serial_stats_t  stats;
+  serial_probing_t probing;
+
+  /* Reader thread, drains the port into the ring whatever the radio does */
+  void           *ring;
+  void           *reader;
+  int32           notifier;
+  int32           running;
+  int32           rx_time;
+
+  /* Writer thread, takes frames from serial_send and paces them out */
+  void           *tx_ring;
+  void           *echo_ring;
+  serial_tx_slot_t echo;
+  void           *tx_sync;
+  void           *writer;
+  int32           writing;
+  serial_tx_slot_t pending[SERIAL_TX_SLOTS];
+  uint32          pending_head;
+  uint32          pending_count;
+  uint32          pending_offset;
+  uint32          tx_delay_total;
+} serial_link_t;
+
 /* File scope global variables */
+static char serial_default_node[] = "/dev/ttyS0";
+
 static serial_device_t serial_device =
 {
   .vendor_id   = "2458",
   .product_id  = "0001",
   .file_desc   = -1,
+  .baud_rate   = SERIAL_BAUD_RATE,
+  .low_latency = 1,
+  .line_rate   = SERIAL_BAUD_RATE,
   .usb_info =
     {
       .dev_node           = NULL,
       .dev_sys_path       = NULL,
-      .dev_subsystem_node = "/dev/ttyS0",
+      .dev_subsystem_node = serial_default_node,
       .bus_num            = 255,
       .dev_num            = 255,
       .next               = NULL,
     }
 }; 
 
+static serial_link_t serial_link =
+{
+  .rx_count      = 0,
+  .synced        = 0,
+  .last_sequence = 0,
+  .arrival       = 0,
+  .ring          = NULL,
+  .reader        = NULL,
+  .notifier      = -1,
+  .running       = 0,
+  .rx_time       = 0,
+  .tx_ring       = NULL,
+  .echo_ring     = NULL,
+  .tx_sync       = NULL,
+  .writer        = NULL,
+  .writing       = 0
+};
+
+/* CRC-16/CCITT (poly 0x1021, init 0xFFFF), a nibble at a time */
+static const uint16 serial_crc_table[16] =
+{
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+
+static uint16 serial_crc (uint8 *data, uint32 bytes)
+{
+  uint16 crc = 0xFFFF;
+
+  while (bytes > 0)
+  {
+    crc = (crc << 4) ^ serial_crc_table[(crc >> 12) ^ (*data >> 4)];
+    crc = (crc << 4) ^ serial_crc_table[(crc >> 12) ^ (*data & 0x0F)];
+    data++;
+    bytes--;
+  }
+
+  return crc;
+}
+
+/* Drops parsed or garbage bytes from the front of the receive buffer */
+static void serial_consume (uint32 bytes)
+{
+  serial_link.rx_count -= bytes;
+  memmove (serial_link.rx, &(serial_link.rx[bytes]), serial_link.rx_count);
+}
+
+/* Lays out a link frame around the payload in the slot */
+static void serial_frame (serial_tx_slot_t *slot, uint16 flags, uint16 sequence,
+                          uint32 timestamp, uint8 *payload, uint32 bytes)
+{
+  uint8 *tx = slot->data;
+  uint16 crc;
+
+  tx[0]  = SERIAL_SYNC_0;
+  tx[1]  = SERIAL_SYNC_1;
+  tx[2]  = (flags | bytes) >> 8;
+  tx[3]  = bytes;
+  tx[4]  = sequence >> 8;
+  tx[5]  = sequence;
+  tx[6]  = timestamp >> 24;
+  tx[7]  = timestamp >> 16;
+  tx[8]  = timestamp >> 8;
+  tx[9]  = timestamp;
+  crc    = serial_crc (&(tx[2]), SERIAL_HEADER_SIZE - 4);
+  tx[10] = crc >> 8;
+  tx[11] = crc;
+
+  memcpy (&(tx[SERIAL_HEADER_SIZE]), payload, bytes);
+  crc = serial_crc (payload, bytes);
+  tx[SERIAL_HEADER_SIZE + bytes]     = crc >> 8;
+  tx[SERIAL_HEADER_SIZE + bytes + 1] = crc;
+
+  slot->bytes  = bytes + SERIAL_FRAME_OVERHEAD;
+  slot->queued = clock_get_count ();
+}
+
+/* A probe frame at the front of the receive buffer: ours coming back (echoed, or
+ * looped back by a jumper) is timed, the far end's goes back through the writer.
+ * Before the reader and writer start (both ends probing at start up) the port is
+ * the caller's, and the far end's probes are answered right away */
+static void serial_reply (uint16 flags, uint32 length)
+{
+  uint8 *rx = serial_link.rx;
+  uint16 sequence = (rx[4] << 8) | rx[5];
+  uint32 timestamp = ((uint32)rx[6] << 24) | (rx[7] << 16) | (rx[8] << 8) | rx[9];
+  uint32 nonce = 0;
+
+  if (length >= SERIAL_PROBE_NONCE)
+  {
+    nonce = ((uint32)rx[12] << 24) | (rx[13] << 16) | (rx[14] << 8) | rx[15];
+  }
+
+  if ((serial_link.probing.nonce != 0) && (nonce == serial_link.probing.nonce))
+  {
+    serial_probing_t *probing = &(serial_link.probing);
+    uint32 rtt = serial_link.arrival - (int32)timestamp;
+
+    /* Throughput counts what came in after the first, over the time since it did */
+    if (probing->returned == 0)
+    {
+      probing->first = serial_link.arrival;
+    }
+    else
+    {
+      probing->bytes += length + SERIAL_FRAME_OVERHEAD;
+    }
+
+    probing->last       = serial_link.arrival;
+    probing->rtt_total += rtt;
+    probing->rtt_min    = (rtt < probing->rtt_min) ? rtt : probing->rtt_min;
+    probing->rtt_max    = (rtt > probing->rtt_max) ? rtt : probing->rtt_max;
+    probing->returned++;
+  }
+  else if (!(flags & SERIAL_FLAG_ECHO))
+  {
+    serial_frame (&(serial_link.echo), (SERIAL_FLAG_PROBE | SERIAL_FLAG_ECHO), sequence,
+                  timestamp, &(rx[SERIAL_HEADER_SIZE]), length);
+
+    if (serial_link.writer != NULL)
+    {
+      if ((ring_write (serial_link.echo_ring, &(serial_link.echo), 1)) == 1)
+      {
+        os_post_sem (serial_link.tx_sync);
+      }
+    }
+    else if (serial_link.reader == NULL)
+    {
+      serial_tx (serial_link.echo.bytes, serial_link.echo.data);
+    }
+  }
+}
+
+/* Streaming parser over the buffered bytes, returns 1 with a frame, 0 when it needs
+ * more. A bad header or CRC costs one byte, the hunt goes on from the next one, so
+ * a frame that started inside a corrupted one is still found */
+static int32 serial_parse (serial_frame_t *frame)
+{
+  uint8 *rx = serial_link.rx;
+  int32 status = -1;
+
+  while (status < 0)
+  {
+    uint32 start = 0;
+    uint32 length;
+
+    /* Hunt for the sync word, a trailing first byte may be half of it */
+    while (((start + 1) < serial_link.rx_count) &&
+           ((rx[start] != SERIAL_SYNC_0) || (rx[start + 1] != SERIAL_SYNC_1)))
+    {
+      start++;
+    }
+
+    if (((start + 1) == serial_link.rx_count) && (rx[start] != SERIAL_SYNC_0))
+    {
+      start++;
+    }
+
+    serial_link.stats.skipped += start;
+    serial_consume (start);
+    length = ((rx[2] << 8) | rx[3]) & SERIAL_LENGTH_MASK;
+
+    if (serial_link.rx_count < SERIAL_HEADER_SIZE)
+    {
+      status = 0;
+    }
+    else if ((length > SERIAL_MAX_PAYLOAD) ||
+             ((serial_crc (&(rx[2]), SERIAL_HEADER_SIZE - 4)) != ((rx[10] << 8) | rx[11])))
+    {
+      serial_link.stats.header_errors++;
+      serial_link.stats.skipped++;
+      serial_consume (1);
+    }
+    else if (serial_link.rx_count < (SERIAL_HEADER_SIZE + length + SERIAL_CRC_SIZE))
+    {
+      status = 0;
+    }
+    else if ((serial_crc (&(rx[SERIAL_HEADER_SIZE]), length))
+             != ((rx[SERIAL_HEADER_SIZE + length] << 8) | rx[SERIAL_HEADER_SIZE + length + 1]))
+    {
+      serial_link.stats.crc_errors++;
+      serial_link.stats.skipped++;
+      serial_consume (1);
+    }
+    else if (rx[2] & (SERIAL_FLAG_PROBE >> 8))
+    {
+      /* Link probing, not for the caller and outside the sequence */
+      serial_reply ((rx[2] << 8), length);
+      serial_consume (SERIAL_HEADER_SIZE + length + SERIAL_CRC_SIZE);
+    }
+    else
+    {
+      frame->sequence  = (rx[4] << 8) | rx[5];
+      frame->timestamp = ((uint32)rx[6] << 24) | (rx[7] << 16) | (rx[8] << 8) | rx[9];
+      frame->bytes     = length;
+      frame->arrival   = serial_link.arrival;
+      memcpy (frame->payload, &(rx[SERIAL_HEADER_SIZE]), length);
+      serial_consume (SERIAL_HEADER_SIZE + length + SERIAL_CRC_SIZE);
+
+      /* Gaps in the sequence are frames the link lost, a step back is a new stream */
+      if ((serial_link.synced) && ((int16)(frame->sequence - serial_link.last_sequence) > 1))
+      {
+        serial_link.stats.lost += (uint16)(frame->sequence - serial_link.last_sequence) - 1;
+      }
+
+      serial_link.synced        = 1;
+      serial_link.last_sequence = frame->sequence;
+      serial_link.stats.frames++;
+      status = 1;
+    }
+  }
+
+  return status;
+}
 
 void serial_free (void)
 {
   free (serial_device.usb_info.dev_node);
   serial_device.usb_info.dev_node = NULL;
-  free (serial_device.usb_info.dev_subsystem_node);
+  if (serial_device.usb_info.dev_subsystem_node != serial_default_node)
+  {
+    free (serial_device.usb_info.dev_subsystem_node);
+  }
   serial_device.usb_info.dev_subsystem_node = NULL;
   serial_device.usb_info.bus_num = 255;
   serial_device.usb_info.dev_num = 255;
 }
 
+/* Takes effect on the next serial_open */
+int32 serial_option (int32 option, int32 value)
+{
+  int32 status = -1;
+
+  if ((option == SERIAL_OPTION_BAUD) && (value > 0))
+  {
+    serial_device.baud_rate = value;
+    serial_device.line_rate = value;
+    status = 1;
+  }
+  else if (option == SERIAL_OPTION_LOW_LATENCY)
+  {
+    serial_device.low_latency = value;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set serial option %d\n", option);
+  }
+
+  return status;
+}
+
+/* Port serial_open uses in place of the default or what serial_init finds,
+ * a pty of the link simulator say */
+int32 serial_set_device (char *device)
+{
+  char *node = NULL;
+  int32 status = -1;
+
+  if ((serial_device.file_desc < 0) && ((asprintf (&node, "%s", device)) > 0))
+  {
+    /* Only an earlier call's node is ours to free */
+    if (serial_device.usb_info.dev_subsystem_node != serial_default_node)
+    {
+      free (serial_device.usb_info.dev_subsystem_node);
+    }
+
+    serial_device.usb_info.dev_subsystem_node = node;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set serial device %s\n", device);
+  }
+
+  return status;
+}
+
 int32 serial_init (void)
 {
   usb_info_t *usb_list = NULL;
@@ -154,20 +524,23 @@ void serial_deinit (void)
 int32 serial_open (void)
 {
   serial_device.file_desc = open (serial_device.usb_info.dev_subsystem_node,
-                                  (O_RDWR | O_NOCTTY /*| O_NDELAY*/));
+                                  (O_RDWR | O_NOCTTY | O_NONBLOCK));
   if (serial_device.file_desc > 0)
   {
     if ((lockf (serial_device.file_desc, F_TLOCK, 0)) == 0)
     {
-      struct termios options;
+      struct termios2 options;
+      struct serial_struct serial_info;
       int tiocm;
 
       /* Get current serial port options */
-      tcgetattr (serial_device.file_desc, &options);
+      ioctl (serial_device.file_desc, TCGETS2, &options);
 
-      /* Set read/write baud rate */
-      cfsetispeed (&options, B115200);
-      cfsetospeed (&options, B115200);
+      /* Any read/write baud rate, the driver picks its nearest divisor */
+      options.c_cflag &= ~CBAUD;
+      options.c_cflag |= BOTHER;
+      options.c_ispeed = serial_device.baud_rate;
+      options.c_ospeed = serial_device.baud_rate;
 
       /* Set parameters including enabling receiver */
       options.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS /*| HUPCL*/);
@@ -176,12 +549,45 @@ int32 serial_open (void)
       options.c_iflag &= ~(INPCK | IXON | IXOFF | IXANY | ICRNL);
       options.c_oflag &= ~(OPOST | ONLCR);
 
-      /* Timeout is in tenths of seconds */
-      options.c_cc[VTIME] = (SERIAL_TIMEOUT * 10)/1000;
+      /* Reads return whatever is there at once, the reader waits in poll instead */
+      options.c_cc[VTIME] = 0;
       options.c_cc[VMIN]  = 0;
 
-      /* Flush buffers and apply options */
-      tcsetattr (serial_device.file_desc, TCSAFLUSH, &options);
+      /* Flush buffers and apply options, then see what rate the driver settled on */
+      if (((ioctl (serial_device.file_desc, TCSETSF2, &options)) < 0) ||
+          ((ioctl (serial_device.file_desc, TCGETS2, &options)) < 0) ||
+          (options.c_ospeed == 0))
+      {
+        printf ("Can't set %u baud on %s\n", serial_device.baud_rate,
+                serial_device.usb_info.dev_subsystem_node);
+        close (serial_device.file_desc);
+        serial_device.file_desc = -1;
+
+        return serial_device.file_desc;
+      }
+
+      serial_device.line_rate = options.c_ospeed;
+
+      /* No receive batching in the driver (a 1 ms latency timer on FTDI), not all have it */
+      if (serial_device.low_latency)
+      {
+        int result = ioctl (serial_device.file_desc, TIOCGSERIAL, &serial_info);
+
+        if (result == 0)
+        {
+          serial_info.flags |= ASYNC_LOW_LATENCY;
+          result = ioctl (serial_device.file_desc, TIOCSSERIAL, &serial_info);
+        }
+
+        if (result < 0)
+        {
+          printf ("No low latency mode on %s\n", serial_device.usb_info.dev_subsystem_node);
+        }
+      }
+
+      serial_link.rx_count = 0;
+      serial_link.synced   = 0;
+      memset (&(serial_link.stats), 0, sizeof (serial_link.stats));
 
       /* Set DTR/RTS */
       ioctl (serial_device.file_desc, TIOCMGET, &tiocm);
@@ -205,15 +611,30 @@ int32 serial_open (void)
 
 void serial_close (void)
 {
+  serial_writer_stop ();
+  serial_reader_stop ();
+
   if (serial_device.file_desc > 0)
   {
-    tcdrain (serial_device.file_desc);
+    /* tcdrain () */
+    ioctl (serial_device.file_desc, TCSBRK, 1);
     close (serial_device.file_desc);
 
     serial_device.file_desc = -1;
   }
 }
 
+int32 serial_fd (void)
+{
+  return serial_device.file_desc;
+}
+
+/* Bytes per second, at the rate the driver actually set once the port is open */
+uint32 serial_rate (void)
+{
+  return serial_device.line_rate/SERIAL_BITS_PER_BYTE;
+}
+
 int32 serial_tx (uint32 bytes, uint8 *buffer)
 {
   ssize_t bytes_written = 0;
@@ -240,6 +661,13 @@ int32 serial_tx (uint32 bytes, uint8 *buffer)
       bytes  -= bytes_written;
       buffer += bytes_written;
     }
+    else if ((bytes_written < 0) && (errno == EAGAIN))
+    {
+      /* The port is non-blocking for the reader, wait for room in the driver */
+      struct pollfd poll_fd = {.fd = serial_device.file_desc, .events = POLLOUT};
+
+      poll (&poll_fd, 1, SERIAL_POLL_TIMEOUT);
+    }
     else if ((bytes_written == 0) ||
              ((bytes_written < 0) && (errno != EINTR)))
     {
@@ -286,3 +714,766 @@ int32 serial_rx (uint32 bytes, uint8 *buffer)
   return bytes_read;
 }
 
+/* Sends one link frame around the payload, through the writer's queue when it runs */
+int32 serial_send (uint16 sequence, uint32 timestamp, uint8 *payload, uint32 bytes)
+{
+  int32 status = -1;
+
+  if (bytes <= SERIAL_MAX_PAYLOAD)
+  {
+    serial_frame (&(serial_link.tx), 0, sequence, timestamp, payload, bytes);
+
+    if (serial_link.writer != NULL)
+    {
+      if ((ring_write (serial_link.tx_ring, &(serial_link.tx), 1)) == 1)
+      {
+        os_post_sem (serial_link.tx_sync);
+        status = 1;
+      }
+      else
+      {
+        __atomic_add_fetch (&(serial_link.stats.tx_dropped), 1, __ATOMIC_RELAXED);
+      }
+    }
+    else if ((serial_tx (serial_link.tx.bytes, serial_link.tx.data)) > 0)
+    {
+      __atomic_add_fetch (&(serial_link.stats.sent), 1, __ATOMIC_RELAXED);
+      status = 1;
+    }
+  }
+
+  return status;
+}
+
+/* Returns 1 with the next received frame, 0 once everything received is parsed;
+ * bytes come from the reader's ring when it runs, straight from the port otherwise */
+int32 serial_receive (serial_frame_t *frame)
+{
+  int32 status;
+  ssize_t bytes = 1;
+
+  while (((status = serial_parse (frame)) == 0) && (bytes > 0))
+  {
+    /* The parser keeps less than a frame around, so there is always room */
+    if (serial_link.reader != NULL)
+    {
+      /* Stamped by the read that brought in the last of these bytes, or a later one */
+      serial_link.arrival = __atomic_load_n (&(serial_link.rx_time), __ATOMIC_ACQUIRE);
+      bytes = ring_read (serial_link.ring, &(serial_link.rx[serial_link.rx_count]),
+                         sizeof (serial_link.rx) - serial_link.rx_count);
+    }
+    else
+    {
+      serial_link.arrival = clock_get_count ();
+      bytes = read (serial_device.file_desc, &(serial_link.rx[serial_link.rx_count]),
+                    sizeof (serial_link.rx) - serial_link.rx_count);
+    }
+
+    if (bytes > 0)
+    {
+      serial_link.rx_count += bytes;
+    }
+  }
+
+  return status;
+}
+
+void serial_stats (serial_stats_t *stats)
+{
+  *stats = serial_link.stats;
+  stats->sent         = __atomic_load_n (&(serial_link.stats.sent), __ATOMIC_RELAXED);
+  stats->bytes        = __atomic_load_n (&(serial_link.stats.bytes), __ATOMIC_RELAXED);
+  stats->overflow     = __atomic_load_n (&(serial_link.stats.overflow), __ATOMIC_RELAXED);
+  stats->tx_dropped   = __atomic_load_n (&(serial_link.stats.tx_dropped), __ATOMIC_RELAXED);
+  stats->tx_writes    = __atomic_load_n (&(serial_link.stats.tx_writes), __ATOMIC_RELAXED);
+  stats->tx_delay_max = __atomic_load_n (&(serial_link.stats.tx_delay_max), __ATOMIC_RELAXED);
+  stats->flow_held    = __atomic_load_n (&(serial_link.stats.flow_held), __ATOMIC_RELAXED);
+  stats->tx_delay     = (stats->sent > 0)
+                        ? (__atomic_load_n (&(serial_link.tx_delay_total), __ATOMIC_RELAXED)
+                           / stats->sent) : 0;
+}
+
+/* Waits on the port, moves whatever arrived into the ring and notifies */
+static void * serial_read (void *data)
+{
+  struct pollfd poll_fd = {.fd = serial_device.file_desc, .events = POLLIN};
+  uint8 buffer[256];
+
+  while (__atomic_load_n (&(serial_link.running), __ATOMIC_ACQUIRE))
+  {
+    ssize_t bytes = 0;
+    uint32 total = 0;
+
+    if ((poll (&poll_fd, 1, SERIAL_POLL_TIMEOUT)) <= 0)
+    {
+      continue;
+    }
+
+    while ((bytes = read (serial_device.file_desc, buffer, sizeof (buffer))) > 0)
+    {
+      uint32 written;
+
+      __atomic_store_n (&(serial_link.rx_time), clock_get_count (), __ATOMIC_RELEASE);
+      written = ring_write (serial_link.ring, buffer, bytes);
+
+      /* A stalled consumer loses the newest bytes, the parser resyncs on them */
+      __atomic_add_fetch (&(serial_link.stats.bytes), bytes, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&(serial_link.stats.overflow), bytes - written, __ATOMIC_RELAXED);
+      total += bytes;
+    }
+
+    if (total > 0)
+    {
+      event_notify (serial_link.notifier);
+    }
+    else if ((bytes == 0) || (errno != EAGAIN))
+    {
+      /* Hung up, poll would return at once, don't spin on it */
+      poll (NULL, 0, SERIAL_POLL_TIMEOUT);
+    }
+  }
+
+  return NULL;
+}
+
+/* Reads run on their own thread from now on, the notifier (an event_notifier id)
+ * fires whenever bytes arrive, serial_receive then hands out the frames */
+int32 serial_reader_start (int32 notifier)
+{
+  int32 status = -1;
+
+  if ((serial_link.reader == NULL) && (serial_device.file_desc > 0) &&
+      ((ring_create (1, SERIAL_RING_SIZE, &(serial_link.ring))) > 0))
+  {
+    serial_link.notifier = notifier;
+    serial_link.running  = 1;
+
+    if ((status = os_create_thread (serial_read, OS_THREAD_PRIORITY_MAX,
+                                    NULL, &(serial_link.reader))) < 0)
+    {
+      serial_link.running = 0;
+      serial_link.reader  = NULL;
+    }
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to start serial reader\n");
+    serial_reader_stop ();
+  }
+
+  return status;
+}
+
+void serial_reader_stop (void)
+{
+  if (serial_link.reader != NULL)
+  {
+    __atomic_store_n (&(serial_link.running), 0, __ATOMIC_RELEASE);
+    os_destroy_thread (serial_link.reader);
+    serial_link.reader = NULL;
+  }
+
+  if (serial_link.ring != NULL)
+  {
+    ring_destroy (serial_link.ring);
+    serial_link.ring = NULL;
+  }
+
+  serial_link.notifier = -1;
+}
+
+/* Hands as much of the pending frames to the driver as the queue depth allows, in
+ * one writev, and retires the frames it completed; outq is the driver's queue */
+static uint32 serial_flush (uint32 budget, int32 outq, int32 now)
+{
+  struct iovec iov[SERIAL_TX_SLOTS];
+  uint32 total = 0;
+  uint32 count;
+  ssize_t written;
+
+  for (count = 0; ((count < serial_link.pending_count) && (total < budget)); count++)
+  {
+    serial_tx_slot_t *slot
+      = &(serial_link.pending[(serial_link.pending_head + count) & (SERIAL_TX_SLOTS - 1)]);
+    uint32 offset = (count == 0) ? serial_link.pending_offset : 0;
+    uint32 length = slot->bytes - offset;
+
+    length = (length < (budget - total)) ? length : (budget - total);
+    iov[count].iov_base = &(slot->data[offset]);
+    iov[count].iov_len  = length;
+    total += length;
+  }
+
+  if ((written = writev (serial_device.file_desc, iov, count)) <= 0)
+  {
+    return 0;
+  }
+
+  __atomic_add_fetch (&(serial_link.stats.tx_writes), 1, __ATOMIC_RELAXED);
+  total = written;
+
+  while (total > 0)
+  {
+    serial_tx_slot_t *slot = &(serial_link.pending[serial_link.pending_head]);
+    uint32 left = slot->bytes - serial_link.pending_offset;
+
+    if (total < left)
+    {
+      serial_link.pending_offset += total;
+      break;
+    }
+
+    /* Time in our queue plus the driver's queue ahead of its last byte */
+    outq  += left;
+    total -= left;
+    left   = (now - slot->queued) + ((outq * 1000)/(serial_rate ()));
+    LOG (LOG_MODULE_SERIAL, LOG_DEBUG, "TX queueing %u ms\n", left);
+
+    __atomic_add_fetch (&(serial_link.tx_delay_total), left, __ATOMIC_RELAXED);
+    if (left > serial_link.stats.tx_delay_max)
+    {
+      __atomic_store_n (&(serial_link.stats.tx_delay_max), left, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch (&(serial_link.stats.sent), 1, __ATOMIC_RELAXED);
+
+    serial_link.pending_head   = (serial_link.pending_head + 1) & (SERIAL_TX_SLOTS - 1);
+    serial_link.pending_count--;
+    serial_link.pending_offset = 0;
+  }
+
+  return written;
+}
+
+/* Keeps the driver's queue no deeper than SERIAL_TX_DEPTH of line time, so frames
+ * wait here rather than behind a full tty buffer. Whatever the line should have
+ * drained by now but did not was held back by RTS/CTS flow control */
+static void * serial_write (void *data)
+{
+  uint32 rate = serial_rate ();
+  uint32 depth = (rate * SERIAL_TX_DEPTH)/1000;
+  uint32 last_outq = 0;
+  int32 last_check = clock_get_count ();
+
+  while (__atomic_load_n (&(serial_link.writing), __ATOMIC_ACQUIRE))
+  {
+    int outq = 0;
+    uint32 drained;
+    uint32 expected;
+    int32 now;
+
+    if (serial_link.pending_count == 0)
+    {
+      os_wait_sem (serial_link.tx_sync, SERIAL_POLL_TIMEOUT);
+    }
+
+    while (serial_link.pending_count < SERIAL_TX_SLOTS)
+    {
+      serial_tx_slot_t *tail
+        = &(serial_link.pending[(serial_link.pending_head + serial_link.pending_count)
+                                & (SERIAL_TX_SLOTS - 1)]);
+
+      /* Probe echoes go first, the far end is timing them */
+      if (((ring_read (serial_link.echo_ring, tail, 1)) != 1) &&
+          ((ring_read (serial_link.tx_ring, tail, 1)) != 1))
+      {
+        break;
+      }
+
+      serial_link.pending_count++;
+    }
+
+    if (serial_link.pending_count == 0)
+    {
+      continue;
+    }
+
+    now      = clock_get_count ();
+    drained  = ((now - last_check) * rate)/1000;
+    expected = (last_outq > drained) ? (last_outq - drained) : 0;
+
+    /* Pipes and some USB adapters don't report it, ptys report an empty queue
+     * however much is in it; pacing then relies on the rate alone */
+    if ((ioctl (serial_device.file_desc, TIOCOUTQ, &outq)) < 0)
+    {
+      outq = expected;
+    }
+    else if ((uint32)outq > (expected + ((SERIAL_CLOCK_SLACK * rate)/1000)))
+    {
+      __atomic_add_fetch (&(serial_link.stats.flow_held), ((outq - expected) * 1000)/rate,
+                          __ATOMIC_RELAXED);
+    }
+    else if ((uint32)outq < expected)
+    {
+      outq = expected;
+    }
+
+    last_outq  = outq;
+    last_check = now;
+
+    if ((uint32)outq < depth)
+    {
+      last_outq += serial_flush (depth - outq, outq, now);
+    }
+
+    /* Back when the driver is down to half the depth */
+    poll (NULL, 0, (last_outq > (depth/2)) ? ((((last_outq - (depth/2)) * 1000)/rate) + 1) : 1);
+  }
+
+  return NULL;
+}
+
+/* Frames from serial_send go out on their own thread from now on, coalesced and
+ * paced to the line rate */
+int32 serial_writer_start (void)
+{
+  int32 status = -1;
+
+  serial_link.pending_head   = 0;
+  serial_link.pending_count  = 0;
+  serial_link.pending_offset = 0;
+
+  if ((serial_link.writer == NULL) && (serial_device.file_desc > 0) &&
+      ((ring_create (sizeof (serial_tx_slot_t), SERIAL_TX_SLOTS, &(serial_link.tx_ring))) > 0) &&
+      ((ring_create (sizeof (serial_tx_slot_t), SERIAL_TX_SLOTS, &(serial_link.echo_ring))) > 0) &&
+      ((os_create_sem (&(serial_link.tx_sync))) > 0))
+  {
+    serial_link.writing = 1;
+
+    if ((status = os_create_thread (serial_write, OS_THREAD_PRIORITY_MAX,
+                                    NULL, &(serial_link.writer))) < 0)
+    {
+      serial_link.writing = 0;
+      serial_link.writer  = NULL;
+    }
+  }
+
+  if (status < 0)
+  {
+    printf ("Unable to start serial writer\n");
+    serial_writer_stop ();
+  }
+
+  return status;
+}
+
+/* Frames still queued are dropped */
+void serial_writer_stop (void)
+{
+  if (serial_link.writer != NULL)
+  {
+    __atomic_store_n (&(serial_link.writing), 0, __ATOMIC_RELEASE);
+    os_post_sem (serial_link.tx_sync);
+    os_destroy_thread (serial_link.writer);
+    serial_link.writer = NULL;
+  }
+
+  if (serial_link.tx_sync != NULL)
+  {
+    os_destroy_sem (serial_link.tx_sync);
+    serial_link.tx_sync = NULL;
+  }
+
+  if (serial_link.tx_ring != NULL)
+  {
+    ring_destroy (serial_link.tx_ring);
+    serial_link.tx_ring = NULL;
+  }
+
+  if (serial_link.echo_ring != NULL)
+  {
+    ring_destroy (serial_link.echo_ring);
+    serial_link.echo_ring = NULL;
+  }
+}
+
+/* Waits up to timeout millisec. for the port, parses what came in and returns
+ * the poll events; frames other than probes are dropped */
+static int32 serial_probe_wait (int16 events, int32 timeout)
+{
+  static serial_frame_t frame;
+  struct pollfd poll_fd = {.fd = serial_device.file_desc, .events = (events | POLLIN)};
+
+  if ((poll (&poll_fd, 1, timeout)) <= 0)
+  {
+    return 0;
+  }
+
+  while ((serial_receive (&frame)) > 0)
+  {
+  }
+
+  return poll_fd.revents;
+}
+
+/* Measures the link against the far end (or a loopback jumper) for about duration
+ * millisec., before the reader and writer start: the round trip of short frames
+ * sent one at a time, then the bytes per second coming back with frames sent back
+ * to back, which is what the link carries with traffic both ways */
+int32 serial_probe (uint32 duration, serial_probe_t *probe)
+{
+  serial_probing_t *probing = &(serial_link.probing);
+  uint8 payload[SERIAL_PROBE_PAYLOAD];
+  uint16 sequence;
+  uint32 queued = 0;
+  uint32 elapsed;
+  int32 start;
+  int32 status = -1;
+
+  memset (probe, 0, sizeof (serial_probe_t));
+
+  if ((serial_device.file_desc <= 0) || (serial_link.reader != NULL) ||
+      (serial_link.writer != NULL))
+  {
+    printf ("Unable to probe serial link\n");
+    return status;
+  }
+
+  memset (probing, 0, sizeof (serial_probing_t));
+  probing->nonce   = (((uint32)getpid ()) << 16) ^ (clock_get_count ()) ^ 1;
+  probing->rtt_min = 0xFFFFFFFF;
+  memset (payload, 0x55, sizeof (payload));
+  payload[0] = probing->nonce >> 24;
+  payload[1] = probing->nonce >> 16;
+  payload[2] = probing->nonce >> 8;
+  payload[3] = probing->nonce;
+
+  /* Round trip, nothing queued ahead of each frame */
+  for (sequence = 0; sequence < SERIAL_PROBE_PINGS; sequence++)
+  {
+    uint32 returned = probing->returned;
+
+    start = clock_get_count ();
+    serial_frame (&(serial_link.tx), SERIAL_FLAG_PROBE, sequence, start, payload,
+                  SERIAL_PROBE_NONCE);
+    serial_tx (serial_link.tx.bytes, serial_link.tx.data);
+    probe->sent++;
+
+    while ((probing->returned == returned) &&
+           (((clock_get_count ()) - start) < SERIAL_PROBE_TIMEOUT))
+    {
+      serial_probe_wait (0, 1);
+    }
+
+    /* Nobody there, don't hold up the start any longer */
+    if (probing->returned == 0)
+    {
+      probing->nonce = 0;
+      printf ("No answer to serial link probe\n");
+
+      return status;
+    }
+  }
+
+  probe->rtt     = probing->rtt_total/probing->returned;
+  probe->rtt_min = probing->rtt_min;
+  probe->rtt_max = probing->rtt_max;
+
+  probe->returned   = probing->returned;
+  probing->returned = 0;
+  probing->bytes    = 0;
+
+  /* Throughput, a new frame whenever the driver's queue runs low; no faster than
+   * the line rate either, for drivers that queue far more than they report */
+  start = clock_get_count ();
+  while ((elapsed = (clock_get_count ()) - start) < duration)
+  {
+    uint32 budget = ((elapsed * (serial_rate ()))/1000) + SERIAL_MAX_FRAME;
+
+    if ((queued < budget) && ((serial_probe_wait (POLLOUT, 1)) & POLLOUT))
+    {
+      serial_frame (&(serial_link.tx), SERIAL_FLAG_PROBE, sequence++, clock_get_count (),
+                    payload, sizeof (payload));
+      serial_tx (serial_link.tx.bytes, serial_link.tx.data);
+      queued += serial_link.tx.bytes;
+      probe->sent++;
+    }
+    else if (queued >= budget)
+    {
+      serial_probe_wait (0, 1);
+    }
+  }
+
+  /* Then collect the echoes still on their way */
+  start = clock_get_count ();
+  while ((probe->returned + probing->returned) < probe->sent)
+  {
+    uint32 returned = probing->returned;
+
+    serial_probe_wait (0, 1);
+
+    if (probing->returned != returned)
+    {
+      start = clock_get_count ();
+    }
+    else if (((clock_get_count ()) - start) >= SERIAL_PROBE_TIMEOUT)
+    {
+      break;
+    }
+  }
+
+  if (probing->last != probing->first)
+  {
+    uint32 elapsed = probing->last - probing->first;
+
+    probe->throughput = ((probing->bytes/elapsed) * 1000)
+                        + (((probing->bytes % elapsed) * 1000)/elapsed);
+  }
+
+  probe->returned += probing->returned;
+  probing->nonce   = 0;
+
+  return 1;
+}
+
+#ifdef UTIL_SERIAL_TEST
+
+#include <sys/socket.h>
+
+#define SERIAL_TEST_FRAMES  (200)
+
+static int32 serial_test_looping = 0;
+static int32 serial_test_answered = 0;
+
+/* Far end of the probe test, a jumper across TX and RX that also sends a probe
+ * of its own, as a second unit starting up at the same time would */
+static void * serial_test_loop (void *data)
+{
+  static serial_tx_slot_t slot;
+  struct pollfd poll_fd = {.fd = *((int *)data), .events = POLLIN};
+  uint8 nonce[SERIAL_PROBE_NONCE] = {0xFE, 0xED, 0xF0, 0x0D};
+  uint8 buffer[1024];
+
+  serial_frame (&slot, SERIAL_FLAG_PROBE, 0, 0, nonce, sizeof (nonce));
+  write (poll_fd.fd, slot.data, slot.bytes);
+
+  while (__atomic_load_n (&serial_test_looping, __ATOMIC_ACQUIRE))
+  {
+    ssize_t looped;
+
+    if (((poll (&poll_fd, 1, 10)) > 0) &&
+        ((looped = read (poll_fd.fd, buffer, sizeof (buffer))) > 0))
+    {
+      ssize_t index;
+
+      /* Our probe's nonce coming back is the answer to it */
+      for (index = 0; (index + SERIAL_PROBE_NONCE) <= looped; index++)
+      {
+        if ((memcmp (&(buffer[index]), nonce, sizeof (nonce))) == 0)
+        {
+          serial_test_answered = 1;
+        }
+      }
+
+      write (poll_fd.fd, buffer, looped);
+    }
+  }
+
+  return NULL;
+}
+
+/* Frames go out through one pipe, get damaged and come back through another */
+int main (void)
+{
+  static uint8 stream[SERIAL_TEST_FRAMES * SERIAL_MAX_FRAME];
+  serial_frame_t frame;
+  serial_stats_t stats;
+  uint8 payload[SERIAL_MAX_PAYLOAD];
+  int out[2];
+  int in[2];
+  uint32 length = 0;
+  uint32 count;
+  uint32 pass;
+  int failures = 0;
+
+  failures += ((serial_crc ((uint8 *)"123456789", 9)) != 0x29B1);
+
+  for (count = 0; count < SERIAL_TEST_FRAMES; count++)
+  {
+    uint32 bytes = 1 + ((count * 37) % 200);
+    ssize_t got;
+
+    memset (payload, count, bytes);
+    pipe (out);
+    serial_device.file_desc = out[1];
+    serial_send (count, count * 60, payload, bytes);
+    got = read (out[0], &(stream[length]), sizeof (stream) - length);
+    close (out[0]);
+    close (out[1]);
+
+    /* Every 10th frame loses a byte, every 20th gets one flipped, or gains a stray one */
+    if ((count % 10) == 8)
+    {
+      memmove (&(stream[length + 3]), &(stream[length + 4]), got - 4);
+      got--;
+    }
+    else if ((count % 20) == 5)
+    {
+      stream[length + SERIAL_HEADER_SIZE] ^= 0x40;
+    }
+    else if ((count % 20) == 15)
+    {
+      memmove (&(stream[length + 1]), &(stream[length]), got);
+      stream[length] = SERIAL_SYNC_0;
+      got++;
+    }
+
+    length += got;
+  }
+
+  /* Straight from the port first, then through the reader thread and its ring */
+  for (pass = 0; pass < 2; pass++)
+  {
+    uint32 received = 0;
+    int32 idle = 0;
+
+    pipe (in);
+    fcntl (in[0], F_SETFL, O_NONBLOCK);
+    serial_device.file_desc = in[0];
+    serial_link.rx_count = 0;
+    serial_link.synced   = 0;
+    memset (&(serial_link.stats), 0, sizeof (serial_link.stats));
+
+    if (pass > 0)
+    {
+      failures += ((serial_reader_start (-1)) < 0);
+    }
+
+    /* Dribble it in so frames straddle reads */
+    for (count = 0; ((count < length) || (idle < 50)); count += 13)
+    {
+      if (count < length)
+      {
+        write (in[1], &(stream[count]), ((length - count) < 13) ? (length - count) : 13);
+
+        /* About line rate, a pipe would outrun the ring */
+        if (pass > 0)
+        {
+          usleep (100);
+        }
+      }
+      else
+      {
+        /* Let the reader catch up with the tail */
+        poll (NULL, 0, 1);
+        idle++;
+      }
+
+      while ((serial_receive (&frame)) > 0)
+      {
+        uint32 expected = 1 + ((frame.sequence * 37) % 200);
+
+        failures += ((frame.bytes != expected) || (frame.timestamp != (frame.sequence * 60u)) ||
+                     (frame.payload[0] != (uint8)frame.sequence) ||
+                     (frame.payload[frame.bytes - 1] != (uint8)frame.sequence));
+        received++;
+      }
+    }
+
+    serial_reader_stop ();
+
+    /* Only the damaged frames may be missing, the stream resyncs after each */
+    serial_stats (&stats);
+    failures += (received != (SERIAL_TEST_FRAMES - (SERIAL_TEST_FRAMES/10)
+                              - (SERIAL_TEST_FRAMES/20)));
+    failures += (stats.lost != (SERIAL_TEST_FRAMES/10) + (SERIAL_TEST_FRAMES/20));
+    failures += ((pass > 0) && ((stats.bytes != length) || (stats.overflow != 0)));
+    printf ("Serial %s: %u of %u frames, %u lost, %u header and %u CRC errors, "
+            "%u bytes skipped\n", (pass > 0) ? "reader" : "direct", received,
+            SERIAL_TEST_FRAMES, stats.lost, stats.header_errors, stats.crc_errors,
+            stats.skipped);
+
+    close (in[0]);
+    close (in[1]);
+  }
+
+  /* A burst of short frames through the writer comes out whole, in fewer writes */
+  if ((socketpair (AF_UNIX, SOCK_STREAM, 0, in)) == 0)
+  {
+    uint32 received = 0;
+    int32 start = clock_get_count ();
+
+    fcntl (in[0], F_SETFL, O_NONBLOCK);
+    fcntl (in[1], F_SETFL, O_NONBLOCK);
+    serial_device.file_desc = in[0];
+    memset (&(serial_link.stats), 0, sizeof (serial_link.stats));
+    serial_link.tx_delay_total = 0;
+    failures += ((serial_writer_start ()) < 0);
+
+    for (count = 0; count < SERIAL_TX_SLOTS; count++)
+    {
+      uint32 bytes = 1 + ((count * 7) % 30);
+
+      memset (payload, count, bytes);
+      failures += ((serial_send (count, count * 60, payload, bytes)) < 0);
+    }
+
+    serial_link.rx_count = 0;
+    serial_link.synced   = 0;
+
+    /* The far end loops everything back, like a jumper across TX and RX */
+    while ((received < SERIAL_TX_SLOTS) && (((clock_get_count ()) - start) < 2000))
+    {
+      ssize_t looped = read (in[1], stream, sizeof (stream));
+
+      if (looped > 0)
+      {
+        write (in[1], stream, looped);
+      }
+
+      while ((serial_receive (&frame)) > 0)
+      {
+        failures += ((frame.sequence != received) ||
+                     (frame.bytes != (1 + ((frame.sequence * 7) % 30))) ||
+                     (frame.payload[frame.bytes - 1] != (uint8)frame.sequence));
+        received++;
+      }
+
+      poll (NULL, 0, 1);
+    }
+
+    serial_writer_stop ();
+    serial_stats (&stats);
+    failures += ((received != SERIAL_TX_SLOTS) || (stats.sent != SERIAL_TX_SLOTS) ||
+                 (stats.tx_writes >= SERIAL_TX_SLOTS));
+    printf ("Serial writer: %u frames in %u writes over %d ms, queueing %u ms mean, "
+            "%u ms max\n", received, stats.tx_writes, (clock_get_count ()) - start,
+            stats.tx_delay, stats.tx_delay_max);
+
+    close (in[0]);
+    close (in[1]);
+  }
+
+  /* Every probe comes back, and the far end's gets answered without the writer */
+  if ((socketpair (AF_UNIX, SOCK_STREAM, 0, in)) == 0)
+  {
+    serial_probe_t probe;
+    void *loop = NULL;
+
+    fcntl (in[0], F_SETFL, O_NONBLOCK);
+    serial_device.file_desc = in[0];
+    serial_link.rx_count = 0;
+    serial_test_looping  = 1;
+    failures += ((os_create_thread (serial_test_loop, OS_THREAD_PRIORITY_NORMAL,
+                                    &(in[1]), &loop)) < 0);
+    failures += ((serial_probe (200, &probe)) < 0);
+    __atomic_store_n (&serial_test_looping, 0, __ATOMIC_RELEASE);
+    os_destroy_thread (loop);
+
+    failures += ((probe.returned != probe.sent) || (probe.sent <= SERIAL_PROBE_PINGS) ||
+                 (probe.rtt_max >= SERIAL_PROBE_TIMEOUT) || (probe.throughput == 0) ||
+                 (!serial_test_answered));
+    printf ("Serial probe: %u of %u returned, round trip %u ms (%u to %u ms), "
+            "%u bytes/s, far end %s\n", probe.returned, probe.sent, probe.rtt, probe.rtt_min,
+            probe.rtt_max, probe.throughput, serial_test_answered ? "answered" : "unanswered");
+
+    close (in[0]);
+    close (in[1]);
+  }
+
+  printf ("Serial: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+  return failures;
+}
+
+#endif
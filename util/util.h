@@ -26,9 +26,71 @@ extern int32 os_create_thread (void * (*start_function)(void *), uint8 priority,
 
 extern int32 os_destroy_thread (void *handle);
 
+extern void os_alloc_guard (int32 enable);
+
 /* Serial API */
+
+/* Largest payload of a link frame and the bytes framing adds to it */
+#define SERIAL_MAX_PAYLOAD     (1000)
+#define SERIAL_FRAME_OVERHEAD  (14)
+
+/* Received frame, arrival is the clock_get_count time its last bytes were read */
+typedef struct
+{
+  uint16  sequence;
+  uint32  timestamp;
+  int32   arrival;
+  uint32  bytes;
+  uint8   payload[SERIAL_MAX_PAYLOAD];
+} serial_frame_t;
+
+/* Link counters since the port was opened, overflow counts bytes the reader's
+ * ring had no room for. Transmit side: frames the writer's queue had no room
+ * for, writev calls, queueing delay per frame until its last byte is on the
+ * line and the time flow control held the line, all in millisec. */
+typedef struct
+{
+  uint32  sent;
+  uint32  tx_dropped;
+  uint32  tx_writes;
+  uint32  tx_delay;
+  uint32  tx_delay_max;
+  uint32  flow_held;
+  uint32  bytes;
+  uint32  overflow;
+  uint32  frames;
+  uint32  lost;
+  uint32  header_errors;
+  uint32  crc_errors;
+  uint32  skipped;
+} serial_stats_t;
+
+/* Line rate in bits per second, and the driver's low latency mode (on by default) */
+enum
+{
+  SERIAL_OPTION_BAUD,
+  SERIAL_OPTION_LOW_LATENCY,
+  NUM_SERIAL_OPTIONS
+};
+
+/* Link probe, probe frames sent and returned, round trip of a short frame in
+ * millisec. and bytes per second that came back with frames sent back to back */
+typedef struct
+{
+  uint32  sent;
+  uint32  returned;
+  uint32  rtt;
+  uint32  rtt_min;
+  uint32  rtt_max;
+  uint32  throughput;
+} serial_probe_t;
+
+extern int32 serial_option (int32 option, int32 value);
+
 extern int32 serial_init (void);
 
+extern int32 serial_set_device (char *device);
+
 extern void serial_deinit (void);
 
 extern int32 serial_open (void);
@@ -39,7 +101,71 @@ extern int32 serial_tx (uint32 bytes, uint8 *buffer);
 
 extern int32 serial_rx (uint32 bytes, uint8 *buffer);
 
+extern int32 serial_send (uint16 sequence, uint32 timestamp, uint8 *payload, uint32 bytes);
+
+extern int32 serial_receive (serial_frame_t *frame);
+
+extern void serial_stats (serial_stats_t *stats);
+
+extern int32 serial_reader_start (int32 notifier);
+
+extern void serial_reader_stop (void);
+
+extern int32 serial_writer_start (void);
+
+extern void serial_writer_stop (void);
+
+extern int32 serial_probe (uint32 duration, serial_probe_t *probe);
+
+extern uint32 serial_rate (void);
+
+extern int32 serial_fd (void);
+
 /* Audio API */
+#define AUDIO_MAX_FRAMES  (6)
+
+enum
+{
+  AUDIO_OPTION_MMAP,
+  AUDIO_OPTION_DUPLEX,
+  AUDIO_OPTION_LATENCY,
+  AUDIO_OPTION_THREAD,
+  AUDIO_OPTION_BACKEND,
+  AUDIO_OPTION_PACED,
+  NUM_AUDIO_OPTIONS
+};
+
+enum
+{
+  AUDIO_BACKEND_ALSA,
+  AUDIO_BACKEND_WAV,
+  AUDIO_BACKEND_SYNTH,
+  NUM_AUDIO_BACKENDS
+};
+
+enum
+{
+  AUDIO_LATENCY_LOW,
+  AUDIO_LATENCY_BALANCED,
+  AUDIO_LATENCY_ROBUST,
+  NUM_AUDIO_LATENCY
+};
+
+/* Stream health since start, times in microsec. */
+typedef struct
+{
+  uint32  playback_underruns;
+  uint32  capture_overruns;
+  uint32  suspends;
+  uint32  recovery_time;
+  uint32  recovery_max;
+  uint32  ring_overflows;
+} audio_health_t;
+
+extern int32 audio_option (int32 option, int32 value);
+
+extern int32 audio_set_device (int8 *playback_name, int8 *capture_name);
+
 extern int32 audio_init (uint8 channels, uint32 frame_duration, uint32 rate);
 
 extern int32 audio_deinit (void);
@@ -52,6 +178,149 @@ extern int32 audio_playback_pause (int32 pause);
 
 extern int32 audio_capture_pause (int32 pause);
 
+extern int32 audio_playback_delay (void);
+
+extern int32 audio_latency (void);
+
+extern void audio_health (audio_health_t *health);
+
+/* Resample API */
+enum
+{
+  RESAMPLE_DECIMATE,
+  RESAMPLE_INTERPOLATE
+};
+
+extern int32 resample_create (int32 direction, uint32 ratio, uint8 channels,
+                              uint8 device_channels, uint32 block, void **handle);
+
+extern int32 resample_destroy (void *handle);
+
+extern uint32 resample_delay (void *handle);
+
+extern int32 resample_process (void *handle, int16 *input, uint32 frames, uint8 input_channels,
+                               int16 *output, uint8 output_channels);
+
+/* PCM API, kernels picked at startup from the CPU's vector extensions */
+#define PCM_GAIN_SHIFT  (12)
+
+enum
+{
+  PCM_PATH_SCALAR,
+  PCM_PATH_SSE2,
+  PCM_PATH_AVX2,
+  PCM_PATH_NEON,
+  NUM_PCM_PATHS
+};
+
+extern void pcm_init (void);
+
+extern int32 pcm_supported (int32 path);
+
+extern int32 pcm_select (int32 path);
+
+extern const int8 * pcm_path (void);
+
+extern void pcm_deinterleave (int16 *stereo, int16 *left, int16 *right, uint32 frames);
+
+extern void pcm_interleave (int16 *left, int16 *right, int16 *stereo, uint32 frames);
+
+extern void pcm_downmix (int16 *stereo, int16 *mono, uint32 frames);
+
+extern void pcm_gain (int16 *buffer, uint32 samples, int16 gain);
+
+extern void pcm_saturate (int32 *input, int16 *output, uint32 samples);
+
+extern int32 pcm_dot (int16 *a, int16 *b, uint32 count);
+
+/* Ring API, lock-free single producer/single consumer */
+extern int32 ring_create (uint32 element_size, uint32 elements, void **handle);
+
+extern int32 ring_destroy (void *handle);
+
+extern void ring_reset (void *handle);
+
+extern uint32 ring_count (void *handle);
+
+extern uint32 ring_space (void *handle);
+
+extern uint32 ring_write (void *handle, void *elements, uint32 count);
+
+extern uint32 ring_read (void *handle, void *elements, uint32 count);
+
+/* Event API, epoll based reactor */
+enum
+{
+  EVENT_READ     = (0x1 << 0),
+  EVENT_WRITE    = (0x1 << 1),
+  EVENT_PRIORITY = (0x1 << 2),
+  EVENT_ERROR    = (0x1 << 3)
+};
+
+extern int32 event_create (void **handle);
+
+extern int32 event_destroy (void *handle);
+
+extern int32 event_add (void *handle, int32 fd, uint32 events,
+                        void (*callback)(void *, uint32), void *data);
+
+extern int32 event_remove (void *handle, int32 fd);
+
+extern int32 event_timer (void *handle, int32 millisec, int32 periodic,
+                          void (*callback)(void *, uint32), void *data);
+
+extern int32 event_notifier (void *handle, void (*callback)(void *, uint32), void *data);
+
+extern int32 event_notify (int32 id);
+
+extern int32 event_dispatch (void *handle, int32 timeout);
+
+/* Log API, real-time safe records formatted by a background thread */
+#define LOG_MAX_ARGS  (6)
+
+enum
+{
+  LOG_ERROR,
+  LOG_WARNING,
+  LOG_INFO,
+  LOG_DEBUG,
+  NUM_LOG_LEVELS
+};
+
+enum
+{
+  LOG_MODULE_MAIN,
+  LOG_MODULE_STATUS,
+  LOG_MODULE_AUDIO,
+  LOG_MODULE_CODEC,
+  LOG_MODULE_SERIAL,
+  NUM_LOG_MODULES
+};
+
+/* Integer arguments only, format must be a string literal */
+#define LOG(module, level, format, ...)                                     \
+  do                                                                        \
+  {                                                                         \
+    if (log_enabled (module, level))                                        \
+    {                                                                       \
+      int32 log_args[] = {0, ##__VA_ARGS__};                                \
+      log_write (module, format, &(log_args[1]),                            \
+                 (sizeof (log_args)/sizeof (int32)) - 1);                   \
+    }                                                                       \
+  } while (0)
+
+extern int32 log_init (void);
+
+extern void log_deinit (void);
+
+extern void log_level (int32 module, int32 level);
+
+extern int32 log_enabled (int32 module, int32 level);
+
+extern uint32 log_dropped (void);
+
+extern void log_write (int32 module, const int8 *format, int32 *args, uint32 count);
+
 /* Timer API */
 typedef struct
 {
@@ -87,6 +356,8 @@ extern int32 input_init (void);
 
 extern int32 input_deinit (void);
 
+extern int32 input_fd (uint32 *events);
+
 extern uint32 input_read (void);
 
 /* String/Binary API */
@@ -0,0 +1,231 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "util.h"
+#include "vad.h"
+
+/* Analysis block in millisec., decisions are per frame; frames shorter than a
+ * block fill it across calls and go by the last block done */
+#define VAD_BLOCK_DURATION  (10)
+
+/* Frames keep counting as speech this long after the last active block */
+#define VAD_HANGOVER_TIME   (300)
+
+/* Largest block, 10 ms at 48 kHz */
+#define VAD_MAX_BLOCK       (480)
+
+/* Mean square energy is kept scaled down by 2^VAD_ENERGY_SHIFT */
+#define VAD_ENERGY_SHIFT    (8)
+
+/* Nothing below -55 dBFS is speech */
+#define VAD_MIN_ENERGY      (13)
+
+/* Speech is 9 dB over the noise floor, or 3 dB with fricative-like zero
+ * crossings (in 1/256th of the block's samples) */
+#define VAD_SPEECH_RATIO    (8)
+#define VAD_NOISE_RATIO     (2)
+#define VAD_ZCR_FRICATIVE   (77)
+
+/* Floor tracks down fast and creeps up at about 4 dB/s */
+#define VAD_FLOOR_DOWN      (2)
+#define VAD_FLOOR_UP        (6)
+
+/* Local structures */
+typedef struct
+{
+  uint8   channels;
+  uint32  block;
+  uint32  frame;
+  int16   mono[VAD_MAX_BLOCK];
+  uint32  filled;
+  int32   speech;
+  uint32  hangover;
+  uint32  hangover_frames;
+  uint32  floor;
+  int16   last;
+  uint32  active;
+  uint32  total;
+} vad_t;
+
+/* File scope global variables */
+static vad_t vad =
+{
+  .channels        = 1,
+  .block           = 0,
+  .frame           = 0,
+  .filled          = 0,
+  .speech          = 0,
+  .hangover        = 0,
+  .hangover_frames = 0,
+  .floor           = VAD_MIN_ENERGY,
+  .last            = 0,
+  .active          = 0,
+  .total           = 0
+};
+
+
+/* Scaled energy and sign changes of a mono block, branch free so the
+ * compiler vectorizes both loops */
+static inline uint32 vad_energy (const int16 * __restrict sample, uint32 count)
+{
+  uint32 index;
+  uint32 sum = 0;
+
+  for (index = 0; index < count; index++)
+  {
+    sum += ((uint32)((int32)sample[index] * (int32)sample[index])) >> VAD_ENERGY_SHIFT;
+  }
+
+  return sum/count;
+}
+
+static inline uint32 vad_crossings (const int16 * __restrict sample, uint32 count)
+{
+  uint32 index;
+  uint32 crossings = 0;
+
+  for (index = 1; index < count; index++)
+  {
+    crossings += ((uint16)(sample[index] ^ sample[index - 1])) >> 15;
+  }
+
+  return crossings;
+}
+
+static int32 vad_block (const int16 *sample, uint32 count)
+{
+  uint32 energy = vad_energy (sample, count);
+  uint32 crossings = vad_crossings (sample, count) + ((uint16)(sample[0] ^ vad.last) >> 15);
+  int32 speech;
+
+  vad.last = sample[count - 1];
+
+  speech = (energy >= VAD_MIN_ENERGY) &&
+           ((energy > (vad.floor * VAD_SPEECH_RATIO)) ||
+            ((energy > (vad.floor * VAD_NOISE_RATIO)) &&
+             (((crossings << 8)/count) > VAD_ZCR_FRICATIVE)));
+
+  /* Noise floor follows quiet blocks down quickly, drifts up otherwise */
+  if (energy < vad.floor)
+  {
+    vad.floor -= (vad.floor - energy) >> VAD_FLOOR_DOWN;
+  }
+  else if (!speech)
+  {
+    vad.floor += (vad.floor >> VAD_FLOOR_UP) + 1;
+  }
+
+  return speech;
+}
+
+int32 vad_init (uint8 channels, uint32 frame_duration, uint32 rate)
+{
+  int32 status = -1;
+
+  if ((channels > 0) && (frame_duration > 0) && (((rate * frame_duration)/1000) > 0) &&
+      (((rate * VAD_BLOCK_DURATION)/1000) <= VAD_MAX_BLOCK))
+  {
+    vad.channels        = channels;
+    vad.block           = (rate * VAD_BLOCK_DURATION)/1000;
+    vad.frame           = (rate * frame_duration)/1000;
+    vad.filled          = 0;
+    vad.speech          = 0;
+    vad.hangover_frames = (VAD_HANGOVER_TIME + frame_duration - 1)/frame_duration;
+    vad.hangover        = 0;
+    vad.floor           = VAD_MIN_ENERGY;
+    vad.last            = 0;
+    vad.active          = 0;
+    vad.total           = 0;
+    status = 1;
+  }
+  else
+  {
+    printf ("Unable to set up voice activity detection\n");
+  }
+
+  return status;
+}
+
+int32 vad_deinit (void)
+{
+  vad.block = 0;
+  vad.frame = 0;
+
+  return 1;
+}
+
+/* 1 when the frames carry speech (or are within the hangover), 0 when silent */
+int32 vad_process (int16 *audio_buffer, uint8 frames)
+{
+  uint32 samples = vad.frame * frames;
+  int32 speech = 0;
+  int32 decided = 0;
+  uint32 count;
+
+  while (samples > 0)
+  {
+    int16 *mono = &(vad.mono[vad.filled]);
+    uint32 chunk = vad.block - vad.filled;
+
+    chunk = (chunk < samples) ? chunk : samples;
+
+    /* First channel only, deinterleaved so the kernels stay unit stride */
+    if (vad.channels == 1)
+    {
+      memcpy (mono, audio_buffer, chunk * sizeof (int16));
+    }
+    else if (vad.channels == 2)
+    {
+      pcm_deinterleave (audio_buffer, mono, NULL, chunk);
+    }
+    else
+    {
+      for (count = 0; count < chunk; count++)
+      {
+        mono[count] = audio_buffer[count * vad.channels];
+      }
+    }
+
+    audio_buffer += chunk * vad.channels;
+    samples      -= chunk;
+    vad.filled   += chunk;
+
+    if (vad.filled == vad.block)
+    {
+      vad.speech  = vad_block (vad.mono, vad.block);
+      speech     |= vad.speech;
+      decided     = 1;
+      vad.filled  = 0;
+    }
+  }
+
+  if (!decided)
+  {
+    speech = vad.speech;
+  }
+
+  if (speech)
+  {
+    vad.hangover = vad.hangover_frames;
+  }
+  else if (vad.hangover > 0)
+  {
+    /* Each call covers frames frames of the hangover */
+    vad.hangover = (vad.hangover > frames) ? (vad.hangover - frames) : 0;
+    speech = 1;
+  }
+
+  vad.active += (speech) ? frames : 0;
+  vad.total  += frames;
+
+  return speech;
+}
+
+/* Share of frames sent so far, in percent */
+uint32 vad_duty (void)
+{
+  return (vad.total > 0) ? ((vad.active * 100)/vad.total) : 100;
+}
+
@@ -0,0 +1,15 @@
+#ifndef __VAD_H__
+#define __VAD_H__
+
+#include "types.h"
+
+extern int32 vad_init (uint8 channels, uint32 frame_duration, uint32 rate);
+
+extern int32 vad_deinit (void);
+
+extern int32 vad_process (int16 *audio_buffer, uint8 frames);
+
+extern uint32 vad_duty (void);
+
+#endif
+